@@ -0,0 +1,606 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <sys/mman.h>
+#endif
+#endif
+#endif
+
+#include "aio.h"
+#include "file_utils.h"
+
+// io_uring transfers at most this many bytes per submission
+#define MAX_CHUNK ((size_t)1 << 30)
+
+struct aio_request
+{
+	struct aio_request *next; // queue of the thread engine
+	char *name;
+	int fd;
+	bool is_write;
+	unsigned char *data;
+	size_t size;
+	size_t done; // bytes transferred so far
+	int rc;
+	bool complete;
+	struct iovec iov;
+};
+
+struct aio
+{
+	enum aio_engine engine;
+
+	// thread engine
+	pthread_mutex_t lock;
+	pthread_cond_t work; // signaled on new requests
+	pthread_cond_t done; // broadcast on completions
+	struct aio_request *first;
+	struct aio_request *last;
+	pthread_t *workers;
+	unsigned worker_count;
+	bool stop;
+
+#ifdef HAVE_IO_URING
+	int ring_fd;
+	unsigned inflight;
+	unsigned entries;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+#endif
+};
+
+static void request_fail(struct aio_request *req, const char *what)
+{
+	print_error();
+	fprintf(stderr, "Cannot %s file '%s'.\n", what, req->name);
+	req->rc = 1;
+}
+
+// The thread engine
+
+static void transfer(struct aio_request *req)
+{
+	while (req->done < req->size && req->rc == 0) {
+		ssize_t count;
+		if (req->is_write)
+			count = pwrite(req->fd, req->data + req->done, req->size - req->done, req->done);
+		else
+			count = pread(req->fd, req->data + req->done, req->size - req->done, req->done);
+
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			request_fail(req, req->is_write ? "write" : "read");
+		else
+			req->done += count;
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct aio *ptr = arg;
+	pthread_mutex_lock(&(ptr->lock));
+	while (1) {
+		while (ptr->first == NULL && !ptr->stop)
+			pthread_cond_wait(&(ptr->work), &(ptr->lock));
+
+		if (ptr->first == NULL)
+			break;
+
+		struct aio_request *req = ptr->first;
+		ptr->first = req->next;
+		if (ptr->first == NULL)
+			ptr->last = NULL;
+
+		pthread_mutex_unlock(&(ptr->lock));
+		transfer(req);
+		pthread_mutex_lock(&(ptr->lock));
+
+		req->complete = true;
+		pthread_cond_broadcast(&(ptr->done));
+	}
+	pthread_mutex_unlock(&(ptr->lock));
+	return NULL;
+}
+
+static int threads_new(struct aio *ptr, unsigned depth)
+{
+	ptr->first = NULL;
+	ptr->last = NULL;
+	ptr->stop = false;
+	ptr->worker_count = 0;
+	ptr->workers = malloc(sizeof(pthread_t) * depth);
+	if (ptr->workers == NULL)
+		abort();
+
+	for (; ptr->worker_count < depth; ptr->worker_count++) {
+		if (pthread_create(&(ptr->workers[ptr->worker_count]), NULL, worker, ptr) != 0)
+			break;
+	}
+	return (ptr->worker_count == 0);
+}
+
+static void threads_free(struct aio *ptr)
+{
+	pthread_mutex_lock(&(ptr->lock));
+	ptr->stop = true;
+	pthread_cond_broadcast(&(ptr->work));
+	pthread_mutex_unlock(&(ptr->lock));
+
+	for (unsigned i = 0; i < ptr->worker_count; i++)
+		pthread_join(ptr->workers[i], NULL);
+
+	free(ptr->workers);
+}
+
+static void threads_submit(struct aio *ptr, struct aio_request *req)
+{
+	pthread_mutex_lock(&(ptr->lock));
+	req->next = NULL;
+	if (ptr->last == NULL)
+		ptr->first = req;
+	else
+		ptr->last->next = req;
+	ptr->last = req;
+	pthread_cond_signal(&(ptr->work));
+	pthread_mutex_unlock(&(ptr->lock));
+}
+
+static void threads_wait(struct aio *ptr, struct aio_request *req)
+{
+	pthread_mutex_lock(&(ptr->lock));
+	while (!req->complete)
+		pthread_cond_wait(&(ptr->done), &(ptr->lock));
+	pthread_mutex_unlock(&(ptr->lock));
+}
+
+// The io_uring engine, through the raw system calls
+
+#ifdef HAVE_IO_URING
+static int uring_enter(struct aio *ptr, unsigned submit, unsigned wait)
+{
+	unsigned flags = (wait > 0) ? IORING_ENTER_GETEVENTS : 0;
+	long ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, ptr->ring_fd, submit, wait, flags, NULL, _NSIG / 8);
+	} while (ret < 0 && errno == EINTR);
+	return (ret < 0);
+}
+
+static int uring_new(struct aio *ptr, unsigned depth)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	long fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (fd < 0)
+		return 1;
+
+	ptr->ring_fd = fd;
+	ptr->inflight = 0;
+	ptr->entries = params.sq_entries;
+	if (ptr->entries > params.cq_entries)
+		ptr->entries = params.cq_entries;
+
+	ptr->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ptr->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ptr->cq_ring_size > ptr->sq_ring_size)
+			ptr->sq_ring_size = ptr->cq_ring_size;
+		ptr->cq_ring_size = ptr->sq_ring_size;
+	}
+
+	ptr->sq_ring = mmap(NULL, ptr->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ptr->ring_fd, IORING_OFF_SQ_RING);
+	if (ptr->sq_ring == MAP_FAILED)
+		goto fail_close;
+
+	ptr->cq_ring = ptr->sq_ring;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		ptr->cq_ring = mmap(NULL, ptr->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ptr->ring_fd, IORING_OFF_CQ_RING);
+		if (ptr->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+
+	ptr->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ptr->sqes = mmap(NULL, ptr->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ptr->ring_fd, IORING_OFF_SQES);
+	if (ptr->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	unsigned char *sq = ptr->sq_ring;
+	unsigned char *cq = ptr->cq_ring;
+	ptr->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ptr->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ptr->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ptr->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ptr->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ptr->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ptr->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ptr->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 0;
+
+fail_cq:
+	if (ptr->cq_ring != ptr->sq_ring)
+		munmap(ptr->cq_ring, ptr->cq_ring_size);
+fail_sq:
+	munmap(ptr->sq_ring, ptr->sq_ring_size);
+fail_close:
+	close(ptr->ring_fd);
+	return 1;
+}
+
+static void uring_free(struct aio *ptr)
+{
+	munmap(ptr->sqes, ptr->sqes_size);
+	if (ptr->cq_ring != ptr->sq_ring)
+		munmap(ptr->cq_ring, ptr->cq_ring_size);
+	munmap(ptr->sq_ring, ptr->sq_ring_size);
+	close(ptr->ring_fd);
+}
+
+// queue the next chunk of the request, one chunk per request is in flight
+static void uring_queue(struct aio *ptr, struct aio_request *req)
+{
+	size_t size = req->size - req->done;
+	if (size > MAX_CHUNK)
+		size = MAX_CHUNK;
+
+	req->iov.iov_base = req->data + req->done;
+	req->iov.iov_len = size;
+
+	unsigned tail = *(ptr->sq_tail);
+	unsigned index = tail & *(ptr->sq_mask);
+	struct io_uring_sqe *sqe = &(ptr->sqes[index]);
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = req->fd;
+	sqe->off = req->done;
+	sqe->addr = (unsigned long)&(req->iov);
+	sqe->len = 1;
+	sqe->user_data = (unsigned long)req;
+
+	ptr->sq_array[index] = index;
+	__atomic_store_n(ptr->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ptr->inflight++;
+}
+
+static void uring_reap(struct aio *ptr)
+{
+	unsigned head = *(ptr->cq_head);
+	unsigned tail = __atomic_load_n(ptr->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned queued = 0;
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &(ptr->cqes[head & *(ptr->cq_mask)]);
+		struct aio_request *req = (struct aio_request *)(unsigned long)cqe->user_data;
+		ptr->inflight--;
+
+		// the cancellations have no request
+		if (req == NULL)
+			continue;
+		if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+			// retry the same chunk
+		} else if (cqe->res <= 0) {
+			if (req->rc == 0)
+				request_fail(req, req->is_write ? "write" : "read");
+		} else {
+			req->done += cqe->res;
+		}
+
+		if (req->rc == 0 && req->done < req->size) {
+			uring_queue(ptr, req);
+			queued++;
+		} else {
+			req->complete = true;
+		}
+	}
+	__atomic_store_n(ptr->cq_head, head, __ATOMIC_RELEASE);
+
+	if (queued > 0)
+		uring_enter(ptr, queued, 0);
+}
+
+static void uring_submit(struct aio *ptr, struct aio_request *req)
+{
+	// never have more requests in flight than completion slots
+	while (ptr->inflight >= ptr->entries) {
+		uring_reap(ptr);
+		if (ptr->inflight >= ptr->entries)
+			uring_enter(ptr, 0, 1);
+	}
+	uring_queue(ptr, req);
+	if (uring_enter(ptr, 1, 0)) {
+		// without SQPOLL the kernel only looks at the ring in io_uring_enter()
+		__atomic_store_n(ptr->sq_tail, *(ptr->sq_tail) - 1, __ATOMIC_RELEASE);
+		ptr->inflight--;
+		request_fail(req, req->is_write ? "write" : "read");
+		req->complete = true;
+	}
+}
+
+// ask the kernel to cancel the chunk of the request in flight
+static int uring_cancel(struct aio *ptr, struct aio_request *req)
+{
+	if (ptr->inflight >= ptr->entries)
+		return 1;
+
+	unsigned tail = *(ptr->sq_tail);
+	unsigned index = tail & *(ptr->sq_mask);
+	struct io_uring_sqe *sqe = &(ptr->sqes[index]);
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)req;
+	sqe->user_data = 0;
+
+	ptr->sq_array[index] = index;
+	__atomic_store_n(ptr->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ptr->inflight++;
+	return uring_enter(ptr, 1, 0);
+}
+
+/*
+ * The kernel uses the buffer of the request until its completion is reaped,
+ * even when waiting fails. The request is then cancelled and waited on
+ * again, a ring that cannot do either is beyond repair.
+ */
+static void uring_wait(struct aio *ptr, struct aio_request *req)
+{
+	bool cancelled = false;
+	uring_reap(ptr);
+	while (!req->complete) {
+		if (uring_enter(ptr, 0, 1) == 0) {
+			uring_reap(ptr);
+			continue;
+		}
+		// a full completion queue refuses to wait until it is reaped
+		uring_reap(ptr);
+		if (req->complete)
+			break;
+		if (cancelled || uring_cancel(ptr, req))
+			abort();
+		request_fail(req, req->is_write ? "write" : "read");
+		cancelled = true;
+	}
+}
+#endif /* HAVE_IO_URING */
+
+/*
+ * depth is the number of requests that can be in flight at once.
+ * Returns non-zero when the requested engine is unavailable.
+ */
+int aio_new(struct aio **ptr, unsigned depth, enum aio_engine engine)
+{
+	assert(ptr != NULL);
+	assert(depth > 0);
+	int rc = 1;
+
+	struct aio *new = malloc(sizeof(struct aio));
+	if (new == NULL)
+		abort();
+
+	if (pthread_mutex_init(&(new->lock), NULL) != 0
+	    || pthread_cond_init(&(new->work), NULL) != 0
+	    || pthread_cond_init(&(new->done), NULL) != 0)
+		abort();
+
+#ifdef HAVE_IO_URING
+	if (rc && engine != aio_threads) {
+		rc = uring_new(new, depth);
+		new->engine = aio_uring;
+	}
+#endif
+	if (rc && engine != aio_uring) {
+		rc = threads_new(new, depth);
+		new->engine = aio_threads;
+		if (rc)
+			threads_free(new);
+	}
+
+	if (rc) {
+		print_error();
+		fprintf(stderr, "The asynchronous I/O engine is not available.\n");
+		new->engine = aio_auto;
+		aio_free(new);
+		new = NULL;
+	}
+	*ptr = new;
+	return rc;
+}
+
+// all requests must have been waited on
+void aio_free(struct aio *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	switch (ptr->engine) {
+	case aio_uring:
+#ifdef HAVE_IO_URING
+		uring_free(ptr);
+#endif
+		break;
+	case aio_threads:
+		threads_free(ptr);
+		break;
+	default:
+		break;
+	}
+	pthread_cond_destroy(&(ptr->done));
+	pthread_cond_destroy(&(ptr->work));
+	pthread_mutex_destroy(&(ptr->lock));
+	free(ptr);
+}
+
+const char *aio_engine_name(struct aio *ptr)
+{
+	if (ptr->engine == aio_uring)
+		return "io_uring";
+	return "threads";
+}
+
+static struct aio_request *request_new(const char *name, bool is_write)
+{
+	struct aio_request *new = malloc(sizeof(struct aio_request));
+	if (new == NULL)
+		abort();
+
+	new->name = malloc(strlen(name) + 1);
+	if (new->name == NULL)
+		abort();
+	strcpy(new->name, name);
+
+	new->next = NULL;
+	new->fd = -1;
+	new->is_write = is_write;
+	new->data = NULL;
+	new->size = 0;
+	new->done = 0;
+	new->rc = 0;
+	new->complete = false;
+	return new;
+}
+
+static void submit(struct aio *ptr, struct aio_request *req)
+{
+	if (req->size == 0) {
+		req->complete = true;
+		return;
+	}
+#ifdef HAVE_IO_URING
+	if (ptr->engine == aio_uring) {
+		uring_submit(ptr, req);
+		return;
+	}
+#endif
+	threads_submit(ptr, req);
+}
+
+// start reading the whole file
+struct aio_request *aio_read(struct aio *ptr, const char *name)
+{
+	assert(ptr != NULL);
+	assert(name != NULL);
+	struct aio_request *req = request_new(name, false);
+
+	struct stat st;
+	req->fd = open(name, O_RDONLY);
+	if (req->fd < 0 || fstat(req->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		printf("Cannot open file '%s'\n", name);
+		req->rc = 1;
+		req->complete = true;
+		return req;
+	}
+
+	req->size = st.st_size;
+	req->data = malloc(req->size + 1);
+	if (req->data == NULL)
+		abort();
+
+	submit(ptr, req);
+	return req;
+}
+
+// start writing a new file, the request takes ownership of data
+struct aio_request *aio_write(struct aio *ptr, const char *name, unsigned char *data, size_t size)
+{
+	assert(ptr != NULL);
+	assert(name != NULL);
+	struct aio_request *req = request_new(name, true);
+	req->data = data;
+	req->size = size;
+
+	req->fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (req->fd < 0) {
+		if (errno == EEXIST)
+			printf("File '%s' already exists.\n", name);
+		else
+			printf("Cannot open file '%s'\n", name);
+		req->rc = 1;
+		req->complete = true;
+		return req;
+	}
+
+	submit(ptr, req);
+	return req;
+}
+
+int aio_wait(struct aio *ptr, struct aio_request *req)
+{
+	assert(ptr != NULL);
+	assert(req != NULL);
+
+#ifdef HAVE_IO_URING
+	if (ptr->engine == aio_uring)
+		uring_wait(ptr, req);
+#endif
+	if (ptr->engine == aio_threads)
+		threads_wait(ptr, req);
+
+	if (req->fd >= 0) {
+		if (close(req->fd) != 0 && req->rc == 0)
+			request_fail(req, "close");
+		req->fd = -1;
+	}
+	return req->rc;
+}
+
+unsigned char *aio_request_data(struct aio_request *req)
+{
+	return (req->data);
+}
+
+size_t aio_request_size(struct aio_request *req)
+{
+	return (req->size);
+}
+
+void aio_request_free(struct aio_request *req)
+{
+	if (req == NULL)
+		return;
+
+	assert(req->fd < 0);
+	free(req->data);
+	free(req->name);
+	free(req);
+}
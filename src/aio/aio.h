@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_AIO_H
+#define PIXMAP565_AIO_H
+
+#include <stddef.h>
+
+/*
+ * aio:
+ *
+ * Asynchronous whole-file reads and writes. Requests are submitted and
+ * then waited on, while the caller does other work in between.
+ *
+ * The io_uring engine is used on Linux when the kernel allows it,
+ * otherwise a pool of threads does blocking pread()/pwrite().
+ */
+
+enum aio_engine {
+	aio_auto,
+	aio_uring,
+	aio_threads
+};
+
+struct aio;
+struct aio_request;
+
+int aio_new(struct aio **ptr, unsigned depth, enum aio_engine engine);
+void aio_free(struct aio *ptr);
+const char *aio_engine_name(struct aio *ptr);
+
+struct aio_request *aio_read(struct aio *ptr, const char *name);
+struct aio_request *aio_write(struct aio *ptr, const char *name, unsigned char *data, size_t size);
+int aio_wait(struct aio *ptr, struct aio_request *req);
+
+unsigned char *aio_request_data(struct aio_request *req);
+size_t aio_request_size(struct aio_request *req);
+void aio_request_free(struct aio_request *req);
+
+#endif /* PIXMAP565_AIO_H */
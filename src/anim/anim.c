@@ -0,0 +1,355 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "anim.h"
+#include "convert.h"
+#include "file_utils.h"
+#include "jobs.h"
+#include "picture.h"
+#include "pixmap.h"
+
+struct frame
+{
+	char *name;
+	struct pixmap *pix;
+	uint16_t **rows;
+	struct region rect; // what is stored of the frame
+	udword_t offset;
+	udword_t bytes;
+};
+
+static void add_frame(struct frame **frames, size_t *count, size_t *size, const char *name, size_t length)
+{
+	if (*count == *size) {
+		*size = 2 * *size + 16;
+		*frames = realloc(*frames, sizeof(struct frame) * *size);
+		if (*frames == NULL)
+			abort();
+	}
+
+	struct frame *new = &((*frames)[*count]);
+	memset(new, 0, sizeof(struct frame));
+	new->name = malloc(length + 1);
+	if (new->name == NULL)
+		abort();
+	memcpy(new->name, name, length);
+	new->name[length] = '\0';
+	*count += 1;
+}
+
+// one frame per line, empty lines and '#' comments are ignored
+static int list_frames(FILE *list, struct frame **frames, size_t *count)
+{
+	size_t size = 0;
+	char line[4096];
+	while (fgets(line, sizeof(line), list) != NULL) {
+		char *first = line;
+		while (*first == ' ' || *first == '\t')
+			first++;
+		size_t length = strcspn(first, "\r\n");
+		while (length > 0 && (first[length - 1] == ' ' || first[length - 1] == '\t'))
+			length--;
+		if (length == 0 || first[0] == '#')
+			continue;
+
+		add_frame(frames, count, &size, first, length);
+	}
+	if (ferror(list)) {
+		print_error();
+		fprintf(stderr, "Unexpected end of file, caused by I/O error.\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int compare_frames(const void *a, const void *b)
+{
+	const struct frame *x = a;
+	const struct frame *y = b;
+	return strcmp(x->name, y->name);
+}
+
+// the files of a directory, in name order, hidden files excluded
+static int scan_frames(const char *path, struct frame **frames, size_t *count)
+{
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		printf("Cannot open directory '%s'\n", path);
+		return 1;
+	}
+
+	size_t size = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		size_t length = strlen(path) + 1 + strlen(entry->d_name);
+		char *name = malloc(length + 1);
+		if (name == NULL)
+			abort();
+		snprintf(name, length + 1, "%s/%s", path, entry->d_name);
+		add_frame(frames, count, &size, name, length);
+		free(name);
+	}
+	closedir(dir);
+
+	qsort(*frames, *count, sizeof(struct frame), compare_frames);
+	return 0;
+}
+
+struct pack_ctx
+{
+	const struct options *opt;
+	struct frame *frames;
+};
+
+// read a frame with the same reader as a single conversion
+static int read_frame(void *arg, size_t index)
+{
+	struct pack_ctx *ctx = arg;
+	struct frame *frame = &(ctx->frames[index]);
+
+	FILE *fp = fopen(frame->name, "r");
+	if (fp == NULL) {
+		printf("Cannot open file '%s'\n", frame->name);
+		return 1;
+	}
+
+	// the arena isn't shared between threads
+	struct picture *pic = NULL;
+	picture_new(&pic, NULL);
+	int rc = convert_read(ctx->opt, fp, is_pic(frame->name), pic, &(frame->pix), NULL);
+	picture_free(pic);
+	fclose(fp);
+
+	if (rc) {
+		fprintf(stderr, "Cannot read frame '%s'\n", frame->name);
+		return rc;
+	}
+	frame->rows = pixmap_get_rows(frame->pix);
+	frame->rect.width = pixmap_get_x(frame->pix);
+	frame->rect.height = pixmap_get_y(frame->pix);
+	return 0;
+}
+
+// shrink the rectangle of a frame to the pixels that differ from the previous
+static int diff_frame(void *arg, size_t index)
+{
+	struct pack_ctx *ctx = arg;
+	if (index == 0)
+		return 0;
+
+	struct frame *frame = &(ctx->frames[index]);
+	uint16_t **prev = ctx->frames[index - 1].rows;
+	udword_t width = frame->rect.width;
+	udword_t height = frame->rect.height;
+
+	udword_t left = width;
+	udword_t right = 0;
+	udword_t top = height;
+	udword_t bottom = 0;
+	for (udword_t y = 0; y < height; y++) {
+		if (memcmp(frame->rows[y], prev[y], (size_t)width * sizeof(uint16_t)) == 0)
+			continue;
+
+		if (top == height)
+			top = y;
+		bottom = y + 1;
+		for (udword_t x = 0; x < width; x++) {
+			if (frame->rows[y][x] != prev[y][x]) {
+				if (x < left)
+					left = x;
+				if (x + 1 > right)
+					right = x + 1;
+			}
+		}
+	}
+
+	if (top == height) {
+		frame->rect = (struct region){0, 0, 0, 0};
+	} else {
+		frame->rect.x = left;
+		frame->rect.y = top;
+		frame->rect.width = right - left;
+		frame->rect.height = bottom - top;
+	}
+	return 0;
+}
+
+static unsigned long long align_up(unsigned long long value, udword_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static int write_zeros(unsigned long long count, FILE *fp)
+{
+	int rc = 0;
+	for (unsigned long long i = 0; i < count && rc == 0; i++)
+		rc = (fputc(0, fp) == EOF);
+	return rc;
+}
+
+static int write_pack(struct frame *frames, size_t count, bool delta, udword_t alignment, udword_t row_align, FILE *fp)
+{
+	udword_t width = frames[0].rect.width;
+	udword_t height = frames[0].rect.height;
+	unsigned long long data_offset = align_up(ANIM_HEADER_BYTES + ANIM_ENTRY_BYTES * count, alignment);
+
+	// the offsets are 32 bit
+	unsigned long long offset = data_offset;
+	for (size_t i = 0; i < count; i++) {
+		unsigned long long stride = pixmap_stride(frames[i].rect.width, row_align);
+		unsigned long long bytes = stride * frames[i].rect.height;
+		if (offset + bytes > UDWORD_MAX) {
+			print_error();
+			fprintf(stderr, "The frames don't fit in %llu bytes.\n", (unsigned long long)UDWORD_MAX);
+			return 1;
+		}
+		frames[i].offset = offset;
+		frames[i].bytes = bytes;
+		offset = align_up(offset + bytes, alignment);
+	}
+
+	int rc = (fwrite(ANIM_MAGIC, 1, 4, fp) != 4);
+	if (rc == 0)
+		rc = fput_uword(ANIM_VERSION, fp);
+	if (rc == 0)
+		rc = fput_uword(delta ? ANIM_DELTA : 0, fp);
+	if (rc == 0)
+		rc = fput_udword(width, fp);
+	if (rc == 0)
+		rc = fput_udword(height, fp);
+	if (rc == 0)
+		rc = fput_udword(count, fp);
+	if (rc == 0)
+		rc = fput_udword(alignment, fp);
+	if (rc == 0)
+		rc = fput_udword(ANIM_HEADER_BYTES, fp);
+	if (rc == 0)
+		rc = fput_udword(data_offset, fp);
+
+	for (size_t i = 0; i < count && rc == 0; i++) {
+		rc = fput_udword(frames[i].offset, fp);
+		if (rc == 0)
+			rc = fput_udword(frames[i].bytes, fp);
+		if (rc == 0)
+			rc = fput_udword(frames[i].rect.x, fp);
+		if (rc == 0)
+			rc = fput_udword(frames[i].rect.y, fp);
+		if (rc == 0)
+			rc = fput_udword(frames[i].rect.width, fp);
+		if (rc == 0)
+			rc = fput_udword(frames[i].rect.height, fp);
+	}
+
+	unsigned long long byte = ANIM_HEADER_BYTES + ANIM_ENTRY_BYTES * count;
+	for (size_t i = 0; i < count && rc == 0; i++) {
+		rc = write_zeros(frames[i].offset - byte, fp);
+		byte = frames[i].offset;
+		if (rc || frames[i].bytes == 0)
+			continue;
+
+		const struct region *rect = &(frames[i].rect);
+		struct pixmap *pix = NULL;
+		pixmap_new(&pix, rect->width, NULL);
+		for (udword_t y = 0; y < rect->height; y++)
+			pixmap_add_row(pix, frames[i].rows[rect->y + y] + rect->x);
+		rc = pixmap_write(pix, fp, row_align);
+		pixmap_free(pix);
+		byte = frames[i].offset + frames[i].bytes;
+	}
+	if (rc == 0)
+		rc = write_zeros(offset - byte, fp);
+
+	if (rc) {
+		print_error();
+		fprintf(stderr, "Cannot write the output file.\n");
+	}
+	return rc;
+}
+
+/*
+ * source is a directory of frames, or a file that lists them.
+ * The frames are read and diffed in parallel, then written in order.
+ */
+int anim_pack(const struct options *opt, const char *source, FILE *outfile, bool delta, udword_t alignment)
+{
+	assert(opt != NULL);
+	assert(source != NULL);
+	assert(outfile != NULL);
+	assert(alignment > 0);
+
+	int rc = 0;
+	struct frame *frames = NULL;
+	size_t count = 0;
+
+	struct stat st;
+	if (stat(source, &st) == 0 && S_ISDIR(st.st_mode)) {
+		rc = scan_frames(source, &frames, &count);
+	} else {
+		FILE *list = fopen(source, "r");
+		if (list == NULL) {
+			printf("Cannot open file '%s'\n", source);
+			return 1;
+		}
+		rc = list_frames(list, &frames, &count);
+		fclose(list);
+	}
+	if (rc)
+		goto out;
+
+	if (count == 0 || count > (UDWORD_MAX - ANIM_HEADER_BYTES) / ANIM_ENTRY_BYTES) {
+		print_error();
+		fprintf(stderr, "Expected between 1 and %llu frames.\n",
+			(unsigned long long)(UDWORD_MAX - ANIM_HEADER_BYTES) / ANIM_ENTRY_BYTES);
+		rc = 1;
+		goto out;
+	}
+
+	struct pack_ctx ctx = {
+		.opt = opt,
+		.frames = frames
+	};
+	rc = jobs_run(count, 0, read_frame, &ctx);
+	if (rc)
+		goto out;
+
+	for (size_t i = 1; i < count; i++) {
+		if (frames[i].rect.width != frames[0].rect.width || frames[i].rect.height != frames[0].rect.height) {
+			print_error();
+			fprintf(stderr, "Frame '%s' is %llux%llu, expected %llux%llu.\n", frames[i].name,
+				(unsigned long long)frames[i].rect.width, (unsigned long long)frames[i].rect.height,
+				(unsigned long long)frames[0].rect.width, (unsigned long long)frames[0].rect.height);
+			rc = 1;
+			goto out;
+		}
+	}
+
+	// every frame compares with the unchanged previous one, read-only
+	if (delta)
+		rc = jobs_run(count, 0, diff_frame, &ctx);
+	if (rc == 0)
+		rc = write_pack(frames, count, delta, alignment, opt->out_align, outfile);
+
+out:
+	for (size_t i = 0; i < count; i++) {
+		free(frames[i].rows);
+		pixmap_free(frames[i].pix);
+		free(frames[i].name);
+	}
+	free(frames);
+	return rc;
+}
@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_ANIM_H
+#define PIXMAP565_ANIM_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "convert.h"
+#include "file_utils.h"
+
+/*
+ * anim:
+ *
+ * Pack a sequence of frames into one file, to be played back with a single
+ * sequential read. All integers are little-endian.
+ *
+ * header (32 bytes):
+ *   magic "A565", version (2 bytes), flags (2 bytes, ANIM_DELTA),
+ *   width, height, frame count, alignment, table offset, data offset
+ * frame table, at the table offset, 24 bytes per frame:
+ *   offset, bytes, x, y, width, height
+ * frames, from the data offset, each one starting at a multiple of the
+ * alignment: the rows of the x, y, width, height rectangle of the frame,
+ * as a pixmap with the output row alignment, of bytes / height bytes per
+ * row. With ANIM_DELTA, the rectangle of a frame after the first bounds
+ * the pixels that differ from the previous frame, and it is empty if there
+ * are none.
+ */
+
+#define ANIM_MAGIC "A565"
+#define ANIM_VERSION 1u
+#define ANIM_DELTA 1u
+#define ANIM_HEADER_BYTES 32u
+#define ANIM_ENTRY_BYTES 24u
+#define ANIM_ALIGNMENT 512u
+
+int anim_pack(const struct options *opt, const char *source, FILE *outfile, bool delta, udword_t alignment);
+
+#endif /* PIXMAP565_ANIM_H */
@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define DEFAULT_BLOCK_SIZE ((size_t)64 << 10)
+#define MAX_BLOCK_SIZE ((size_t)64 << 20)
+#define ALIGNMENT (_Alignof(max_align_t))
+
+struct block
+{
+	struct block *next;
+	size_t size;
+	_Alignas(max_align_t) unsigned char data[];
+};
+
+struct arena
+{
+	struct block *first;
+	struct block *current;
+	size_t used; // bytes of current->data in use
+	size_t block_size;
+};
+
+void arena_new(struct arena **ptr, size_t block_size)
+{
+	assert(ptr != NULL);
+	struct arena *new = malloc(sizeof(struct arena));
+	if (new == NULL)
+		abort();
+
+	if (block_size == 0)
+		block_size = DEFAULT_BLOCK_SIZE;
+
+	new->first = NULL;
+	new->current = NULL;
+	new->used = 0;
+	new->block_size = block_size;
+
+	*ptr = new;
+}
+
+void arena_free(struct arena *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	struct block *tmp = ptr->first;
+	while (tmp != NULL) {
+		struct block *next = tmp->next;
+		free(tmp);
+		tmp = next;
+	}
+	free(ptr);
+}
+
+// O(1), the blocks are kept and reused in the same order
+void arena_reset(struct arena *ptr)
+{
+	assert(ptr != NULL);
+	ptr->current = ptr->first;
+	ptr->used = 0;
+}
+
+static struct block *block_new(size_t size)
+{
+	if (size > (size_t)-1 - sizeof(struct block))
+		abort();
+
+	struct block *new = malloc(sizeof(struct block) + size);
+	if (new == NULL)
+		abort();
+
+	new->next = NULL;
+	new->size = size;
+	return new;
+}
+
+void *arena_alloc(struct arena *ptr, size_t size)
+{
+	void *ret = NULL;
+	if (ptr == NULL) {
+		ret = malloc(size);
+		if (ret == NULL)
+			abort();
+		goto out;
+	}
+
+	if (size > (size_t)-1 - ALIGNMENT)
+		abort();
+	size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+	// move on to the next kept block that fits, or link in a new one
+	while (ptr->current == NULL || size > ptr->current->size - ptr->used) {
+		struct block *next = (ptr->current == NULL) ? ptr->first : ptr->current->next;
+
+		if (next == NULL || size > next->size) {
+			size_t block_size = ptr->block_size;
+			if (ptr->block_size < MAX_BLOCK_SIZE)
+				ptr->block_size *= 2;
+			if (block_size < size)
+				block_size = size;
+
+			struct block *new = block_new(block_size);
+			new->next = next;
+			if (ptr->current == NULL)
+				ptr->first = new;
+			else
+				ptr->current->next = new;
+			next = new;
+		}
+		ptr->current = next;
+		ptr->used = 0;
+	}
+	ret = ptr->current->data + ptr->used;
+	ptr->used += size;
+out:
+	return ret;
+}
+
+// memory from an arena is only given back by arena_reset() or arena_free()
+void arena_release(struct arena *ptr, void *data)
+{
+	if (ptr == NULL)
+		free(data);
+}
@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_ARENA_H
+#define PIXMAP565_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * arena:
+ *
+ * A bump allocator for the objects of one conversion. Everything is
+ * released at once with arena_reset(), which keeps the blocks for the
+ * next conversion, or arena_free().
+ *
+ * A NULL arena falls back to malloc() and free().
+ * An arena must not be shared between threads.
+ */
+
+struct arena;
+
+void arena_new(struct arena **ptr, size_t block_size);
+void arena_free(struct arena *ptr);
+void arena_reset(struct arena *ptr);
+
+void *arena_alloc(struct arena *ptr, size_t size);
+void arena_release(struct arena *ptr, void *data);
+
+#endif /* PIXMAP565_ARENA_H */
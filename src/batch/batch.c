@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aio.h"
+#include "arena.h"
+#include "batch.h"
+#include "checksum.h"
+#include "convert.h"
+#include "file_utils.h"
+#include "picture.h"
+
+// inputs read ahead, and outputs written behind, of the current conversion
+#define DEPTH 8
+
+struct pair
+{
+	char *inname;
+	char *outname;
+};
+
+static char *strnew(const char *str, size_t size)
+{
+	char *new = malloc(size + 1);
+	if (new == NULL)
+		abort();
+
+	memcpy(new, str, size);
+	new[size] = '\0';
+	return new;
+}
+
+// one "infile outfile" pair per line, empty lines and '#' comments are ignored
+static int read_list(FILE *list, struct pair **pairs, size_t *count)
+{
+	int rc = 0;
+	size_t size = 0;
+	char line[4096];
+	unsigned long lineno = 0;
+
+	*pairs = NULL;
+	*count = 0;
+	while (fgets(line, sizeof(line), list) != NULL) {
+		lineno++;
+		char *field[3] = {NULL, NULL, NULL};
+		size_t length[3] = {0, 0, 0};
+		int found = 0;
+		for (char *ch = line; *ch != '\0' && found < 3;) {
+			while (*ch == ' ' || *ch == '\t' || *ch == '\n' || *ch == '\r')
+				ch++;
+			if (*ch == '\0')
+				break;
+			field[found] = ch;
+			while (*ch != '\0' && *ch != ' ' && *ch != '\t' && *ch != '\n' && *ch != '\r')
+				ch++;
+			length[found] = ch - field[found];
+			found++;
+		}
+		if (found == 0 || field[0][0] == '#')
+			continue;
+
+		if (found != 2) {
+			print_error();
+			fprintf(stderr, "Invalid pair on line %lu, expected: infile outfile\n", lineno);
+			rc = 1;
+			break;
+		}
+		if (*count == size) {
+			size = 2 * size + 16;
+			*pairs = realloc(*pairs, sizeof(struct pair) * size);
+			if (*pairs == NULL)
+				abort();
+		}
+		(*pairs)[*count].inname = strnew(field[0], length[0]);
+		(*pairs)[*count].outname = strnew(field[1], length[1]);
+		*count += 1;
+	}
+	if (rc == 0 && ferror(list)) {
+		print_error();
+		fprintf(stderr, "Unexpected end of file, caused by I/O error.\n");
+		rc = 1;
+	}
+	return rc;
+}
+
+// convert an input that is already in memory into a new memory buffer
+static int convert_buffer(const struct options *opt, struct pair *pair, struct aio_request *in, struct arena *arena, unsigned char **data, size_t *size)
+{
+	int rc = 0;
+	FILE *infile = NULL;
+	FILE *outfile = NULL;
+	char *buffer = NULL;
+	size_t length = 0;
+
+	if (aio_request_size(in) == 0) {
+		print_error();
+		fprintf(stderr, "'%s': Unexpected end of file.\n", pair->inname);
+		rc = 1;
+		goto out;
+	}
+	infile = fmemopen(aio_request_data(in), aio_request_size(in), "r");
+	outfile = open_memstream(&buffer, &length);
+	if (infile == NULL || outfile == NULL)
+		abort();
+
+	rc = convert(opt, infile, is_pic(pair->inname), outfile, is_pic(pair->outname), arena);
+out:
+	if (infile != NULL)
+		fclose(infile);
+	if (outfile != NULL && fclose(outfile) != 0)
+		rc = 1;
+
+	if (rc) {
+		free(buffer);
+		buffer = NULL;
+		length = 0;
+	}
+	*data = (unsigned char *)buffer;
+	*size = length;
+	return rc;
+}
+
+int batch_run(const struct options *opt, FILE *list, enum aio_engine engine)
+{
+	assert(opt != NULL);
+	assert(list != NULL);
+
+	struct pair *pairs = NULL;
+	size_t count = 0;
+	struct aio *io = NULL;
+	struct arena *arena = NULL;
+	struct aio_request **reads = NULL;
+	struct aio_request **writes = NULL;
+
+	int rc = read_list(list, &pairs, &count);
+	if (rc)
+		goto out;
+
+	rc = aio_new(&io, DEPTH, engine);
+	if (rc)
+		goto out;
+
+	reads = calloc(count + 1, sizeof(struct aio_request *));
+	writes = calloc(count + 1, sizeof(struct aio_request *));
+	if (reads == NULL || writes == NULL)
+		abort();
+
+	arena_new(&arena, 0);
+
+	for (size_t i = 0; i < count && i < DEPTH; i++)
+		reads[i] = aio_read(io, pairs[i].inname);
+
+	for (size_t i = 0; i < count; i++) {
+		int job_rc = aio_wait(io, reads[i]);
+		if (i + DEPTH < count)
+			reads[i + DEPTH] = aio_read(io, pairs[i + DEPTH].inname);
+
+		unsigned char *data = NULL;
+		size_t size = 0;
+		if (job_rc == 0)
+			job_rc = convert_buffer(opt, &(pairs[i]), reads[i], arena, &data, &size);
+
+		arena_reset(arena);
+		aio_request_free(reads[i]);
+		reads[i] = NULL;
+
+		// keep at most DEPTH writes in flight
+		if (i >= DEPTH && writes[i - DEPTH] != NULL) {
+			if (aio_wait(io, writes[i - DEPTH]))
+				rc = 1;
+			aio_request_free(writes[i - DEPTH]);
+			writes[i - DEPTH] = NULL;
+		}
+
+		// the output is still in memory, checksum it before it's written
+		if (job_rc == 0 && opt->checksum != 0) {
+			struct checksum *sum = NULL;
+			checksum_new(&sum, opt->checksum);
+			checksum_update(sum, data, size);
+			job_rc = checksum_report(sum, pairs[i].outname, stdout);
+			if (job_rc == 0 && opt->sidecar)
+				job_rc = checksum_write_sidecar(sum, pairs[i].outname);
+			checksum_free(sum);
+		}
+
+		if (job_rc == 0 && !opt->hash_only)
+			writes[i] = aio_write(io, pairs[i].outname, data, size);
+		else
+			free(data);
+
+		if (job_rc) {
+			fprintf(stderr, "Cannot convert '%s' to '%s'\n", pairs[i].inname, pairs[i].outname);
+			rc = 1;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (writes[i] == NULL)
+			continue;
+		if (aio_wait(io, writes[i]))
+			rc = 1;
+		aio_request_free(writes[i]);
+	}
+
+out:
+	arena_free(arena);
+	aio_free(io);
+	free(reads);
+	free(writes);
+	for (size_t i = 0; i < count; i++) {
+		free(pairs[i].inname);
+		free(pairs[i].outname);
+	}
+	free(pairs);
+	return rc;
+}
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_BATCH_H
+#define PIXMAP565_BATCH_H
+
+#include <stdio.h>
+
+#include "aio.h"
+#include "convert.h"
+
+/*
+ * batch:
+ *
+ * Convert every "infile outfile" pair listed in a file, one pair per line.
+ * The next inputs are read ahead and the outputs are written behind,
+ * while the current conversion runs in memory.
+ */
+
+int batch_run(const struct options *opt, FILE *list, enum aio_engine engine);
+
+#endif /* PIXMAP565_BATCH_H */
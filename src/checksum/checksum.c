@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#define _GNU_SOURCE // fopencookie()
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "checksum.h"
+
+#define XXH_PRIME1 0x9E3779B1u
+#define XXH_PRIME2 0x85EBCA77u
+#define XXH_PRIME3 0xC2B2AE3Du
+#define XXH_PRIME4 0x27D4EB2Fu
+#define XXH_PRIME5 0x165667B1u
+
+struct checksum
+{
+	unsigned algorithms;
+	unsigned long long bytes;
+
+	uint32_t crc; // inverted
+
+	uint32_t acc[4];
+	unsigned char pending[16]; // bytes of an incomplete XXH32 stripe
+	size_t pending_size;
+
+	// without custom streams, the output is collected and checksummed on close
+	char *buffer;
+	size_t buffer_size;
+	FILE *target;
+};
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+// slicing-by-8 tables of the reflected polynomial 0xEDB88320
+static void crc_table_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+		crc_table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+	}
+}
+
+static uint32_t read32(const unsigned char *ptr)
+{
+	return (uint32_t)ptr[0] | (uint32_t)ptr[1] << 8 | (uint32_t)ptr[2] << 16 | (uint32_t)ptr[3] << 24;
+}
+
+static uint32_t crc_update(uint32_t crc, const unsigned char *data, size_t size)
+{
+#if defined(__ARM_FEATURE_CRC32)
+	// ARMv8 has instructions for the IEEE polynomial
+	for (; size >= 8; size -= 8, data += 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc = __crc32d(crc, word);
+	}
+	for (; size > 0; size--, data++)
+		crc = __crc32b(crc, *data);
+#else
+	// x86 has crc32 instructions only for CRC-32C, so slice instead
+	for (; size >= 8; size -= 8, data += 8) {
+		uint32_t low = read32(data) ^ crc;
+		uint32_t high = read32(data + 4);
+		crc = crc_table[7][low & 0xff] ^ crc_table[6][(low >> 8) & 0xff]
+			^ crc_table[5][(low >> 16) & 0xff] ^ crc_table[4][low >> 24]
+			^ crc_table[3][high & 0xff] ^ crc_table[2][(high >> 8) & 0xff]
+			^ crc_table[1][(high >> 16) & 0xff] ^ crc_table[0][high >> 24];
+	}
+	for (; size > 0; size--, data++)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *data) & 0xff];
+#endif
+	return crc;
+}
+
+static uint32_t rotl32(uint32_t value, unsigned bits)
+{
+	return (value << bits) | (value >> (32 - bits));
+}
+
+static uint32_t xxh_round(uint32_t acc, uint32_t input)
+{
+	acc += input * XXH_PRIME2;
+	acc = rotl32(acc, 13);
+	return acc * XXH_PRIME1;
+}
+
+static void xxh_stripe(struct checksum *ptr, const unsigned char *data)
+{
+	for (int i = 0; i < 4; i++)
+		ptr->acc[i] = xxh_round(ptr->acc[i], read32(data + 4 * i));
+}
+
+static void xxh_update(struct checksum *ptr, const unsigned char *data, size_t size)
+{
+	if (ptr->pending_size > 0) {
+		size_t fill = 16 - ptr->pending_size;
+		if (fill > size)
+			fill = size;
+		memcpy(ptr->pending + ptr->pending_size, data, fill);
+		ptr->pending_size += fill;
+		data += fill;
+		size -= fill;
+		if (ptr->pending_size < 16)
+			return;
+		xxh_stripe(ptr, ptr->pending);
+		ptr->pending_size = 0;
+	}
+	for (; size >= 16; size -= 16, data += 16)
+		xxh_stripe(ptr, data);
+
+	memcpy(ptr->pending, data, size);
+	ptr->pending_size = size;
+}
+
+void checksum_new(struct checksum **ptr, unsigned algorithms)
+{
+	assert(ptr != NULL);
+	struct checksum *new = malloc(sizeof(struct checksum));
+	if (new == NULL)
+		abort();
+
+	pthread_once(&crc_table_once, crc_table_init);
+
+	new->algorithms = algorithms;
+	new->bytes = 0;
+	new->crc = 0xFFFFFFFFu;
+
+	// seed 0
+	new->acc[0] = XXH_PRIME1 + XXH_PRIME2;
+	new->acc[1] = XXH_PRIME2;
+	new->acc[2] = 0;
+	new->acc[3] = 0u - XXH_PRIME1;
+	new->pending_size = 0;
+
+	new->buffer = NULL;
+	new->buffer_size = 0;
+	new->target = NULL;
+
+	*ptr = new;
+}
+
+void checksum_free(struct checksum *ptr)
+{
+	free(ptr);
+}
+
+void checksum_update(struct checksum *ptr, const void *data, size_t size)
+{
+	assert(ptr != NULL);
+	ptr->bytes += size;
+	if (ptr->algorithms & CHECKSUM_CRC32)
+		ptr->crc = crc_update(ptr->crc, data, size);
+	if (ptr->algorithms & CHECKSUM_XXH32)
+		xxh_update(ptr, data, size);
+}
+
+uint32_t checksum_crc32(struct checksum *ptr)
+{
+	return ~(ptr->crc);
+}
+
+uint32_t checksum_xxh32(struct checksum *ptr)
+{
+	uint32_t hash = 0;
+	if (ptr->bytes >= 16) {
+		hash = rotl32(ptr->acc[0], 1) + rotl32(ptr->acc[1], 7)
+			+ rotl32(ptr->acc[2], 12) + rotl32(ptr->acc[3], 18);
+	} else {
+		hash = XXH_PRIME5; // seed 0
+	}
+	hash += (uint32_t)ptr->bytes;
+
+	size_t i = 0;
+	for (; i + 4 <= ptr->pending_size; i += 4) {
+		hash += read32(ptr->pending + i) * XXH_PRIME3;
+		hash = rotl32(hash, 17) * XXH_PRIME4;
+	}
+	for (; i < ptr->pending_size; i++) {
+		hash += ptr->pending[i] * XXH_PRIME5;
+		hash = rotl32(hash, 11) * XXH_PRIME1;
+	}
+
+	hash ^= hash >> 15;
+	hash *= XXH_PRIME2;
+	hash ^= hash >> 13;
+	hash *= XXH_PRIME3;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+// one line: the selected checksums, the size in bytes and the name
+int checksum_report(struct checksum *ptr, const char *name, FILE *fp)
+{
+	assert(ptr != NULL);
+	int rc = 0;
+	if (ptr->algorithms & CHECKSUM_CRC32)
+		rc |= (fprintf(fp, "crc32:%08lx ", (unsigned long)checksum_crc32(ptr)) < 0);
+	if (ptr->algorithms & CHECKSUM_XXH32)
+		rc |= (fprintf(fp, "xxh32:%08lx ", (unsigned long)checksum_xxh32(ptr)) < 0);
+	rc |= (fprintf(fp, "bytes:%llu  %s\n", ptr->bytes, name) < 0);
+	return rc;
+}
+
+// the report line, in the new file <name>.sum
+int checksum_write_sidecar(struct checksum *ptr, const char *name)
+{
+	assert(ptr != NULL);
+	assert(name != NULL);
+	int rc = 0;
+
+	char *sidecar = malloc(strlen(name) + strlen(".sum") + 1);
+	if (sidecar == NULL)
+		abort();
+	strcpy(sidecar, name);
+	strcat(sidecar, ".sum");
+
+	FILE *fp = fopen(sidecar, "wx");
+	if (fp == NULL) {
+		printf("Cannot open file '%s'\n", sidecar);
+		rc = 1;
+		goto out;
+	}
+	rc = checksum_report(ptr, name, fp);
+	if (fclose(fp) != 0)
+		rc = 1;
+out:
+	free(sidecar);
+	return rc;
+}
+
+/*
+ * A write-only stream that checksums everything written to it and passes
+ * it on to fp. With fp == NULL the data is only checksummed.
+ * checksum_fclose() closes the stream, but not fp.
+ */
+
+struct tee
+{
+	struct checksum *sum;
+	FILE *fp;
+};
+
+static bool tee_write(struct tee *ptr, const char *buffer, size_t size)
+{
+	checksum_update(ptr->sum, buffer, size);
+	if (ptr->fp != NULL && fwrite(buffer, 1, size, ptr->fp) != size)
+		return false;
+	return true;
+}
+
+static int tee_close(void *cookie)
+{
+	struct tee *ptr = cookie;
+	int rc = 0;
+	if (ptr->fp != NULL)
+		rc = fflush(ptr->fp);
+	free(ptr);
+	return rc;
+}
+
+#if defined(__GLIBC__)
+static ssize_t cookie_write(void *cookie, const char *buffer, size_t size)
+{
+	return tee_write(cookie, buffer, size) ? (ssize_t)size : 0;
+}
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+static int cookie_write(void *cookie, const char *buffer, int size)
+{
+	return tee_write(cookie, buffer, size) ? size : -1;
+}
+#endif
+
+FILE *checksum_fopen(struct checksum *ptr, FILE *fp)
+{
+	assert(ptr != NULL);
+	FILE *ret = NULL;
+	struct tee *cookie = malloc(sizeof(struct tee));
+	if (cookie == NULL)
+		abort();
+
+	cookie->sum = ptr;
+	cookie->fp = fp;
+
+#if defined(__GLIBC__)
+	cookie_io_functions_t io = {
+		.read = NULL,
+		.write = cookie_write,
+		.seek = NULL,
+		.close = tee_close
+	};
+	ret = fopencookie(cookie, "w", io);
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+	ret = funopen(cookie, NULL, cookie_write, NULL, tee_close);
+#endif
+
+	if (ret != NULL)
+		goto out;
+
+	// no custom streams in this C library
+	free(cookie);
+	ptr->target = fp;
+	ret = open_memstream(&(ptr->buffer), &(ptr->buffer_size));
+	if (ret == NULL)
+		abort();
+out:
+	return ret;
+}
+
+int checksum_fclose(struct checksum *ptr, FILE *stream)
+{
+	assert(ptr != NULL);
+	int rc = (fclose(stream) != 0);
+	if (ptr->buffer == NULL)
+		goto out;
+
+	checksum_update(ptr, ptr->buffer, ptr->buffer_size);
+	if (rc == 0 && ptr->target != NULL)
+		rc = (fwrite(ptr->buffer, 1, ptr->buffer_size, ptr->target) != ptr->buffer_size);
+
+	free(ptr->buffer);
+	ptr->buffer = NULL;
+	ptr->buffer_size = 0;
+	ptr->target = NULL;
+out:
+	return rc;
+}
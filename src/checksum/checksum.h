@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_CHECKSUM_H
+#define PIXMAP565_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * checksum:
+ *
+ * CRC-32 (IEEE 802.3) and XXH32, computed incrementally over the bytes
+ * of an output as they are written.
+ */
+
+#define CHECKSUM_CRC32 1u
+#define CHECKSUM_XXH32 2u
+
+struct checksum;
+
+void checksum_new(struct checksum **ptr, unsigned algorithms);
+void checksum_free(struct checksum *ptr);
+
+void checksum_update(struct checksum *ptr, const void *data, size_t size);
+uint32_t checksum_crc32(struct checksum *ptr);
+uint32_t checksum_xxh32(struct checksum *ptr);
+int checksum_report(struct checksum *ptr, const char *name, FILE *fp);
+int checksum_write_sidecar(struct checksum *ptr, const char *name);
+
+FILE *checksum_fopen(struct checksum *ptr, FILE *fp);
+int checksum_fclose(struct checksum *ptr, FILE *stream);
+
+#endif /* PIXMAP565_CHECKSUM_H */
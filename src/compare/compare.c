@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "compare.h"
+#include "file_utils.h"
+#include "format.h"
+#include "pixmap.h"
+
+struct row_stats
+{
+	unsigned long long different;
+	udword_t first; // the first and last different pixels, if any
+	udword_t last;
+	uint64_t sse[3]; // sum of squared channel differences
+};
+
+static void compare_scalar(const uint16_t *a, const uint16_t *b, udword_t from, udword_t to,
+	const struct pixel_format *format, struct row_stats *stats)
+{
+	for (udword_t x = from; x < to; x++) {
+		if (a[x] == b[x])
+			continue;
+
+		if (stats->different == 0)
+			stats->first = x;
+		stats->last = x;
+		stats->different++;
+		for (int c = 0; c < 3; c++) {
+			long d = (long)((a[x] & format->mask[c]) >> format->shift[c])
+				- (long)((b[x] & format->mask[c]) >> format->shift[c]);
+			stats->sse[c] += d * d;
+		}
+	}
+}
+
+#if defined(__SSE2__)
+/*
+ * 8 pixels at a time. The squares of the channel differences are summed in
+ * pairs into 32 bit lanes, which are moved to 64 bits before they can wrap.
+ */
+static void compare_row(const uint16_t *a, const uint16_t *b, udword_t width,
+	const struct pixel_format *format, struct row_stats *stats)
+{
+	__m128i mask[3];
+	__m128i shift[3];
+	uint32_t flush = UINT32_MAX;
+	for (int c = 0; c < 3; c++) {
+		mask[c] = _mm_set1_epi16((short)format->mask[c]);
+		shift[c] = _mm_cvtsi32_si128(format->shift[c]);
+
+		uint32_t max = (1u << format->width[c]) - 1;
+		if (max != 0 && INT32_MAX / (2 * max * max) < flush)
+			flush = INT32_MAX / (2 * max * max);
+	}
+
+	__m128i acc[3] = {_mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128()};
+	uint32_t pending = 0;
+	udword_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+		unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi16(va, vb));
+		if (same == 0xffff)
+			continue;
+
+		unsigned diff = ~same & 0xffff;
+		if (stats->different == 0)
+			stats->first = x + __builtin_ctz(diff) / 2;
+		stats->last = x + (31 - __builtin_clz(diff)) / 2;
+		stats->different += __builtin_popcount(diff) / 2;
+
+		for (int c = 0; c < 3; c++) {
+			__m128i ca = _mm_srl_epi16(_mm_and_si128(va, mask[c]), shift[c]);
+			__m128i cb = _mm_srl_epi16(_mm_and_si128(vb, mask[c]), shift[c]);
+			__m128i d = _mm_sub_epi16(ca, cb);
+			acc[c] = _mm_add_epi32(acc[c], _mm_madd_epi16(d, d));
+		}
+
+		if (++pending == flush) {
+			for (int c = 0; c < 3; c++) {
+				uint32_t lanes[4];
+				_mm_storeu_si128((__m128i *)lanes, acc[c]);
+				stats->sse[c] += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+				acc[c] = _mm_setzero_si128();
+			}
+			pending = 0;
+		}
+	}
+	for (int c = 0; c < 3; c++) {
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i *)lanes, acc[c]);
+		stats->sse[c] += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+
+	compare_scalar(a, b, x, width, format, stats);
+}
+#else
+static void compare_row(const uint16_t *a, const uint16_t *b, udword_t width,
+	const struct pixel_format *format, struct row_stats *stats)
+{
+	compare_scalar(a, b, 0, width, format, stats);
+}
+#endif
+
+/*
+ * Both pixmaps must be in format. With equal_only set, stop at the first
+ * row that differs and only fill result->equal.
+ */
+int compare_pixmaps(struct pixmap *a, struct pixmap *b, const struct pixel_format *format, bool equal_only, struct compare_result *result)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+	assert(format != NULL);
+	assert(result != NULL);
+
+	udword_t width = pixmap_get_x(a);
+	udword_t height = pixmap_get_y(a);
+	if (width != pixmap_get_x(b) || height != pixmap_get_y(b)) {
+		print_error();
+		fprintf(stderr, "The images are %llux%llu and %llux%llu.\n",
+			(unsigned long long)width, (unsigned long long)height,
+			(unsigned long long)pixmap_get_x(b), (unsigned long long)pixmap_get_y(b));
+		return 1;
+	}
+
+	memset(result, 0, sizeof(struct compare_result));
+	result->equal = true;
+	result->pixels = (unsigned long long)width * height;
+
+	uint16_t **rows_a = pixmap_get_rows(a);
+	uint16_t **rows_b = pixmap_get_rows(b);
+	uint64_t sse[3] = {0, 0, 0};
+	udword_t left = width;
+	udword_t right = 0;
+	udword_t top = height;
+	udword_t bottom = 0;
+	for (udword_t y = 0; y < height; y++) {
+		if (memcmp(rows_a[y], rows_b[y], (size_t)width * sizeof(uint16_t)) == 0)
+			continue;
+
+		result->equal = false;
+		if (equal_only)
+			break;
+
+		struct row_stats stats = {0};
+		compare_row(rows_a[y], rows_b[y], width, format, &stats);
+		result->different += stats.different;
+		for (int c = 0; c < 3; c++)
+			sse[c] += stats.sse[c];
+
+		if (stats.first < left)
+			left = stats.first;
+		if (stats.last + 1 > right)
+			right = stats.last + 1;
+		if (top == height)
+			top = y;
+		bottom = y + 1;
+	}
+	free(rows_a);
+	free(rows_b);
+
+	if (!result->equal && !equal_only) {
+		result->box.x = left;
+		result->box.y = top;
+		result->box.width = right - left;
+		result->box.height = bottom - top;
+	}
+	for (int c = 0; c < 3; c++) {
+		double max = (1u << format->width[c]) - 1;
+		double mse = (double)sse[c] / result->pixels;
+		result->psnr[c] = (mse == 0) ? INFINITY : 10 * log10(max * max / mse);
+	}
+	return 0;
+}
+
+int compare_report(const struct compare_result *result, bool equal_only, FILE *fp)
+{
+	assert(result != NULL);
+	assert(fp != NULL);
+
+	fprintf(fp, "equal: %s\n", result->equal ? "yes" : "no");
+	if (equal_only || result->equal)
+		return ferror(fp);
+
+	fprintf(fp, "different pixels: %llu of %llu\n", result->different, result->pixels);
+	fprintf(fp, "bounding box: %llu,%llu,%llu,%llu\n",
+		(unsigned long long)result->box.x, (unsigned long long)result->box.y,
+		(unsigned long long)result->box.width, (unsigned long long)result->box.height);
+
+	static const char *names[3] = {"red", "green", "blue"};
+	for (int c = 0; c < 3; c++) {
+		if (isinf(result->psnr[c]))
+			fprintf(fp, "psnr %s: inf\n", names[c]);
+		else
+			fprintf(fp, "psnr %s: %.2f dB\n", names[c], result->psnr[c]);
+	}
+	return ferror(fp);
+}
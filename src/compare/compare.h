@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_COMPARE_H
+#define PIXMAP565_COMPARE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "file_utils.h"
+#include "pixmap.h"
+
+/*
+ * compare:
+ *
+ * The distance between two images of the same size and pixel format: the
+ * pixels that differ, their bounding box and the PSNR of each color channel,
+ * at the bit depth of the channel.
+ */
+
+struct pixel_format;
+
+struct compare_result
+{
+	bool equal;
+	unsigned long long different; // pixels
+	unsigned long long pixels;
+	struct region box;            // of the different pixels
+	double psnr[3];               // red, green, blue, in dB
+};
+
+int compare_pixmaps(struct pixmap *a, struct pixmap *b, const struct pixel_format *format, bool equal_only, struct compare_result *result);
+int compare_report(const struct compare_result *result, bool equal_only, FILE *fp);
+
+#endif /* PIXMAP565_COMPARE_H */
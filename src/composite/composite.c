@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "composite.h"
+#include "file_utils.h"
+#include "format.h"
+#include "picture.h"
+#include "pixmap.h"
+
+struct composite
+{
+	bool keyed;
+	uint16_t key; // a fully transparent input pixel
+
+	unsigned char color[4]; // without an image
+
+	struct pixmap *image;
+	uint16_t **rows;
+	struct pixel_format format; // of the image
+	udword_t x;                 // of the region under the input
+	udword_t y;
+};
+
+void composite_new(struct composite **ptr)
+{
+	struct composite *new = malloc(sizeof(struct composite));
+	if (new == NULL)
+		abort();
+
+	new->keyed = false;
+	new->key = 0;
+	memset(new->color, 0, sizeof(new->color));
+	new->color[3] = UCHAR_MAX;
+	new->image = NULL;
+	new->rows = NULL;
+	new->x = 0;
+	new->y = 0;
+
+	*ptr = new;
+}
+
+void composite_free(struct composite *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	free(ptr->rows);
+	pixmap_free(ptr->image);
+	free(ptr);
+}
+
+void composite_set_key(struct composite *ptr, uint16_t key)
+{
+	assert(ptr != NULL);
+	ptr->keyed = true;
+	ptr->key = key;
+}
+
+// rgb is 0xRRGGBB
+void composite_set_color(struct composite *ptr, udword_t rgb)
+{
+	assert(ptr != NULL);
+	ptr->color[0] = (rgb >> 16) & 0xff;
+	ptr->color[1] = (rgb >> 8) & 0xff;
+	ptr->color[2] = rgb & 0xff;
+}
+
+// the background picture, the input is placed at (x, y) of it
+int composite_load_background(struct composite *ptr, const char *name, udword_t x, udword_t y)
+{
+	assert(ptr != NULL);
+	assert(ptr->image == NULL);
+	assert(name != NULL);
+
+	FILE *fp = fopen(name, "r");
+	if (fp == NULL) {
+		printf("Cannot open file '%s'\n", name);
+		return 1;
+	}
+
+	struct picture *pic = NULL;
+	picture_new(&pic, NULL);
+	int rc = picture_read(pic, fp);
+	if (rc == 0) {
+		ptr->format = *picture_get_format(pic);
+		ptr->image = picture_get_pixmap(pic);
+		ptr->rows = pixmap_get_rows(ptr->image);
+		ptr->x = x;
+		ptr->y = y;
+	}
+	picture_free(pic);
+	fclose(fp);
+	return rc;
+}
+
+/*
+ * rgba = rgba over under, for count pixels of 4 bytes. The result is opaque.
+ * The division by 255 is (t + (t >> 8)) >> 8, with t = x + 128.
+ */
+static void blend(unsigned char *rgba, const unsigned char *under, size_t count)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi16(255);
+	const __m128i half = _mm_set1_epi16(128);
+	const __m128i opaque = _mm_set1_epi32((int)0xff000000);
+	for (; i + 4 <= count; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(rgba + 4 * i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(under + 4 * i));
+		__m128i out[2];
+		for (int half_index = 0; half_index < 2; half_index++) {
+			__m128i s16 = half_index ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+			__m128i d16 = half_index ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+			// the alpha of each pixel, in its 4 lanes
+			__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xff), 0xff);
+			__m128i t = _mm_add_epi16(_mm_mullo_epi16(s16, a), _mm_mullo_epi16(d16, _mm_sub_epi16(full, a)));
+			t = _mm_add_epi16(t, half);
+			out[half_index] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+		}
+		__m128i result = _mm_or_si128(_mm_packus_epi16(out[0], out[1]), opaque);
+		_mm_storeu_si128((__m128i *)(rgba + 4 * i), result);
+	}
+#endif
+	for (; i < count; i++) {
+		unsigned a = rgba[4 * i + 3];
+		for (int c = 0; c < 3; c++) {
+			unsigned t = rgba[4 * i + c] * a + under[4 * i + c] * (255 - a) + 128;
+			rgba[4 * i + c] = (t + (t >> 8)) >> 8;
+		}
+		rgba[4 * i + 3] = UCHAR_MAX;
+	}
+}
+
+/*
+ * Replace the pixels of pix, in the from format, with the pixels
+ * composited over the background, in the to format.
+ */
+int composite_apply(const struct composite *ptr, struct pixmap *pix, const struct pixel_format *from, const struct pixel_format *to)
+{
+	assert(ptr != NULL);
+	assert(pix != NULL);
+	assert(from != NULL);
+	assert(to != NULL);
+
+	udword_t width = pixmap_get_x(pix);
+	udword_t height = pixmap_get_y(pix);
+	if (ptr->image != NULL) {
+		udword_t image_width = pixmap_get_x(ptr->image);
+		udword_t image_height = pixmap_get_y(ptr->image);
+		if (ptr->x > image_width || width > image_width - ptr->x
+		    || ptr->y > image_height || height > image_height - ptr->y) {
+			print_error();
+			fprintf(stderr, "The %llux%llu image at (%llu, %llu) is outside of the %llux%llu background.\n",
+				(unsigned long long)width, (unsigned long long)height,
+				(unsigned long long)ptr->x, (unsigned long long)ptr->y,
+				(unsigned long long)image_width, (unsigned long long)image_height);
+			return 1;
+		}
+	}
+
+	unsigned char *rgba = malloc((size_t)width * 4 + 1);
+	unsigned char *under = malloc((size_t)width * 4 + 1);
+	if (rgba == NULL || under == NULL)
+		abort();
+
+	if (ptr->image == NULL) {
+		for (udword_t x = 0; x < width; x++)
+			memcpy(under + 4 * x, ptr->color, 4);
+	}
+
+	uint16_t **rows = pixmap_get_rows(pix);
+	for (udword_t y = 0; y < height; y++) {
+		uint16_t *row = rows[y];
+		for (udword_t x = 0; x < width; x++) {
+			format_unpack(from, row[x], rgba + 4 * x);
+			if (ptr->keyed && row[x] == ptr->key)
+				rgba[4 * x + 3] = 0;
+		}
+		if (ptr->image != NULL) {
+			const uint16_t *back = ptr->rows[ptr->y + y] + ptr->x;
+			for (udword_t x = 0; x < width; x++)
+				format_unpack(&(ptr->format), back[x], under + 4 * x);
+		}
+
+		blend(rgba, under, width);
+
+		for (udword_t x = 0; x < width; x++)
+			row[x] = format_pack(to, rgba + 4 * x);
+	}
+	free(rows);
+	free(rgba);
+	free(under);
+	return 0;
+}
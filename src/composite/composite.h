@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_COMPOSITE_H
+#define PIXMAP565_COMPOSITE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "file_utils.h"
+#include "pixmap.h"
+
+/*
+ * composite:
+ *
+ * Flatten an image with alpha, or with a color key, over a background
+ * color or over a region of a background picture. The background is loaded
+ * once and can be shared by every conversion that reads it.
+ */
+
+struct composite;
+struct pixel_format;
+
+void composite_new(struct composite **ptr);
+void composite_free(struct composite *ptr);
+
+void composite_set_key(struct composite *ptr, uint16_t key);
+void composite_set_color(struct composite *ptr, udword_t rgb);
+int composite_load_background(struct composite *ptr, const char *name, udword_t x, udword_t y);
+
+int composite_apply(const struct composite *ptr, struct pixmap *pix, const struct pixel_format *from, const struct pixel_format *to);
+
+#endif /* PIXMAP565_COMPOSITE_H */
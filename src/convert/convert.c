@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "composite.h"
+#include "convert.h"
+#include "display.h"
+#include "file_utils.h"
+#include "format.h"
+#include "gray.h"
+#include "layout.h"
+#include "palette.h"
+#include "perf.h"
+#include "picture.h"
+#include "pixmap.h"
+#include "pointop.h"
+#include "truecolor.h"
+
+// convert the pixels of pix in place
+static void convert_format(struct pixmap *pix, const struct pixel_format *from, const struct pixel_format *to)
+{
+	if (format_equal(from, to))
+		return;
+
+	uint16_t **rows = pixmap_get_rows(pix);
+	for (udword_t i = 0; i < pixmap_get_y(pix); i++)
+		format_convert(from, to, rows[i], pixmap_get_x(pix));
+	free(rows);
+}
+
+static int write_zeros(FILE *fp, size_t count)
+{
+	static const unsigned char zero[PIXMAP_MAX_ALIGNMENT] = {0};
+	while (count > 0) {
+		size_t n = count < sizeof(zero) ? count : sizeof(zero);
+		if (fwrite(zero, 1, n, fp) != n)
+			return 1;
+		count -= n;
+	}
+	return 0;
+}
+
+// read the input into *pix, in the output format, pic keeps the header of a picture input
+int convert_read(const struct options *opt, FILE *infile, bool in_pic, struct picture *pic, struct pixmap **pix, struct arena *arena)
+{
+	assert(opt != NULL);
+	assert(infile != NULL);
+	assert(pic != NULL);
+	assert(pix != NULL);
+	assert(*pix == NULL);
+	int rc = 0;
+
+	if (!in_pic && opt->width == 0) {
+		print_error();
+		fprintf(stderr, "The width of the input pixmap is not set.\n");
+		rc = 1;
+		goto out;
+	}
+
+	const struct pixel_format *from = opt->in_format;
+	if (opt->crop_is_set && in_pic) {
+		rc = picture_read_region(pic, infile, &(opt->crop));
+		if (rc)
+			goto out;
+		*pix = picture_get_pixmap(pic);
+	} else if (opt->crop_is_set) {
+		perf_enter(perf_pixels);
+		pixmap_new(pix, opt->crop.width, arena);
+		rc = pixmap_read_region(*pix, infile, opt->width, opt->in_align, &(opt->crop));
+		perf_leave(perf_pixels);
+	} else if (in_pic) {
+		rc = picture_read(pic, infile);
+		if (rc)
+			goto out;
+		*pix = picture_get_pixmap(pic);
+	} else {
+		perf_enter(perf_pixels);
+		pixmap_new(pix, opt->width, arena);
+		if (opt->in_layout != NULL)
+			rc = layout_read(*pix, opt->in_layout, infile);
+		else
+			rc = pixmap_read(*pix, infile, opt->in_align);
+		perf_leave(perf_pixels);
+	}
+	if (rc)
+		goto out;
+
+	if (in_pic)
+		from = picture_get_format(pic);
+	perf_enter(perf_convert);
+	if (opt->composite != NULL)
+		rc = composite_apply(opt->composite, *pix, from, opt->out_format);
+	else
+		convert_format(*pix, from, opt->out_format);
+	if (rc == 0 && opt->pointop != NULL)
+		rc = pointop_apply(opt->pointop, *pix, opt->out_format);
+	perf_leave(perf_convert);
+out:
+	return rc;
+}
+
+// write pix as 8 bit indices, an 8bpp picture or the raw indexed layout
+static int convert_write_indexed(const struct options *opt, FILE *outfile, bool out_pic, struct picture *pic, struct pixmap *pix)
+{
+	struct palette *pal = NULL;
+	unsigned char *indices = NULL;
+
+	palette_new(&pal, pix, opt->out_format);
+	int rc = palette_map(pal, pix, &indices);
+	if (rc)
+		goto out;
+
+	if (out_pic) {
+		udword_t colors[PALETTE_SIZE];
+		palette_get_rgb(pal, colors);
+		picture_set_top_down(pic, opt->top_down);
+		picture_set_indexed(pic, pixmap_get_x(pix), pixmap_get_y(pix), 8, colors, palette_get_count(pal), indices);
+		rc = picture_write(pic, outfile);
+	} else {
+		rc = palette_write(pal, indices, pixmap_get_x(pix), pixmap_get_y(pix),
+			opt->out_align, opt->buffer_align, outfile);
+	}
+out:
+	free(indices);
+	palette_free(pal);
+	pixmap_free(pix);
+	return rc;
+}
+
+// the BMP bit order is fixed, lsb_first only applies to pixmaps
+static int convert_write_gray(const struct options *opt, FILE *outfile, bool out_pic, struct picture *pic, struct pixmap *pix)
+{
+	struct gray_options gray = *(opt->gray);
+	unsigned char *packed = NULL;
+	size_t stride = 0;
+	if (out_pic)
+		gray.lsb_first = false;
+
+	int rc = gray_pack(pix, opt->out_format, &gray, out_pic ? 1 : opt->out_align, &packed, &stride);
+	if (rc)
+		goto out;
+
+	size_t size = stride * pixmap_get_y(pix);
+	if (out_pic) {
+		udword_t colors[16];
+		gray_get_rgb(&gray, colors);
+		picture_set_top_down(pic, opt->top_down);
+		picture_set_indexed(pic, pixmap_get_x(pix), pixmap_get_y(pix), gray.bits, colors, 1u << gray.bits, packed);
+		rc = picture_write(pic, outfile);
+	} else {
+		rc = (fwrite(packed, 1, size, outfile) != size);
+		if (rc == 0)
+			rc = write_zeros(outfile, (opt->buffer_align - size % opt->buffer_align) % opt->buffer_align);
+		if (rc) {
+			print_error();
+			fprintf(stderr, "Cannot write the output file.\n");
+		}
+	}
+out:
+	free(packed);
+	pixmap_free(pix);
+	return rc;
+}
+
+static int convert_write_truecolor(const struct options *opt, FILE *outfile, bool out_pic, struct picture *pic, struct pixmap *pix)
+{
+	unsigned char *packed = NULL;
+	size_t stride = 0;
+
+	int rc = truecolor_pack(pix, opt->out_format, opt->truecolor, out_pic ? 1 : opt->out_align, &packed, &stride);
+	if (rc)
+		goto out;
+
+	size_t size = stride * pixmap_get_y(pix);
+	if (out_pic) {
+		picture_set_top_down(pic, opt->top_down);
+		picture_set_truecolor(pic, pixmap_get_x(pix), pixmap_get_y(pix), opt->truecolor, packed);
+		rc = picture_write(pic, outfile);
+	} else {
+		rc = (fwrite(packed, 1, size, outfile) != size);
+		if (rc == 0)
+			rc = write_zeros(outfile, (opt->buffer_align - size % opt->buffer_align) % opt->buffer_align);
+		if (rc) {
+			print_error();
+			fprintf(stderr, "Cannot write the output file.\n");
+		}
+	}
+out:
+	free(packed);
+	pixmap_free(pix);
+	return rc;
+}
+
+// write pix, which is consumed
+int convert_write(const struct options *opt, FILE *outfile, bool out_pic, struct picture *pic, struct pixmap *pix)
+{
+	assert(opt != NULL);
+	assert(outfile != NULL);
+	assert(pic != NULL);
+	assert(pix != NULL);
+	int rc = 0;
+
+	perf_enter(perf_write);
+	if (opt->indexed) {
+		rc = convert_write_indexed(opt, outfile, out_pic, pic, pix);
+	} else if (opt->gray != NULL) {
+		rc = convert_write_gray(opt, outfile, out_pic, pic, pix);
+	} else if (opt->truecolor != 0) {
+		rc = convert_write_truecolor(opt, outfile, out_pic, pic, pix);
+	} else if (opt->display != NULL) {
+		rc = display_write(pix, opt->out_format, opt->display, outfile);
+		pixmap_free(pix);
+	} else if (out_pic) {
+		picture_set_top_down(pic, opt->top_down);
+		picture_set_format(pic, opt->out_format);
+		picture_set_pixmap(pic, pix);
+		rc = picture_write(pic, outfile);
+	} else {
+		uint64_t size = 0;
+		if (opt->out_layout != NULL) {
+			size = layout_size(opt->out_layout, pixmap_get_x(pix), pixmap_get_y(pix));
+			rc = layout_write(pix, opt->out_layout, outfile);
+		} else {
+			// the pixmap is in memory, its size fits
+			pixmap_size(pixmap_get_x(pix), pixmap_get_y(pix), opt->out_align, &size);
+			rc = pixmap_write(pix, outfile, opt->out_align);
+		}
+		if (rc == 0)
+			rc = write_zeros(outfile, (opt->buffer_align - size % opt->buffer_align) % opt->buffer_align);
+		pixmap_free(pix);
+	}
+	perf_leave(perf_write);
+	return rc;
+}
+
+int convert(const struct options *opt, FILE *infile, bool in_pic, FILE *outfile, bool out_pic, struct arena *arena)
+{
+	struct picture *pic = NULL;
+	struct pixmap *pix = NULL;
+
+	picture_new(&pic, arena);
+	int rc = convert_read(opt, infile, in_pic, pic, &pix, arena);
+	if (rc == 0) {
+		rc = convert_write(opt, outfile, out_pic, pic, pix);
+		pix = NULL;
+	}
+
+	pixmap_free(pix);
+	picture_free(pic);
+	return rc;
+}
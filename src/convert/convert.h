@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_CONVERT_H
+#define PIXMAP565_CONVERT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "arena.h"
+#include "file_utils.h"
+#include "picture.h"
+#include "pixmap.h"
+
+struct composite;
+struct display_options;
+struct gray_options;
+struct layout;
+struct pixel_format;
+struct pointop;
+
+/*
+ * convert:
+ *
+ * The read and write steps of one conversion, shared by the single file
+ * and the batch modes.
+ */
+
+struct options
+{
+	udword_t width; // of the input pixmap
+	bool top_down;  // write the picture rows top-down
+	bool crop_is_set;
+	struct region crop;
+	unsigned checksum; // CHECKSUM_* of the outputs, or 0
+	bool hash_only;    // checksum the outputs without writing them
+	bool sidecar;      // also write the checksums to <outfile>.sum
+	const struct pixel_format *in_format;  // of the input pixmap
+	const struct pixel_format *out_format; // of the output
+	bool indexed; // write 8 bit indices and a palette
+	const struct gray_options *gray; // write 1 or 4 bit gray levels, or NULL
+	unsigned truecolor; // write 24 or 32 bit pixels, or 0
+	const struct composite *composite; // flatten the input over it, or NULL
+	const struct pointop *pointop;     // adjust the output pixels, or NULL
+	const struct display_options *display; // write a display command stream, or NULL
+	const struct layout *in_layout;  // of the input pixmap, or NULL for rows
+	const struct layout *out_layout; // of the output pixmap, or NULL for rows
+	udword_t in_align;     // of the rows of the input pixmap
+	udword_t out_align;    // of the rows of the output pixmap
+	udword_t buffer_align; // of the size of the whole output pixmap
+};
+
+int convert_read(const struct options *opt, FILE *infile, bool in_pic, struct picture *pic, struct pixmap **pix, struct arena *arena);
+int convert_write(const struct options *opt, FILE *outfile, bool out_pic, struct picture *pic, struct pixmap *pix);
+int convert(const struct options *opt, FILE *infile, bool in_pic, FILE *outfile, bool out_pic, struct arena *arena);
+
+#endif /* PIXMAP565_CONVERT_H */
@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "display.h"
+#include "file_utils.h"
+#include "format.h"
+#include "pixmap.h"
+
+struct controller
+{
+	const char *name;
+	enum display_controller id;
+	unsigned char column_address; // CASET
+	unsigned char row_address;    // PASET on the ILI9341, RASET on the ST7789
+	unsigned char memory_write;   // RAMWR
+	unsigned char pixel_format;   // COLMOD
+	unsigned char bits16;         // the COLMOD data for 16 bit pixels
+	unsigned char memory_access;  // MADCTL
+	unsigned char exchange;       // the MADCTL bit that exchanges rows and columns
+	unsigned char bgr;            // the MADCTL bit of the BGR order
+	udword_t width;               // of the frame memory, not rotated
+	udword_t height;
+};
+
+static const struct controller controllers[] = {
+	{"ili9341", display_ili9341, 0x2a, 0x2b, 0x2c, 0x3a, 0x55, 0x36, 0x20, 0x08, 240, 320},
+	{"st7789",  display_st7789,  0x2a, 0x2b, 0x2c, 0x3a, 0x55, 0x36, 0x20, 0x08, 240, 320}
+};
+
+int display_find(const char *name, enum display_controller *controller)
+{
+	for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+		if (strcmp(name, controllers[i].name) == 0) {
+			*controller = controllers[i].id;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// with fp == NULL only count the records and the bytes
+struct writer
+{
+	FILE *fp;
+	udword_t alignment;
+	unsigned long long offset;
+	udword_t records;
+	int rc;
+};
+
+static void put(struct writer *w, const void *data, size_t size)
+{
+	if (w->fp != NULL && w->rc == 0)
+		w->rc = (fwrite(data, 1, size, w->fp) != size);
+	w->offset += size;
+}
+
+static void put_zeros(struct writer *w, size_t count)
+{
+	static const unsigned char zero[64] = {0};
+	while (count > 0) {
+		size_t n = count < sizeof(zero) ? count : sizeof(zero);
+		put(w, zero, n);
+		count -= n;
+	}
+}
+
+static void record(struct writer *w, unsigned char command, const void *data, udword_t size)
+{
+	unsigned long long start = w->offset + DISPLAY_RECORD_BYTES;
+	put_zeros(w, (w->alignment - start % w->alignment) % w->alignment);
+
+	unsigned char header[DISPLAY_RECORD_BYTES] = {
+		command, 0, 0, 0,
+		size & 0xff, (size >> 8) & 0xff, (size >> 16) & 0xff, (size >> 24) & 0xff
+	};
+	put(w, header, sizeof(header));
+	put(w, data, size);
+	w->records++;
+}
+
+// an address window command: start and end, big-endian
+static void window(struct writer *w, unsigned char command, udword_t start, udword_t end)
+{
+	unsigned char data[4] = {
+		(start >> 8) & 0xff, start & 0xff,
+		(end >> 8) & 0xff, end & 0xff
+	};
+	record(w, command, data, sizeof(data));
+}
+
+static void pixels(struct writer *w, unsigned char command, unsigned char *buffer, uint16_t **rows, udword_t x, udword_t y, udword_t width, udword_t height)
+{
+	size_t n = 0;
+	for (udword_t j = 0; w->fp != NULL && j < height; j++) {
+		for (udword_t i = 0; i < width; i++) {
+			uint16_t pixel = rows[y + j][x + i];
+			buffer[n++] = pixel >> 8;
+			buffer[n++] = pixel & 0xff;
+		}
+	}
+	record(w, command, buffer, (udword_t)width * height * 2);
+}
+
+static void emit(struct writer *w, const struct controller *c, const struct display_options *opt,
+	bool bgr, uint16_t **rows, udword_t width, udword_t height, unsigned char *buffer)
+{
+	record(w, c->pixel_format, &(c->bits16), 1);
+	unsigned char access = (opt->landscape ? c->exchange : 0) | (bgr ? c->bgr : 0);
+	if (access != 0)
+		record(w, c->memory_access, &access, 1);
+
+	udword_t chunk_pixels = opt->chunk / 2;
+	if (width <= chunk_pixels) {
+		udword_t band = chunk_pixels / width;
+		window(w, c->column_address, opt->x, opt->x + width - 1);
+		for (udword_t y = 0; y < height; y += band) {
+			udword_t count = (band < height - y) ? band : height - y;
+			window(w, c->row_address, opt->y + y, opt->y + y + count - 1);
+			pixels(w, c->memory_write, buffer, rows, 0, y, width, count);
+		}
+		return;
+	}
+
+	for (udword_t y = 0; y < height; y++) {
+		window(w, c->row_address, opt->y + y, opt->y + y);
+		for (udword_t x = 0; x < width; x += chunk_pixels) {
+			udword_t count = (chunk_pixels < width - x) ? chunk_pixels : width - x;
+			window(w, c->column_address, opt->x + x, opt->x + x + count - 1);
+			pixels(w, c->memory_write, buffer, rows, x, y, count, 1);
+		}
+	}
+}
+
+// the controllers take 16 bit pixels in RGB or BGR order only
+int display_check_format(const struct pixel_format *format)
+{
+	if (format_equal(format, format_get(format_rgb565)) || format_equal(format, format_get(format_bgr565)))
+		return 0;
+
+	print_error();
+	fprintf(stderr, "The display takes rgb565 or bgr565 pixels, not %s.\n", format_name(format));
+	return 1;
+}
+
+int display_write(struct pixmap *pix, const struct pixel_format *format, const struct display_options *opt, FILE *fp)
+{
+	assert(pix != NULL);
+	assert(format != NULL);
+	assert(opt != NULL);
+	assert(fp != NULL);
+
+	if (display_check_format(format))
+		return 1;
+	bool bgr = format_equal(format, format_get(format_bgr565));
+
+	const struct controller *c = NULL;
+	for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+		if (controllers[i].id == opt->controller)
+			c = &(controllers[i]);
+	}
+	assert(c != NULL);
+
+	udword_t width = pixmap_get_x(pix);
+	udword_t height = pixmap_get_y(pix);
+	udword_t memory_width = opt->landscape ? c->height : c->width;
+	udword_t memory_height = opt->landscape ? c->width : c->height;
+	if (width == 0 || height == 0 || opt->x >= memory_width || width > memory_width - opt->x
+	    || opt->y >= memory_height || height > memory_height - opt->y) {
+		print_error();
+		fprintf(stderr, "The %llux%llu image at (%llu, %llu) is outside of the %llux%llu %s frame memory.\n",
+			(unsigned long long)width, (unsigned long long)height,
+			(unsigned long long)opt->x, (unsigned long long)opt->y,
+			(unsigned long long)memory_width, (unsigned long long)memory_height, c->name);
+		return 1;
+	}
+	if (opt->chunk < 2 || opt->alignment == 0) {
+		print_error();
+		fprintf(stderr, "The DMA chunk must hold a pixel, and the alignment can't be 0.\n");
+		return 1;
+	}
+
+	uint16_t **rows = pixmap_get_rows(pix);
+	unsigned char *buffer = malloc(opt->chunk);
+	if (buffer == NULL)
+		abort();
+
+	// count the records for the header, then write them
+	struct writer w = {NULL, opt->alignment, DISPLAY_HEADER_BYTES, 0, 0};
+	emit(&w, c, opt, bgr, rows, width, height, buffer);
+
+	unsigned char header[DISPLAY_HEADER_BYTES] = {0};
+	memcpy(header, DISPLAY_MAGIC, 4);
+	header[4] = c->id;
+	for (int i = 0; i < 4; i++) {
+		header[8 + i] = (w.records >> (8 * i)) & 0xff;
+		header[12 + i] = (opt->alignment >> (8 * i)) & 0xff;
+	}
+
+	w = (struct writer){fp, opt->alignment, 0, 0, 0};
+	put(&w, header, sizeof(header));
+	emit(&w, c, opt, bgr, rows, width, height, buffer);
+
+	free(buffer);
+	free(rows);
+	if (w.rc) {
+		print_error();
+		fprintf(stderr, "Cannot write the output file.\n");
+	}
+	return w.rc;
+}
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_DISPLAY_H
+#define PIXMAP565_DISPLAY_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "file_utils.h"
+#include "pixmap.h"
+
+/*
+ * display:
+ *
+ * A command stream for ILI9341 and ST7789 controllers, ready for DMA.
+ * All integers of the container are little-endian, the command data is in
+ * controller (big-endian) byte order.
+ *
+ * header (16 bytes):
+ *   magic "D565", controller (2 bytes), 0 (2 bytes), record count, alignment
+ * records, each one preceded by the zero bytes that align its data:
+ *   command (1 byte), 0 (3 bytes), data bytes, data
+ *
+ * The frame memory is 240x320, or 320x240 in landscape. The pixels are
+ * rgb565, or bgr565 with the BGR bit of MADCTL. The stream sets 16 bit
+ * pixels, and MADCTL in landscape or for bgr565, then writes the image
+ * with a column and a row address window and a memory write per band of
+ * rows. The bands are as tall as fits in one DMA chunk, a row wider than a
+ * chunk is written in rectangles of one row.
+ */
+
+#define DISPLAY_MAGIC "D565"
+#define DISPLAY_HEADER_BYTES 16u
+#define DISPLAY_RECORD_BYTES 8u
+#define DISPLAY_CHUNK 65534u
+#define DISPLAY_ALIGNMENT 4u
+
+enum display_controller {
+	display_ili9341 = 1,
+	display_st7789 = 2
+};
+
+struct pixel_format;
+
+struct display_options
+{
+	enum display_controller controller;
+	udword_t x;         // the top left of the image on the display
+	udword_t y;
+	udword_t chunk;     // bytes of pixel data per memory write, at most
+	udword_t alignment; // of the data of every record
+	bool landscape;     // exchange the rows and the columns of the frame memory
+};
+
+int display_find(const char *name, enum display_controller *controller);
+int display_check_format(const struct pixel_format *format);
+int display_write(struct pixmap *pix, const struct pixel_format *format, const struct display_options *opt, FILE *fp);
+
+#endif /* PIXMAP565_DISPLAY_H */
@@ -0,0 +1,494 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#define _GNU_SOURCE // open_memstream()
+
+#include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "embed.h"
+#include "file_utils.h"
+
+enum embed_kind {
+	embed_elf,
+	embed_c,
+	embed_asm
+};
+
+struct machine
+{
+	const char *name;
+	bool is64;
+	uword_t id;     // e_machine
+	udword_t flags; // e_flags
+};
+
+static const struct machine machines[] = {
+	{"arm",     false,  40, 0x05000000}, // EABI version 5
+	{"aarch64", true,  183, 0},
+	{"i386",    false,   3, 0},
+	{"x86_64",  true,   62, 0}
+};
+
+struct embed
+{
+	enum embed_kind kind;
+	const struct machine *machine;
+	char *symbol;
+	udword_t alignment;
+
+	FILE *sink;
+	FILE *stream; // the memory stream of data, while it is open
+	char *data;
+	size_t size;
+};
+
+int embed_new(struct embed **ptr, const char *spec)
+{
+	assert(ptr != NULL);
+	assert(*ptr == NULL);
+
+	enum embed_kind kind;
+	const struct machine *machine = &(machines[0]);
+	const char *comma = strchr(spec, ',');
+	size_t length = (comma != NULL) ? (size_t)(comma - spec) : strlen(spec);
+	if (length == 3 && strncmp(spec, "elf", 3) == 0) {
+		kind = embed_elf;
+		if (comma != NULL) {
+			machine = NULL;
+			for (size_t i = 0; i < sizeof(machines) / sizeof(machines[0]); i++) {
+				if (strcmp(comma + 1, machines[i].name) == 0)
+					machine = &(machines[i]);
+			}
+			if (machine == NULL)
+				return 1;
+		}
+	} else if (strcmp(spec, "c") == 0) {
+		kind = embed_c;
+	} else if (strcmp(spec, "asm") == 0) {
+		kind = embed_asm;
+	} else {
+		return 1;
+	}
+
+	struct embed *new = malloc(sizeof(struct embed));
+	if (new == NULL)
+		abort();
+
+	new->kind = kind;
+	new->machine = machine;
+	new->symbol = NULL;
+	new->alignment = EMBED_ALIGNMENT;
+	new->sink = NULL;
+	new->stream = NULL;
+	new->data = NULL;
+	new->size = 0;
+
+	*ptr = new;
+	return 0;
+}
+
+void embed_free(struct embed *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	if (ptr->stream != NULL)
+		fclose(ptr->stream);
+	free(ptr->symbol);
+	free(ptr->data);
+	free(ptr);
+}
+
+static bool is_identifier(const char *symbol)
+{
+	if (symbol[0] == '\0' || isdigit((unsigned char)symbol[0]))
+		return false;
+	for (const char *c = symbol; *c != '\0'; c++) {
+		if (!isalnum((unsigned char)*c) && *c != '_')
+			return false;
+	}
+	return true;
+}
+
+int embed_set_symbol(struct embed *ptr, const char *symbol)
+{
+	assert(ptr != NULL);
+	if (!is_identifier(symbol))
+		return 1;
+
+	free(ptr->symbol);
+	ptr->symbol = malloc(strlen(symbol) + 1);
+	if (ptr->symbol == NULL)
+		abort();
+	strcpy(ptr->symbol, symbol);
+	return 0;
+}
+
+void embed_set_alignment(struct embed *ptr, udword_t alignment)
+{
+	assert(ptr != NULL);
+	assert(alignment != 0);
+	ptr->alignment = alignment;
+}
+
+// the file name without its directory and extension, as an identifier
+static char *symbol_from_name(const char *name)
+{
+	const char *base = strrchr(name, '/');
+	base = (base != NULL) ? base + 1 : name;
+	size_t length = strlen(base);
+	const char *dot = strrchr(base, '.');
+	if (dot != NULL && dot != base)
+		length = dot - base;
+
+	char *symbol = malloc(length + 2);
+	if (symbol == NULL)
+		abort();
+
+	char *c = symbol;
+	if (length == 0 || isdigit((unsigned char)base[0]))
+		*c++ = '_';
+	for (size_t i = 0; i < length; i++)
+		*c++ = isalnum((unsigned char)base[i]) ? base[i] : '_';
+	*c = '\0';
+	return symbol;
+}
+
+/*
+ * The stream the output is written to: the sink for asm, else a memory
+ * stream that embed_close() wraps.
+ */
+FILE *embed_open(struct embed *ptr, const char *outname, FILE *sink)
+{
+	assert(ptr != NULL);
+	assert(outname != NULL);
+
+	if (ptr->symbol == NULL)
+		ptr->symbol = symbol_from_name(outname);
+	ptr->sink = sink;
+	if (ptr->kind == embed_asm)
+		return sink;
+
+	assert(ptr->stream == NULL);
+	ptr->stream = open_memstream(&(ptr->data), &(ptr->size));
+	if (ptr->stream == NULL)
+		abort();
+	return ptr->stream;
+}
+
+// the ELF fields are little-endian, the words are 64 bit for ELFCLASS64
+struct elf_writer
+{
+	FILE *fp;
+	bool is64;
+	unsigned long long offset;
+	int rc;
+};
+
+static void put_bytes(struct elf_writer *w, const void *data, size_t size)
+{
+	if (w->rc == 0)
+		w->rc = (fwrite(data, 1, size, w->fp) != size);
+	w->offset += size;
+}
+
+static void put_le(struct elf_writer *w, unsigned long long value, size_t size)
+{
+	unsigned char bytes[8];
+	for (size_t i = 0; i < size; i++)
+		bytes[i] = (value >> (CHAR_BIT * i)) & 0xff;
+	put_bytes(w, bytes, size);
+}
+
+static void put_word(struct elf_writer *w, unsigned long long value)
+{
+	put_le(w, value, w->is64 ? 8 : 4);
+}
+
+static void pad_to(struct elf_writer *w, unsigned long long alignment)
+{
+	static const unsigned char zero[64] = {0};
+	while (w->offset % alignment != 0) {
+		size_t n = alignment - w->offset % alignment;
+		put_bytes(w, zero, (n < sizeof(zero)) ? n : sizeof(zero));
+	}
+}
+
+static void put_section(struct elf_writer *w, udword_t name, udword_t type, unsigned long long flags,
+	unsigned long long offset, unsigned long long size, udword_t link, udword_t info,
+	unsigned long long alignment, unsigned long long entry_size)
+{
+	put_le(w, name, 4);
+	put_le(w, type, 4);
+	put_word(w, flags);
+	put_word(w, 0); // sh_addr
+	put_word(w, offset);
+	put_word(w, size);
+	put_le(w, link, 4);
+	put_le(w, info, 4);
+	put_word(w, alignment);
+	put_word(w, entry_size);
+}
+
+static void put_symbol(struct elf_writer *w, udword_t name, unsigned char info, uword_t section,
+	unsigned long long value, unsigned long long size)
+{
+	put_le(w, name, 4);
+	if (w->is64) {
+		put_le(w, info, 1);
+		put_le(w, 0, 1);
+		put_le(w, section, 2);
+		put_le(w, value, 8);
+		put_le(w, size, 8);
+	} else {
+		put_le(w, value, 4);
+		put_le(w, size, 4);
+		put_le(w, info, 1);
+		put_le(w, 0, 1);
+		put_le(w, section, 2);
+	}
+}
+
+#define SHT_PROGBITS 1u
+#define SHT_SYMTAB 2u
+#define SHT_STRTAB 3u
+#define SHF_ALLOC 2u
+#define SHN_ABS 0xfff1u
+#define STB_GLOBAL 1u
+#define STT_NOTYPE 0u
+#define STT_OBJECT 1u
+
+/*
+ * Sections: null, .rodata.<symbol>, .symtab, .strtab, .shstrtab and an
+ * empty .note.GNU-stack, so the object doesn't ask for an executable stack.
+ */
+static int write_elf(struct embed *ptr)
+{
+	const struct machine *m = ptr->machine;
+	if (!m->is64 && ptr->size > UDWORD_MAX) {
+		print_error();
+		fprintf(stderr, "The output doesn't fit in a 32 bit ELF object.\n");
+		return 1;
+	}
+
+	size_t symbol_length = strlen(ptr->symbol);
+	size_t strtab_size = 1 + 3 * (symbol_length + 1) + strlen("_end") + strlen("_size");
+	char *strtab = malloc(strtab_size);
+	char *shstrtab = malloc(symbol_length + 64);
+	if (strtab == NULL || shstrtab == NULL)
+		abort();
+
+	strtab[0] = '\0';
+	udword_t start_name = 1;
+	udword_t end_name = start_name + sprintf(strtab + start_name, "%s", ptr->symbol) + 1;
+	udword_t size_name = end_name + sprintf(strtab + end_name, "%s_end", ptr->symbol) + 1;
+	sprintf(strtab + size_name, "%s_size", ptr->symbol);
+
+	shstrtab[0] = '\0';
+	udword_t rodata_name = 1;
+	udword_t symtab_name = rodata_name + sprintf(shstrtab + rodata_name, ".rodata.%s", ptr->symbol) + 1;
+	udword_t strtab_name = symtab_name + sprintf(shstrtab + symtab_name, ".symtab") + 1;
+	udword_t shstrtab_name = strtab_name + sprintf(shstrtab + strtab_name, ".strtab") + 1;
+	udword_t note_name = shstrtab_name + sprintf(shstrtab + shstrtab_name, ".shstrtab") + 1;
+	size_t shstrtab_size = note_name + sprintf(shstrtab + note_name, ".note.GNU-stack") + 1;
+
+	struct elf_writer w = {ptr->sink, m->is64, 0, 0};
+	size_t word = m->is64 ? 8 : 4;
+	size_t header_size = m->is64 ? 64 : 52;
+	size_t section_size = m->is64 ? 64 : 40;
+	size_t symbol_size = m->is64 ? 24 : 16;
+	const udword_t sections = 6;
+
+	// the file offsets of the sections
+	unsigned long long data_offset = (header_size + ptr->alignment - 1) / ptr->alignment * ptr->alignment;
+	unsigned long long symtab_offset = (data_offset + ptr->size + word - 1) / word * word;
+	unsigned long long strtab_offset = symtab_offset + 4 * symbol_size;
+	unsigned long long shstrtab_offset = strtab_offset + strtab_size;
+	unsigned long long headers_offset = (shstrtab_offset + shstrtab_size + word - 1) / word * word;
+
+	static const unsigned char ident[16] = {0x7f, 'E', 'L', 'F'};
+	unsigned char e_ident[16];
+	memcpy(e_ident, ident, sizeof(e_ident));
+	e_ident[4] = m->is64 ? 2 : 1; // EI_CLASS
+	e_ident[5] = 1;               // EI_DATA, little-endian
+	e_ident[6] = 1;               // EI_VERSION
+	put_bytes(&w, e_ident, sizeof(e_ident));
+	put_le(&w, 1, 2); // ET_REL
+	put_le(&w, m->id, 2);
+	put_le(&w, 1, 4); // EV_CURRENT
+	put_word(&w, 0);  // e_entry
+	put_word(&w, 0);  // e_phoff
+	put_word(&w, headers_offset);
+	put_le(&w, m->flags, 4);
+	put_le(&w, header_size, 2);
+	put_le(&w, 0, 2); // e_phentsize
+	put_le(&w, 0, 2); // e_phnum
+	put_le(&w, section_size, 2);
+	put_le(&w, sections, 2);
+	put_le(&w, 4, 2); // e_shstrndx
+
+	pad_to(&w, ptr->alignment);
+	put_bytes(&w, ptr->data, ptr->size);
+	pad_to(&w, word);
+
+	put_symbol(&w, 0, 0, 0, 0, 0);
+	put_symbol(&w, start_name, (STB_GLOBAL << 4) | STT_OBJECT, 1, 0, ptr->size);
+	put_symbol(&w, end_name, (STB_GLOBAL << 4) | STT_NOTYPE, 1, ptr->size, 0);
+	put_symbol(&w, size_name, (STB_GLOBAL << 4) | STT_NOTYPE, SHN_ABS, ptr->size, 0);
+	put_bytes(&w, strtab, strtab_size);
+	put_bytes(&w, shstrtab, shstrtab_size);
+	pad_to(&w, word);
+
+	put_section(&w, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	put_section(&w, rodata_name, SHT_PROGBITS, SHF_ALLOC, data_offset, ptr->size, 0, 0, ptr->alignment, 0);
+	put_section(&w, symtab_name, SHT_SYMTAB, 0, symtab_offset, 4 * symbol_size, 3, 1, word, symbol_size);
+	put_section(&w, strtab_name, SHT_STRTAB, 0, strtab_offset, strtab_size, 0, 0, 1, 0);
+	put_section(&w, shstrtab_name, SHT_STRTAB, 0, shstrtab_offset, shstrtab_size, 0, 0, 1, 0);
+	put_section(&w, note_name, SHT_PROGBITS, 0, headers_offset, 0, 0, 0, 1, 0);
+
+	free(shstrtab);
+	free(strtab);
+	return w.rc;
+}
+
+// the lines of 16 bytes are formatted into a buffer, with a lookup table
+static int write_c(struct embed *ptr)
+{
+	static const char digits[] = "0123456789abcdef";
+	FILE *fp = ptr->sink;
+	int rc = 0;
+
+	char *guard = malloc(strlen(ptr->symbol) + 3);
+	if (guard == NULL)
+		abort();
+	size_t length = 0;
+	for (const char *c = ptr->symbol; *c != '\0'; c++)
+		guard[length++] = toupper((unsigned char)*c);
+	strcpy(guard + length, "_H");
+
+	fprintf(fp, "/* generated by pixmap565 */\n"
+		"#ifndef %s\n#define %s\n\n#include <stddef.h>\n\n"
+		"static const unsigned char %s[%zu] __attribute__((aligned(%llu), unused)) = {\n",
+		guard, guard, ptr->symbol, ptr->size, (unsigned long long)ptr->alignment);
+
+	char table[256][6];
+	for (int i = 0; i < 256; i++) {
+		table[i][0] = '0';
+		table[i][1] = 'x';
+		table[i][2] = digits[i >> 4];
+		table[i][3] = digits[i & 0xf];
+		table[i][4] = ',';
+		table[i][5] = ' ';
+	}
+
+	char buffer[1 << 16];
+	size_t used = 0;
+	for (size_t i = 0; i < ptr->size; i += 16) {
+		size_t count = (ptr->size - i < 16) ? ptr->size - i : 16;
+		buffer[used++] = '\t';
+		for (size_t j = 0; j < count; j++) {
+			memcpy(buffer + used, table[(unsigned char)ptr->data[i + j]], 6);
+			used += 6;
+		}
+		buffer[used - 1] = '\n';
+		if (used > sizeof(buffer) - 128) {
+			if (fwrite(buffer, 1, used, fp) != used)
+				rc = 1;
+			used = 0;
+		}
+	}
+	if (fwrite(buffer, 1, used, fp) != used)
+		rc = 1;
+
+	fprintf(fp, "};\nstatic const size_t %s_size __attribute__((unused)) = %zu;\n"
+		"#define %s_end (%s + %s_size)\n\n#endif /* %s */\n",
+		ptr->symbol, ptr->size, ptr->symbol, ptr->symbol, ptr->symbol, guard);
+	if (ferror(fp))
+		rc = 1;
+
+	free(guard);
+	return rc;
+}
+
+// wrap what was written to fp into the sink
+int embed_close(struct embed *ptr, FILE *fp)
+{
+	assert(ptr != NULL);
+	assert(fp != NULL);
+	if (ptr->kind == embed_asm)
+		return 0;
+
+	assert(fp == ptr->stream);
+	int rc = 0;
+	ptr->stream = NULL;
+	if (fclose(fp) != 0) {
+		print_error();
+		fprintf(stderr, "Cannot buffer the output.\n");
+		return 1;
+	}
+	if (ptr->kind == embed_elf)
+		rc = write_elf(ptr);
+	else
+		rc = write_c(ptr);
+	if (rc) {
+		print_error();
+		fprintf(stderr, "Cannot write the output file.\n");
+	}
+
+	free(ptr->data);
+	ptr->data = NULL;
+	ptr->size = 0;
+	return rc;
+}
+
+// the .incbin stub of an asm output, with the output file name as it was given
+int embed_write_stub(struct embed *ptr, const char *outname)
+{
+	assert(ptr != NULL);
+	assert(outname != NULL);
+	if (ptr->kind != embed_asm)
+		return 0;
+
+	int rc = 0;
+	char *stub = malloc(strlen(outname) + strlen(EMBED_STUB_EXTENSION) + 1);
+	if (stub == NULL)
+		abort();
+	strcpy(stub, outname);
+	strcat(stub, EMBED_STUB_EXTENSION);
+
+	FILE *fp = fopen(stub, "wx");
+	if (fp == NULL) {
+		printf("Cannot open file '%s'\n", stub);
+		rc = 1;
+		goto out;
+	}
+	const char *s = ptr->symbol;
+	fprintf(fp, "/* generated by pixmap565 */\n"
+		"\t.section .rodata.%s, \"a\"\n"
+		"\t.balign %llu\n"
+		"\t.global %s, %s_end, %s_size\n"
+		"\t.type %s, %%object\n"
+		"%s:\n"
+		"\t.incbin \"%s\"\n"
+		"%s_end:\n"
+		"\t.size %s, %s_end - %s\n"
+		"\t.set %s_size, %s_end - %s\n"
+		"\t.section .note.GNU-stack, \"\", %%progbits\n",
+		s, (unsigned long long)ptr->alignment, s, s, s, s, s, outname, s, s, s, s, s, s, s);
+	if (ferror(fp))
+		rc = 1;
+	if (fclose(fp) != 0)
+		rc = 1;
+out:
+	free(stub);
+	return rc;
+}
@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_EMBED_H
+#define PIXMAP565_EMBED_H
+
+#include <stdio.h>
+
+#include "file_utils.h"
+
+/*
+ * embed:
+ *
+ * Wrap an output for linking it into firmware, with the symbols <name>,
+ * <name>_end and <name>_size.
+ *
+ * elf  a relocatable ELF object, the data in a .rodata.<name> section
+ * c    a C header with the data as an array
+ * asm  the output as it is, and an assembly stub that .incbin's it,
+ *      written to <outfile>.S
+ */
+
+#define EMBED_STUB_EXTENSION ".S"
+#define EMBED_ALIGNMENT 4u
+
+struct embed;
+
+int embed_new(struct embed **ptr, const char *spec);
+void embed_free(struct embed *ptr);
+
+int embed_set_symbol(struct embed *ptr, const char *symbol);
+void embed_set_alignment(struct embed *ptr, udword_t alignment);
+
+FILE *embed_open(struct embed *ptr, const char *outname, FILE *sink);
+int embed_close(struct embed *ptr, FILE *fp);
+int embed_write_stub(struct embed *ptr, const char *outname);
+
+#endif /* PIXMAP565_EMBED_H */
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "file_utils.h"
 
@@ -54,3 +55,27 @@ int fput_udword(udword_t value, FILE *fp)
 {
 	return (fput_any_word(value, 4, fp));
 }
+
+// read exactly size bytes at offset, without moving the file position
+int pread_all(int fd, void *buffer, size_t size, off_t offset)
+{
+	int rc = 0;
+	size_t done = 0;
+	while (done < size) {
+		ssize_t count = pread(fd, (unsigned char *)buffer + done, size - done, offset + done);
+		if (count == 0) {
+			print_error();
+			fprintf(stderr, "Unexpected end of file.\n");
+			rc = 1;
+			break;
+		}
+		if (count < 0) {
+			print_error();
+			fprintf(stderr, "Unexpected end of file, caused by I/O error.\n");
+			rc = 1;
+			break;
+		}
+		done += count;
+	}
+	return rc;
+}
@@ -13,6 +13,7 @@
 #endif
 
 #include <stdio.h>
+#include <sys/types.h>
 
 // Pick an integer type that can hold 2 bytes
 #if (USHRT_MAX >> CHAR_BIT >= UCHAR_MAX)
@@ -57,4 +58,6 @@ int fput_uword(uword_t value, FILE *fp);
 int fput_dword(dword_t value, FILE *fp);
 int fput_udword(udword_t value, FILE *fp);
 
+int pread_all(int fd, void *buffer, size_t size, off_t offset);
+
 #endif /* PIXMAP565_FILE_UTILS_H */
@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "format.h"
+
+#define RED   0
+#define GREEN 1
+#define BLUE  2
+#define ALPHA 3
+
+/*
+ * The named formats:
+ * name, then the shift and width of red, green, blue and alpha.
+ */
+#define FORMATS(X) \
+	X(rgb565,   11, 5, 5, 6,  0, 5,  0, 0) \
+	X(bgr565,    0, 5, 5, 6, 11, 5,  0, 0) \
+	X(rgb555,   10, 5, 5, 5,  0, 5,  0, 0) \
+	X(argb1555, 10, 5, 5, 5,  0, 5, 15, 1) \
+	X(argb4444,  8, 4, 4, 4,  0, 4, 12, 4)
+
+#define MASK(width) ((1u << (width)) - 1)
+
+#define DESCRIPTOR(name, rs, rw, gs, gw, bs, bw, as, aw) \
+	{ \
+		format_##name, \
+		{MASK(rw) << rs, MASK(gw) << gs, MASK(bw) << bs, MASK(aw) << as}, \
+		{rs, gs, bs, as}, \
+		{rw, gw, bw, aw} \
+	},
+
+static const struct pixel_format formats[format_count] = {
+	FORMATS(DESCRIPTOR)
+};
+
+#define NAME(name, ...) #name,
+
+static const char *names[format_count] = {
+	FORMATS(NAME)
+};
+
+// compile-time constants for the kernels
+#define CONSTANTS(name, rs, rw, gs, gw, bs, bw, as, aw) \
+	enum { \
+		name##_rs = rs, name##_rw = rw, \
+		name##_gs = gs, name##_gw = gw, \
+		name##_bs = bs, name##_bw = bw, \
+		name##_as = as, name##_aw = aw \
+	};
+
+FORMATS(CONSTANTS)
+
+/*
+ * Rescale a channel to another width, rounding to the nearest value so that
+ * 0 and the maximum are kept. A missing alpha channel is opaque.
+ */
+static inline unsigned scale(unsigned value, unsigned from, unsigned to)
+{
+	if (to == 0)
+		return 0;
+	if (from == 0)
+		return MASK(to);
+	if (to == from)
+		return value;
+	return (value * MASK(to) + MASK(from) / 2) / MASK(from);
+}
+
+#define CHANNEL(p, from, to, c) \
+	(scale(((p) >> from##_##c##s) & MASK(from##_##c##w), from##_##c##w, to##_##c##w) << to##_##c##s)
+
+#define KERNEL(from, to) \
+	static void convert_##from##_##to(uint16_t *row, size_t count) \
+	{ \
+		for (size_t i = 0; i < count; i++) { \
+			unsigned p = row[i]; \
+			row[i] = CHANNEL(p, from, to, r) | CHANNEL(p, from, to, g) \
+				| CHANNEL(p, from, to, b) | CHANNEL(p, from, to, a); \
+		} \
+	}
+
+#define KERNELS_FROM(from, ...) \
+	KERNEL(from, rgb565) \
+	KERNEL(from, bgr565) \
+	KERNEL(from, rgb555) \
+	KERNEL(from, argb1555) \
+	KERNEL(from, argb4444)
+
+FORMATS(KERNELS_FROM)
+
+typedef void (*kernel_fn)(uint16_t *row, size_t count);
+
+#define KERNEL_ROW(from, ...) \
+	{ \
+		convert_##from##_rgb565, \
+		convert_##from##_bgr565, \
+		convert_##from##_rgb555, \
+		convert_##from##_argb1555, \
+		convert_##from##_argb4444 \
+	},
+
+static const kernel_fn kernels[format_count][format_count] = {
+	FORMATS(KERNEL_ROW)
+};
+
+const struct pixel_format *format_get(enum format_id id)
+{
+	assert(id < format_count);
+	return &(formats[id]);
+}
+
+const struct pixel_format *format_find(const char *name)
+{
+	for (int i = 0; i < format_count; i++) {
+		if (strcmp(name, names[i]) == 0)
+			return &(formats[i]);
+	}
+	return NULL;
+}
+
+const char *format_name(const struct pixel_format *ptr)
+{
+	if (ptr->id < format_count)
+		return names[ptr->id];
+	return "custom";
+}
+
+static int channel_from_mask(struct pixel_format *ptr, int channel, unsigned long mask)
+{
+	ptr->mask[channel] = mask;
+	ptr->shift[channel] = 0;
+	ptr->width[channel] = 0;
+	if (mask == 0)
+		return 0;
+	if (mask > UINT16_MAX)
+		return 1;
+
+	while (!(mask & 1)) {
+		mask >>= 1;
+		ptr->shift[channel]++;
+	}
+	while (mask & 1) {
+		mask >>= 1;
+		ptr->width[channel]++;
+	}
+	// the bits of a channel must be contiguous
+	return (mask != 0);
+}
+
+/*
+ * Describe the layout of the masks, returns non-zero if they aren't a valid
+ * 16 bit layout. Masks of a named format get its id, and its kernels.
+ */
+int format_from_masks(struct pixel_format *ptr, unsigned long red, unsigned long green, unsigned long blue, unsigned long alpha)
+{
+	assert(ptr != NULL);
+	int rc = 0;
+	rc |= channel_from_mask(ptr, RED, red);
+	rc |= channel_from_mask(ptr, GREEN, green);
+	rc |= channel_from_mask(ptr, BLUE, blue);
+	rc |= channel_from_mask(ptr, ALPHA, alpha);
+	if (rc)
+		return rc;
+
+	if (red == 0 || green == 0 || blue == 0)
+		return 1;
+	if ((red & green) || (red & blue) || (green & blue) || ((red | green | blue) & alpha))
+		return 1;
+
+	ptr->id = format_custom;
+	for (int i = 0; i < format_count; i++) {
+		if (memcmp(ptr->mask, formats[i].mask, sizeof(ptr->mask)) == 0)
+			ptr->id = i;
+	}
+	return 0;
+}
+
+int format_equal(const struct pixel_format *a, const struct pixel_format *b)
+{
+	return (memcmp(a->mask, b->mask, sizeof(a->mask)) == 0);
+}
+
+// expand a pixel to 8 bits per channel, without alpha it is opaque
+void format_unpack(const struct pixel_format *ptr, uint16_t pixel, unsigned char rgba[4])
+{
+	assert(ptr != NULL);
+	for (int c = 0; c < 4; c++)
+		rgba[c] = scale((pixel & ptr->mask[c]) >> ptr->shift[c], ptr->width[c], 8);
+}
+
+uint16_t format_pack(const struct pixel_format *ptr, const unsigned char rgba[4])
+{
+	assert(ptr != NULL);
+	unsigned pixel = 0;
+	for (int c = 0; c < 4; c++)
+		pixel |= scale(rgba[c], 8, ptr->width[c]) << ptr->shift[c];
+	return pixel;
+}
+
+static void convert_generic(const struct pixel_format *from, const struct pixel_format *to, uint16_t *row, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		unsigned p = row[i];
+		unsigned q = 0;
+		for (int c = 0; c < 4; c++) {
+			unsigned value = (p & from->mask[c]) >> from->shift[c];
+			q |= scale(value, from->width[c], to->width[c]) << to->shift[c];
+		}
+		row[i] = q;
+	}
+}
+
+// convert count pixels in place
+void format_convert(const struct pixel_format *from, const struct pixel_format *to, uint16_t *row, size_t count)
+{
+	assert(from != NULL);
+	assert(to != NULL);
+	if (format_equal(from, to))
+		return;
+
+	if (from->id < format_count && to->id < format_count)
+		kernels[from->id][to->id](row, count);
+	else
+		convert_generic(from, to, row, count);
+}
+
+// the same, on little-endian bytes
+void format_convert_bytes(const struct pixel_format *from, const struct pixel_format *to, unsigned char *row, size_t count)
+{
+	if (format_equal(from, to))
+		return;
+
+	uint16_t block[256];
+	while (count > 0) {
+		size_t n = count;
+		if (n > 256)
+			n = 256;
+		for (size_t i = 0; i < n; i++)
+			block[i] = row[2 * i] | (uint16_t)row[2 * i + 1] << 8;
+
+		format_convert(from, to, block, n);
+
+		for (size_t i = 0; i < n; i++) {
+			row[2 * i] = block[i] & 0xff;
+			row[2 * i + 1] = block[i] >> 8;
+		}
+		row += 2 * n;
+		count -= n;
+	}
+}
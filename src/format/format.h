@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_FORMAT_H
+#define PIXMAP565_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * format:
+ *
+ * 16 bit pixel layouts, described by one bit mask per channel.
+ * The named formats convert between each other with kernels that are
+ * specialized at compile time, any other layout (e.g. the bit masks of
+ * a BMP) goes through a generic kernel.
+ */
+
+enum format_id {
+	format_rgb565,
+	format_bgr565,
+	format_rgb555,
+	format_argb1555,
+	format_argb4444,
+	format_count,
+	format_custom = format_count
+};
+
+struct pixel_format
+{
+	enum format_id id;
+	uint16_t mask[4];      // red, green, blue, alpha
+	unsigned char shift[4];
+	unsigned char width[4]; // in bits, 0 if the channel is missing
+};
+
+const struct pixel_format *format_get(enum format_id id);
+const struct pixel_format *format_find(const char *name);
+const char *format_name(const struct pixel_format *ptr);
+int format_from_masks(struct pixel_format *ptr, unsigned long red, unsigned long green, unsigned long blue, unsigned long alpha);
+int format_equal(const struct pixel_format *a, const struct pixel_format *b);
+
+void format_unpack(const struct pixel_format *ptr, uint16_t pixel, unsigned char rgba[4]);
+uint16_t format_pack(const struct pixel_format *ptr, const unsigned char rgba[4]);
+
+void format_convert(const struct pixel_format *from, const struct pixel_format *to, uint16_t *row, size_t count);
+void format_convert_bytes(const struct pixel_format *from, const struct pixel_format *to, unsigned char *row, size_t count);
+
+#endif /* PIXMAP565_FORMAT_H */
@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "file_utils.h"
+#include "format.h"
+#include "gray.h"
+#include "jobs.h"
+#include "pixmap.h"
+
+static const unsigned char bayer[8][8] = {
+	{ 0, 32,  8, 40,  2, 34, 10, 42},
+	{48, 16, 56, 24, 50, 18, 58, 26},
+	{12, 44,  4, 36, 14, 46,  6, 38},
+	{60, 28, 52, 20, 62, 30, 54, 22},
+	{ 3, 35, 11, 43,  1, 33,  9, 41},
+	{51, 19, 59, 27, 49, 17, 57, 25},
+	{15, 47,  7, 39, 13, 45,  5, 37},
+	{63, 31, 55, 23, 61, 29, 53, 21}
+};
+
+// (77 R + 150 G + 29 B + 128) / 256 of the RGB565 pixels, at 8 bits per channel
+void gray_luma(const uint16_t *row, unsigned char *luma, udword_t count)
+{
+	udword_t i = 0;
+#if defined(__SSE2__)
+	const __m128i mask6 = _mm_set1_epi16(0x3f);
+	const __m128i mask5 = _mm_set1_epi16(0x1f);
+	const __m128i wr = _mm_set1_epi16(77);
+	const __m128i wg = _mm_set1_epi16(150);
+	const __m128i wb = _mm_set1_epi16(29);
+	const __m128i half = _mm_set1_epi16(128);
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+		__m128i r = _mm_srli_epi16(v, 11);
+		__m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), mask6);
+		__m128i b = _mm_and_si128(v, mask5);
+		r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+		g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+		b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+		// at most 256 * 255 + 128, the sum fits in 16 bits
+		__m128i y = _mm_add_epi16(_mm_mullo_epi16(r, wr), _mm_mullo_epi16(g, wg));
+		y = _mm_add_epi16(y, _mm_add_epi16(_mm_mullo_epi16(b, wb), half));
+		y = _mm_srli_epi16(y, 8);
+		_mm_storel_epi64((__m128i *)(luma + i), _mm_packus_epi16(y, y));
+	}
+#endif
+	for (; i < count; i++) {
+		unsigned r = row[i] >> 11;
+		unsigned g = (row[i] >> 5) & 0x3f;
+		unsigned b = row[i] & 0x1f;
+		r = (r << 3) | (r >> 2);
+		g = (g << 2) | (g >> 4);
+		b = (b << 3) | (b >> 2);
+		luma[i] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+	}
+}
+
+// the 0x00RRGGBB color of every level, 2 or 16 of them
+void gray_get_rgb(const struct gray_options *opt, udword_t *colors)
+{
+	unsigned levels = 1u << opt->bits;
+	for (unsigned i = 0; i < levels; i++) {
+		udword_t value = (i * 255 + (levels - 1) / 2) / (levels - 1);
+		colors[i] = (value << 16) | (value << 8) | value;
+	}
+}
+
+struct pack_ctx
+{
+	uint16_t **rows;
+	udword_t width;
+	const struct pixel_format *format;
+	const struct gray_options *opt;
+	unsigned char *out;
+	size_t stride;
+};
+
+static int pack_row(void *arg, size_t index)
+{
+	struct pack_ctx *ctx = arg;
+	const struct gray_options *opt = ctx->opt;
+	unsigned max = (1u << opt->bits) - 1;
+
+	uint16_t *row = malloc(sizeof(uint16_t) * ctx->width + 1);
+	unsigned char *luma = malloc(ctx->width + 1);
+	if (row == NULL || luma == NULL)
+		abort();
+
+	memcpy(row, ctx->rows[index], sizeof(uint16_t) * ctx->width);
+	format_convert(ctx->format, format_get(format_rgb565), row, ctx->width);
+	gray_luma(row, luma, ctx->width);
+
+	unsigned char *out = ctx->out + index * ctx->stride;
+	for (udword_t x = 0; x < ctx->width; x++) {
+		unsigned level;
+		if (opt->dither) {
+			// floor(luma * max / 255 + (bayer + 0.5) / 64)
+			unsigned t = 2 * bayer[index % 8][x % 8] + 1;
+			level = (luma[x] * max * 128 + t * 255) / (255 * 128);
+		} else {
+			level = (luma[x] * max * 2 + 255) / 510;
+		}
+
+		size_t bit = (size_t)x * opt->bits;
+		unsigned shift = bit % CHAR_BIT;
+		if (!opt->lsb_first)
+			shift = CHAR_BIT - opt->bits - shift;
+		out[bit / CHAR_BIT] |= level << shift;
+	}
+
+	free(luma);
+	free(row);
+	return 0;
+}
+
+/*
+ * The packed rows of pix in the given format, top-down, each one padded with zero bytes to a
+ * multiple of alignment. The rows are packed in parallel.
+ */
+int gray_pack(struct pixmap *pix, const struct pixel_format *format, const struct gray_options *opt,
+	udword_t alignment, unsigned char **packed, size_t *stride)
+{
+	assert(pix != NULL);
+	assert(opt != NULL);
+	assert(opt->bits == 1 || opt->bits == 4);
+	assert(alignment != 0);
+	assert(packed != NULL);
+
+	struct pack_ctx ctx = {
+		.rows = pixmap_get_rows(pix),
+		.width = pixmap_get_x(pix),
+		.format = format,
+		.opt = opt
+	};
+	size_t bytes = ((size_t)ctx.width * opt->bits + CHAR_BIT - 1) / CHAR_BIT;
+	ctx.stride = (bytes + alignment - 1) / alignment * alignment;
+	ctx.out = calloc(ctx.stride * pixmap_get_y(pix) + 1, 1);
+	if (ctx.out == NULL)
+		abort();
+
+	int rc = jobs_run(pixmap_get_y(pix), 0, pack_row, &ctx);
+
+	free(ctx.rows);
+	*packed = ctx.out;
+	*stride = ctx.stride;
+	return rc;
+}
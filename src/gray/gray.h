@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_GRAY_H
+#define PIXMAP565_GRAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "file_utils.h"
+#include "pixmap.h"
+
+/*
+ * gray:
+ *
+ * 1 or 4 bit gray levels for e-paper panels. The luma of every pixel
+ * (BT.601 weights) is rounded to the nearest level, or ordered dithered
+ * with an 8x8 Bayer matrix. Level 0 is black. The levels are packed into
+ * rows of bytes, the first pixel in the most or the least significant bits.
+ */
+
+struct pixel_format;
+
+struct gray_options
+{
+	unsigned bits;  // 1 or 4
+	bool dither;    // ordered dithering, instead of rounding
+	bool lsb_first; // the first pixel of each byte in its low bits
+};
+
+void gray_luma(const uint16_t *row, unsigned char *luma, udword_t count);
+void gray_get_rgb(const struct gray_options *opt, udword_t *colors);
+int gray_pack(struct pixmap *pix, const struct pixel_format *format, const struct gray_options *opt,
+	udword_t alignment, unsigned char **packed, size_t *stride);
+
+#endif /* PIXMAP565_GRAY_H */
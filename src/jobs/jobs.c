@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "jobs.h"
+
+struct jobs
+{
+	pthread_mutex_t lock;
+	size_t next;  // first job that hasn't been picked up
+	size_t count;
+	int rc;       // non-zero if any job failed
+	job_fn job;
+	void *ctx;
+};
+
+unsigned jobs_threads(void)
+{
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	if (online < 1)
+		online = 1;
+
+	return online;
+}
+
+static void *worker(void *arg)
+{
+	struct jobs *ptr = arg;
+	while (1) {
+		pthread_mutex_lock(&(ptr->lock));
+		size_t index = ptr->next;
+		bool done = (index >= ptr->count || ptr->rc != 0);
+		if (!done)
+			ptr->next += 1;
+		pthread_mutex_unlock(&(ptr->lock));
+
+		if (done)
+			break;
+
+		int rc = ptr->job(ptr->ctx, index);
+		if (rc) {
+			pthread_mutex_lock(&(ptr->lock));
+			ptr->rc = rc;
+			pthread_mutex_unlock(&(ptr->lock));
+		}
+	}
+	return NULL;
+}
+
+/*
+ * threads == 0 picks one thread per online CPU.
+ * After the first failure no new jobs are started.
+ */
+int jobs_run(size_t count, unsigned threads, job_fn job, void *ctx)
+{
+	assert(job != NULL);
+
+	struct jobs pool = {
+		.next = 0,
+		.count = count,
+		.rc = 0,
+		.job = job,
+		.ctx = ctx
+	};
+	if (pthread_mutex_init(&(pool.lock), NULL) != 0)
+		abort();
+
+	if (threads == 0)
+		threads = jobs_threads();
+	if (threads > count)
+		threads = count;
+
+	pthread_t *tid = NULL;
+	if (threads > 1) {
+		tid = malloc(sizeof(pthread_t) * (threads - 1));
+		if (tid == NULL)
+			abort();
+	}
+
+	// the calling thread is one of the workers
+	unsigned started = 0;
+	for (; started + 1 < threads; started++) {
+		if (pthread_create(&(tid[started]), NULL, worker, &pool) != 0)
+			break;
+	}
+	worker(&pool);
+
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+
+	free(tid);
+	pthread_mutex_destroy(&(pool.lock));
+	return pool.rc;
+}
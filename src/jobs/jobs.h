@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_JOBS_H
+#define PIXMAP565_JOBS_H
+
+#include <stddef.h>
+
+/*
+ * jobs:
+ *
+ * Run count independent jobs on a pool of threads.
+ * Each job is called with its index in [0, count).
+ */
+
+typedef int (*job_fn)(void *ctx, size_t index);
+
+unsigned jobs_threads(void);
+int jobs_run(size_t count, unsigned threads, job_fn job, void *ctx);
+
+#endif /* PIXMAP565_JOBS_H */
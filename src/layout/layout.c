@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_utils.h"
+#include "layout.h"
+#include "pixmap.h"
+
+// the columns are transposed in blocks of BLOCK*BLOCK pixels
+#define BLOCK 32u
+
+static const char *names[] = {"rows", "columns", "tiles", "morton"};
+
+int layout_find(const char *name, udword_t tile, struct layout *layout)
+{
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(name, names[i]) != 0)
+			continue;
+
+		layout->id = i;
+		layout->tile = 0;
+		if (layout->id != layout_tiles && layout->id != layout_morton)
+			return (tile != 0);
+
+		if (tile == 0)
+			tile = LAYOUT_TILE;
+		if (tile < 2 || tile > LAYOUT_MAX_TILE || (tile & (tile - 1)) != 0)
+			return 1;
+		layout->tile = tile;
+		return 0;
+	}
+	return 1;
+}
+
+const char *layout_name(const struct layout *layout)
+{
+	return names[layout->id];
+}
+
+// the bytes of a width*height pixmap in the layout
+size_t layout_size(const struct layout *layout, udword_t width, udword_t height)
+{
+	assert(layout->id != layout_rows);
+	if (layout->id == layout_columns)
+		return (size_t)width * height * BYTES_PER_PIXEL;
+
+	size_t tile = layout->tile;
+	return (width + tile - 1) / tile * ((height + tile - 1) / tile) * tile * tile * BYTES_PER_PIXEL;
+}
+
+/*
+ * The offsets in a row-major tile of the pixels of a tile in the order of
+ * the layout, so the tiles and morton kernels are the same loop.
+ */
+static udword_t *tile_order(const struct layout *layout)
+{
+	udword_t tile = layout->tile;
+	udword_t *order = malloc(sizeof(udword_t) * tile * tile);
+	if (order == NULL)
+		abort();
+
+	for (udword_t i = 0; i < tile * tile; i++) {
+		if (layout->id == layout_tiles) {
+			order[i] = i;
+			continue;
+		}
+		// the even bits of i are x, the odd ones y
+		udword_t x = 0;
+		udword_t y = 0;
+		for (unsigned bit = 0; (1u << (2 * bit)) < tile * tile; bit++) {
+			x |= ((i >> (2 * bit)) & 1u) << bit;
+			y |= ((i >> (2 * bit + 1)) & 1u) << bit;
+		}
+		order[i] = y * tile + x;
+	}
+	return order;
+}
+
+static int read_all(FILE *fp, unsigned char **data, size_t *size)
+{
+	size_t capacity = 1 << 16;
+	*size = 0;
+	*data = malloc(capacity);
+	if (*data == NULL)
+		abort();
+
+	while (1) {
+		if (*size == capacity) {
+			capacity *= 2;
+			*data = realloc(*data, capacity);
+			if (*data == NULL)
+				abort();
+		}
+		size_t count = fread(*data + *size, 1, capacity - *size, fp);
+		*size += count;
+		if (count == 0)
+			break;
+	}
+	if (ferror(fp)) {
+		print_error();
+		fprintf(stderr, "Unexpected end of file, caused by I/O error.\n");
+		return 1;
+	}
+	return 0;
+}
+
+static uint16_t get_pixel(const unsigned char *bytes)
+{
+	return bytes[0] | (bytes[1] << CHAR_BIT);
+}
+
+static void put_pixel(unsigned char *bytes, uint16_t pixel)
+{
+	bytes[0] = pixel & 0xff;
+	bytes[1] = pixel >> CHAR_BIT;
+}
+
+int layout_read(struct pixmap *pix, const struct layout *layout, FILE *fp)
+{
+	assert(pix != NULL);
+	assert(layout != NULL);
+	assert(layout->id != layout_rows);
+	assert(fp != NULL);
+
+	unsigned char *data = NULL;
+	size_t size = 0;
+	udword_t *order = NULL;
+	uint16_t *rows = NULL;
+	int rc = read_all(fp, &data, &size);
+	if (rc)
+		goto out;
+
+	size_t width = pixmap_get_x(pix);
+	size_t tile = (layout->id == layout_columns) ? BLOCK : layout->tile;
+	size_t tiles = (width + tile - 1) / tile;
+	// the bytes of a row of pixels, or of a band of tiles
+	size_t band = width * BYTES_PER_PIXEL;
+	size_t height = size / band;
+	if (layout->id != layout_columns) {
+		band = tiles * tile * tile * BYTES_PER_PIXEL;
+		height = size / band * tile;
+	}
+	if (size == 0 || size % band != 0 || height > UDWORD_MAX) {
+		print_error();
+		fprintf(stderr, "The input isn't a whole number of %s.\n",
+			(layout->id == layout_columns) ? "columns" : "tile rows");
+		rc = 1;
+		goto out;
+	}
+	// the given height is within the last band of tiles
+	if (layout->height != 0 && (layout->height > height || height - layout->height >= tile)) {
+		print_error();
+		fprintf(stderr, "The input has %zu rows of tiles, not %llu rows.\n",
+			height, (unsigned long long)layout->height);
+		rc = 1;
+		goto out;
+	}
+	if (layout->height != 0)
+		height = layout->height;
+
+	rows = malloc(sizeof(uint16_t) * width * tile);
+	if (rows == NULL)
+		abort();
+	if (layout->id != layout_columns)
+		order = tile_order(layout);
+
+	for (size_t y0 = 0; y0 < height; y0 += tile) {
+		size_t count = (tile < height - y0) ? tile : height - y0;
+		if (layout->id == layout_columns) {
+			// a BLOCK*count block of columns at a time
+			for (size_t x0 = 0; x0 < width; x0 += BLOCK) {
+				size_t end = (x0 + BLOCK < width) ? x0 + BLOCK : width;
+				for (size_t x = x0; x < end; x++) {
+					const unsigned char *column = data + (x * height + y0) * BYTES_PER_PIXEL;
+					for (size_t y = 0; y < count; y++)
+						rows[y * width + x] = get_pixel(column + y * BYTES_PER_PIXEL);
+				}
+			}
+		} else {
+			const unsigned char *src = data + y0 / tile * band;
+			for (size_t t = 0; t < tiles; t++) {
+				for (size_t i = 0; i < tile * tile; i++, src += BYTES_PER_PIXEL) {
+					size_t x = t * tile + order[i] % tile;
+					if (x < width)
+						rows[order[i] / tile * width + x] = get_pixel(src);
+				}
+			}
+		}
+		for (size_t y = 0; y < count; y++)
+			pixmap_add_row(pix, rows + y * width);
+	}
+out:
+	free(rows);
+	free(order);
+	free(data);
+	return rc;
+}
+
+int layout_write(struct pixmap *pix, const struct layout *layout, FILE *fp)
+{
+	assert(pix != NULL);
+	assert(layout != NULL);
+	assert(layout->id != layout_rows);
+	assert(fp != NULL);
+	int rc = 0;
+
+	size_t width = pixmap_get_x(pix);
+	size_t height = pixmap_get_y(pix);
+	uint16_t **rows = pixmap_get_rows(pix);
+	udword_t *order = NULL;
+	unsigned char *buffer = NULL;
+	size_t size = 0;
+
+	if (layout->id == layout_columns) {
+		// BLOCK columns at a time, transposed in BLOCK*BLOCK blocks
+		size = BLOCK * height * BYTES_PER_PIXEL;
+		buffer = malloc(size);
+		if (buffer == NULL)
+			abort();
+		for (size_t x0 = 0; x0 < width && rc == 0; x0 += BLOCK) {
+			size_t end = (x0 + BLOCK < width) ? x0 + BLOCK : width;
+			for (size_t y0 = 0; y0 < height; y0 += BLOCK) {
+				size_t last = (y0 + BLOCK < height) ? y0 + BLOCK : height;
+				for (size_t y = y0; y < last; y++) {
+					for (size_t x = x0; x < end; x++)
+						put_pixel(buffer + ((x - x0) * height + y) * BYTES_PER_PIXEL, rows[y][x]);
+				}
+			}
+			size = (end - x0) * height * BYTES_PER_PIXEL;
+			rc = (fwrite(buffer, 1, size, fp) != size);
+		}
+	} else {
+		// one band of tiles at a time
+		size_t tile = layout->tile;
+		size_t tiles = (width + tile - 1) / tile;
+		size = tiles * tile * tile * BYTES_PER_PIXEL;
+		buffer = malloc(size);
+		if (buffer == NULL)
+			abort();
+		order = tile_order(layout);
+		for (size_t y0 = 0; y0 < height && rc == 0; y0 += tile) {
+			unsigned char *dst = buffer;
+			for (size_t t = 0; t < tiles; t++) {
+				for (size_t i = 0; i < tile * tile; i++, dst += BYTES_PER_PIXEL) {
+					size_t x = t * tile + order[i] % tile;
+					size_t y = y0 + order[i] / tile;
+					put_pixel(dst, (x < width && y < height) ? rows[y][x] : 0);
+				}
+			}
+			rc = (fwrite(buffer, 1, size, fp) != size);
+		}
+	}
+	if (rc) {
+		print_error();
+		fprintf(stderr, "Cannot write the output file.\n");
+	}
+
+	free(buffer);
+	free(order);
+	free(rows);
+	return rc;
+}
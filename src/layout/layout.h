@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_LAYOUT_H
+#define PIXMAP565_LAYOUT_H
+
+#include <stdio.h>
+
+#include "file_utils.h"
+#include "pixmap.h"
+
+/*
+ * layout:
+ *
+ * The order of the pixels of a raw pixmap.
+ *
+ * rows     row-major scanlines, padded to the row alignment (the default)
+ * columns  column-major, top to bottom then left to right, no padding
+ * tiles    tile*tile tiles, left to right then top to bottom, each one
+ *          row-major
+ * morton   like tiles, each one in Morton (Z) order
+ *
+ * The tiles on the right and bottom edges are padded with zero pixels. The
+ * height of a tiled input is a multiple of the tile, unless it is given, then
+ * the padding rows are dropped.
+ */
+
+#define LAYOUT_TILE 8u
+#define LAYOUT_MAX_TILE 128u
+
+enum layout_id {
+	layout_rows,
+	layout_columns,
+	layout_tiles,
+	layout_morton
+};
+
+struct layout
+{
+	enum layout_id id;
+	udword_t tile;   // the side of the tiles, a power of 2
+	udword_t height; // of a tiled input without the padding rows, or 0
+};
+
+int layout_find(const char *name, udword_t tile, struct layout *layout);
+const char *layout_name(const struct layout *layout);
+size_t layout_size(const struct layout *layout, udword_t width, udword_t height);
+int layout_read(struct pixmap *pix, const struct layout *layout, FILE *fp);
+int layout_write(struct pixmap *pix, const struct layout *layout, FILE *fp);
+
+#endif /* PIXMAP565_LAYOUT_H */
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <limits.h>
 
+#include "arena.h"
 #include "file_utils.h"
 #include "llnode.h"
 
@@ -17,18 +18,16 @@ struct llnode
 	uint16_t *array;
 	udword_t size;
 	udword_t logical_size; // first unoccupied element
+	struct arena *arena;
 };
 
-void llnode_new(struct llnode **ptr, udword_t size)
+void llnode_new(struct llnode **ptr, udword_t size, struct arena *arena)
 {
-	struct llnode *new = malloc(sizeof(struct llnode));
-	if (new == NULL)
-		abort();
+	struct llnode *new = arena_alloc(arena, sizeof(struct llnode));
 
 	new->size = size;
-	new->array = malloc(sizeof(udword_t) * new->size);
-	if (new->array == NULL)
-		abort();
+	new->array = arena_alloc(arena, sizeof(uint16_t) * new->size);
+	new->arena = arena;
 
 	new->logical_size = 0;
 	new->next = NULL;
@@ -43,8 +42,8 @@ void llnode_free(struct llnode *ptr)
 	do {
 		struct llnode *next = ptr->next;
 
-		free(ptr->array);
-		free(ptr);
+		arena_release(ptr->arena, ptr->array);
+		arena_release(ptr->arena, ptr);
 		ptr = next;
 	} while (ptr != NULL);
 }
@@ -56,7 +55,7 @@ struct llnode *llnode_add(struct llnode *ptr, uint16_t value)
 		ptr = ptr->next;
 
 	if (ptr->logical_size >= ptr->size) {
-		llnode_new(&(ptr->next), ptr->size);
+		llnode_new(&(ptr->next), ptr->size, ptr->arena);
 		ptr = ptr->next;
 	}
 	ptr->array[ptr->logical_size] = value;
@@ -89,13 +88,26 @@ void llnode_reverse_nodes(struct llnode *ptr)
 	} while (ptr != NULL);
 }
 
+struct llnode *llnode_get_next(struct llnode *ptr)
+{
+	assert(ptr != NULL);
+	return (ptr->next);
+}
+
+uint16_t *llnode_get_array(struct llnode *ptr)
+{
+	assert(ptr != NULL);
+	return (ptr->array);
+}
+
 bool llnode_is_full(struct llnode *ptr)
 {
 	assert(ptr->logical_size <= ptr->size);
 	return (ptr->logical_size == ptr->size);
 }
 
-int llnode_write(struct llnode *ptr, FILE *fp)
+// write the nodes as rows, each one followed by padding zero bytes
+int llnode_write(struct llnode *ptr, FILE *fp, size_t padding)
 {
 	int rc = 0;
 	do {
@@ -105,7 +117,7 @@ int llnode_write(struct llnode *ptr, FILE *fp)
 			if (rc)
 				goto out;
 		}
-		for (udword_t i = 0; i < (ptr->logical_size * BYTES_PER_PIXEL) % 4; i++) {
+		for (size_t i = 0; i < padding; i++) {
 			rc = (fputc(0, fp) != 0);
 			if (rc)
 				goto out;
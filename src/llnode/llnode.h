@@ -10,6 +10,8 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "arena.h"
+
 /*
  * llnode:
  *
@@ -18,7 +20,7 @@
 
 struct llnode;
 
-void llnode_new(struct llnode **ptr, udword_t size);
+void llnode_new(struct llnode **ptr, udword_t size, struct arena *arena);
 void llnode_free(struct llnode *ptr);
 
 struct llnode *llnode_add(struct llnode *ptr, uint16_t value);
@@ -26,7 +28,10 @@ struct llnode *llnode_add(struct llnode *ptr, uint16_t value);
 void llnode_reverse_data(struct llnode *ptr);
 void llnode_reverse_nodes(struct llnode *ptr);
 
+struct llnode *llnode_get_next(struct llnode *ptr);
+uint16_t *llnode_get_array(struct llnode *ptr);
+
 bool llnode_is_full(struct llnode *ptr);
-int llnode_write(struct llnode *ptr, FILE *fp);
+int llnode_write(struct llnode *ptr, FILE *fp, size_t padding);
 
 #endif /* PIXMAP565_LLNODE_H */
@@ -8,24 +8,184 @@
 #include <getopt.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "anim.h"
+#include "batch.h"
+#include "checksum.h"
+#include "compare.h"
+#include "composite.h"
+#include "convert.h"
+#include "display.h"
+#include "embed.h"
+#include "format.h"
+#include "gray.h"
+#include "layout.h"
+#include "perf.h"
 #include "picture.h"
 #include "pixmap.h"
+#include "pointop.h"
+#include "serve.h"
+#include "slicer.h"
+#include "stream.h"
+#include "tar.h"
+#include "trim.h"
 
 static void help(void)
 {
 	printf(
 		"Usage: pixmap565 [options] -i infile%s -o outfile\n"
 		"   or: pixmap565 [options] -w width -i infile -o outfile%s\n"
+		"   or: pixmap565 [options] --batch listfile\n"
+		"   or: pixmap565 [options] --pack frames -o outfile\n"
+		"   or: pixmap565 [options] --serve socket\n"
+		"   or: pixmap565 [options] --tar bmp|raw -i infile.tar -o outfile.tar\n"
+		"   or: pixmap565 --info file%s...\n"
+		"   or: pixmap565 [options] --compare file1 file2\n"
 		"Convert between %s image and RGB565 pixmap.\n\n"
 		"  -w [width]   set the width (height is derived from filesize/width)\n"
 		"\nOptions:\n"
-		"     --help    display this help and exit\n",
+		"     --checksum [crc32|xxh32|all]\n"
+		"                     print the checksums of the output as it is written\n"
+		"     --sidecar       also write the checksums to outfile.sum\n"
+		"     --hash-only     print the checksums without writing the output\n"
+		"     --in-format [format]\n"
+		"                     the pixel layout of a pixmap input (default rgb565)\n"
+		"     --out-format [format]\n"
+		"                     the pixel layout of the output (default rgb565)\n"
+		"                     formats: rgb565, bgr565, rgb555, argb1555, argb4444\n"
+		"     --in-layout [layout[,tile]]\n"
+		"                     the pixel order of a pixmap input (default rows)\n"
+		"     --in-height [height]\n"
+		"                     the height of a tiles or morton input, the\n"
+		"                     padding rows of its last tiles are dropped\n"
+		"     --out-layout [layout[,tile]]\n"
+		"                     the pixel order of a pixmap output (default rows)\n"
+		"                     layouts: rows, columns, tiles, morton, with\n"
+		"                     tile*tile tiles (default %u)\n"
+		"     --in-row-align [bytes]\n"
+		"                     the rows of a pixmap input are padded to a\n"
+		"                     multiple of bytes, 1 for none (default %u)\n"
+		"     --out-row-align [bytes]\n"
+		"                     the same for a pixmap output, a power of 2 up\n"
+		"                     to %u\n"
+		"     --buffer-align [bytes]\n"
+		"                     pad a pixmap output to a multiple of bytes\n"
+		"     --indexed       write 8 bit palette indices: an 8bpp %s, or a\n"
+		"                     pixmap of 256 colors then 1 byte per pixel\n"
+		"     --gray [1|4]    write 1 or 4 bit gray levels of the luma: a %s\n"
+		"                     with a gray color table, or packed pixmap rows\n"
+		"     --dither        ordered dithering of the gray levels, instead of\n"
+		"                     rounding\n"
+		"     --lsb-first     pack the first pixel of each pixmap byte in its\n"
+		"                     low bits, instead of the high ones\n"
+		"     --truecolor [24|32]\n"
+		"                     write 24 or 32 bit BGR(A) pixels: a %s for any\n"
+		"                     viewer, or packed pixmap rows\n"
+		"     --background [RRGGBB]\n"
+		"                     flatten the input over a color, with its alpha\n"
+		"     --background-image [file%s[,x,y]]\n"
+		"                     flatten the input over the region at (x, y) of\n"
+		"                     a picture, loaded once for every input\n"
+		"     --color-key [XXXX]\n"
+		"                     the hexadecimal input pixel that is transparent\n"
+		"     --gamma [value|1.8|2.2|2.4|srgb|linear]\n"
+		"                     raise the channels to 1/value, or a built-in curve\n"
+		"     --brightness [n]\n"
+		"                     add n, from -255 to 255, to the 8 bit channels\n"
+		"     --contrast [percent]\n"
+		"                     scale the channels around the middle gray\n"
+		"     --gains r,g,b   scale each channel by a percent, to calibrate\n"
+		"                     a panel\n"
+		"     --desaturate    the luma in every channel\n"
+		"     --remap XXXX,YYYY\n"
+		"                     replace a hexadecimal output pixel by another\n"
+		"                     the adjustments apply in order, as one lookup per\n"
+		"                     pixel of the output format\n"
+		"     --display [ili9341|st7789]\n"
+		"                     write the commands that draw the image on the\n"
+		"                     display controller, ready for DMA\n"
+		"     --window x,y    the top left of the image on the display\n"
+		"     --landscape     rotate the 240x320 frame memory to 320x240\n"
+		"     --dma-chunk [bytes]\n"
+		"                     the most pixel bytes of one command (default %u)\n"
+		"     --dma-align [bytes]\n"
+		"                     start the data of every command at a multiple\n"
+		"                     of bytes (default %u)\n"
+		"     --embed [elf[,machine]|c|asm]\n"
+		"                     write the output for linking into firmware: an\n"
+		"                     ELF object, a C header, or the output as it is\n"
+		"                     and an .incbin stub in outfile%s\n"
+		"                     machines: arm (default), aarch64, i386, x86_64\n"
+		"     --symbol [name] the symbol of the embedded output (default: the\n"
+		"                     outfile name), also name_end and name_size\n"
+		"     --embed-align [bytes]\n"
+		"                     the alignment of the embedded data (default %u)\n"
+		"     --trim          remove the border of pixels equal to the top left\n"
+		"                     one, or transparent, and write where the rest\n"
+		"                     was to outfile%s\n"
+		"     --crop x,y,w,h  read only the w*h region at (x, y) of the input\n"
+		"     --grid w,h[,margin[,spacing]]\n"
+		"                     slice the input into w*h cells, written to\n"
+		"                     outfile with _0, _1, ... before the extension\n"
+		"     --rects [file]  slice the input into the x,y,w,h rectangles\n"
+		"                     listed in file, one per line\n"
+		"     --batch [file]  convert every \"infile outfile\" pair listed in file,\n"
+		"                     reading ahead and writing behind asynchronously\n"
+		"     --pack [frames] pack the frames of a directory, or listed in a file\n"
+		"                     one per line, into one animation file\n"
+		"     --delta         pack only the rectangle that changed since the\n"
+		"                     previous frame\n"
+		"     --align [bytes] start every packed frame at a multiple of bytes\n"
+		"                     (default 512)\n"
+		"     --io-engine [auto|uring|threads]\n"
+		"                     the asynchronous I/O engine of --batch\n"
+		"     --serve [socket]\n"
+		"                     convert the requests of clients on a UNIX socket,\n"
+		"                     until SIGINT or SIGTERM\n"
+		"     --tar [bmp|raw] infile and outfile are ustar archives, every file\n"
+		"                     of infile is converted to a bmp or raw file of\n"
+		"                     outfile, by a pool of workers\n"
+		"     --workers [n]   the connections served, or the files of --tar\n"
+		"                     converted, at once (default: the CPUs)\n"
+		"     --queue [n]     the accepted connections that wait for a worker\n"
+		"                     (default %u)\n"
+		"     --max-memory [size]\n"
+		"                     stream the rows through a buffer of at most size\n"
+		"                     bytes (K, M or G suffix), instead of loading\n"
+		"                     the whole image\n"
+		"     --top-down      write the %s rows top-down (negative height)\n"
+		"     --info          print the headers of the %s files as JSON,\n"
+		"                     without reading their pixels\n"
+		"     --compare       compare two images: the different pixels, their\n"
+		"                     bounding box and the PSNR of each channel, the\n"
+		"                     exit status is 0 if equal, 1 if not, 2 on errors\n"
+		"     --equal-only    stop comparing at the first difference\n"
+		"     --perf          print the time and the hardware counters (cycles,\n"
+		"                     instructions, cache and branch misses) of each\n"
+		"                     stage of the conversion as JSON, to stderr\n"
+		"     --help          display this help and exit\n",
 		PICTURE_EXTENSION,
 		PICTURE_EXTENSION,
+		PICTURE_EXTENSION,
+		PICTURE_TYPE,
+		LAYOUT_TILE,
+		PIXMAP_ALIGNMENT,
+		PIXMAP_MAX_ALIGNMENT,
+		PICTURE_EXTENSION,
+		PICTURE_EXTENSION,
+		PICTURE_EXTENSION,
+		PICTURE_EXTENSION,
+		DISPLAY_CHUNK,
+		DISPLAY_ALIGNMENT,
+		EMBED_STUB_EXTENSION,
+		EMBED_ALIGNMENT,
+		TRIM_EXTENSION,
+		SERVE_QUEUE,
+		PICTURE_TYPE,
 		PICTURE_TYPE
 	);
 }
@@ -76,14 +236,296 @@ out:
 	return err;
 }
 
+// a hexadecimal number of 1 to digits digits
+static int strto_hex(const char *str, udword_t *number, size_t digits)
+{
+	assert(str != NULL);
+	assert(number != NULL);
+	size_t length = strlen(str);
+	if (length == 0 || length > digits || strspn(str, "0123456789abcdefABCDEF") != length) {
+		fprintf(stderr, "Expected up to %zu hexadecimal digits: '%s'\n", digits, str);
+		return 1;
+	}
+	*number = strtoul(str, NULL, 16);
+	return 0;
+}
+
+// parse up to max comma separated numbers, store how many were found in count
+static int strto_ul_list(const char *str, udword_t *numbers, size_t max, size_t *count)
+{
+	assert(str != NULL);
+	assert(numbers != NULL);
+	assert(count != NULL);
+	int err = 0;
+	char *tmp = NULL;
+	strnewcpy(&tmp, str);
+
+	*count = 0;
+	char *token = tmp;
+	while (!err) {
+		char *comma = strchr(token, ',');
+		if (comma != NULL)
+			*comma = '\0';
+
+		if (*count == max || *token == '\0') {
+			fprintf(stderr, "Expected up to %zu comma separated numbers: '%s'\n", max, str);
+			err = 1;
+			break;
+		}
+		err = strto_ul(token, &(numbers[*count]));
+		*count += 1;
+
+		if (comma == NULL)
+			break;
+		token = comma + 1;
+	}
+	free(tmp);
+	return err;
+}
+
+// string to size_t, with an optional K, M or G suffix
+static int strto_size(const char *str, size_t *number)
+{
+	assert(str != NULL);
+	assert(number != NULL);
+	int err = 0;
+	size_t tmp = 0;
+	size_t i = 0;
+	for (; isdigit(str[i]); i++) {
+		size_t digit = str[i] - '0';
+		if (tmp > (SIZE_MAX - digit) / 10) {
+			err = 1;
+			goto out;
+		}
+		tmp = 10 * tmp + digit;
+	}
+	if (i == 0) {
+		err = 1;
+		goto out;
+	}
+
+	int shift = 0;
+	switch (str[i]) {
+	case '\0':
+		break;
+	case 'k':
+	case 'K':
+		shift = 10;
+		break;
+	case 'm':
+	case 'M':
+		shift = 20;
+		break;
+	case 'g':
+	case 'G':
+		shift = 30;
+		break;
+	default:
+		err = 1;
+		goto out;
+	}
+	if (shift != 0 && str[i + 1] != '\0') {
+		err = 1;
+		goto out;
+	}
+	if (tmp > SIZE_MAX >> shift) {
+		err = 1;
+		goto out;
+	}
+	*number = tmp << shift;
+out:
+	if (err)
+		fprintf(stderr, "Invalid size: '%s'\n", str);
+	return err;
+}
+
+static int open_outfile(const char *name, FILE **fp)
+{
+	if (access(name, F_OK) == 0) {
+		printf("File '%s' already exists.\n", name);
+		return 1;
+	}
+	*fp = fopen(name, "w+");
+	if (*fp == NULL) {
+		printf("Cannot open file '%s'\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+// the stream the writers write to: outfile, checksummed on the way if asked
+static int open_sink(const struct options *opt, const char *name, FILE **outfile, struct checksum **sum, FILE **sink)
+{
+	if (!opt->hash_only && open_outfile(name, outfile))
+		return 1;
+
+	*sink = *outfile;
+	if (opt->checksum != 0) {
+		checksum_new(sum, opt->checksum);
+		*sink = checksum_fopen(*sum, *outfile);
+	}
+	return 0;
+}
+
+static int close_sink(const struct options *opt, const char *name, struct checksum *sum, FILE *sink)
+{
+	if (sum == NULL)
+		return 0;
+
+	int rc = checksum_fclose(sum, sink);
+	if (rc == 0)
+		rc = checksum_report(sum, name, stdout);
+	if (rc == 0 && opt->sidecar)
+		rc = checksum_write_sidecar(sum, name);
+	return rc;
+}
+
+// the output modes that exclude each other, of the modes that convert many inputs
+static bool conflicting_outputs(const struct options *opt)
+{
+	bool display = (opt->display != NULL);
+	return (display && opt->indexed)
+		|| (opt->out_layout != NULL && (display || opt->indexed))
+		|| (opt->gray != NULL && (display || opt->indexed || opt->out_layout != NULL))
+		|| (opt->truecolor != 0 && (display || opt->indexed || opt->gray != NULL
+		|| opt->out_layout != NULL));
+}
+
+// read both files like single inputs, in the output format
+static int compare_files(const struct options *opt, char **names, bool equal_only, bool *equal)
+{
+	int rc = 0;
+	struct arena *arena = NULL;
+	struct pixmap *pix[2] = {NULL, NULL};
+
+	arena_new(&arena, 0);
+	for (int i = 0; i < 2 && rc == 0; i++) {
+		FILE *fp = fopen(names[i], "r");
+		if (fp == NULL) {
+			printf("Cannot open file '%s'\n", names[i]);
+			rc = 1;
+			break;
+		}
+		struct picture *pic = NULL;
+		picture_new(&pic, arena);
+		rc = convert_read(opt, fp, is_pic(names[i]), pic, &(pix[i]), arena);
+		picture_free(pic);
+		fclose(fp);
+	}
+
+	struct compare_result result;
+	if (rc == 0)
+		rc = compare_pixmaps(pix[0], pix[1], opt->out_format, equal_only, &result);
+	if (rc == 0) {
+		rc = compare_report(&result, equal_only, stdout);
+		*equal = result.equal;
+	}
+
+	pixmap_free(pix[0]);
+	pixmap_free(pix[1]);
+	arena_free(arena);
+	return rc;
+}
+
+// a JSON array of the headers, the files that fail are left out
+static int print_info(char **names, int count)
+{
+	int rc = 0;
+	struct picture *pic = NULL;
+	picture_new(&pic, NULL);
+
+	bool first = true;
+	printf("[\n");
+	for (int i = 0; i < count; i++) {
+		FILE *fp = fopen(names[i], "r");
+		if (fp == NULL) {
+			fprintf(stderr, "Cannot open file '%s'\n", names[i]);
+			rc = 1;
+			continue;
+		}
+		// a BITMAPV5HEADER and its masks fit, the pixels aren't read ahead
+		setvbuf(fp, NULL, _IOFBF, 256);
+		if (picture_read_header(pic, fp) == 0) {
+			printf(first ? "  " : ",\n  ");
+			rc |= picture_print_info(pic, names[i], stdout);
+			first = false;
+		} else {
+			fprintf(stderr, "Cannot read the header of '%s'\n", names[i]);
+			rc = 1;
+		}
+		fclose(fp);
+	}
+	printf(first ? "]\n" : "\n]\n");
+
+	picture_free(pic);
+	return rc;
+}
+
 int main(int argc, char *argv[])
 {
 	int rc = 0;
 
 	char *inname = NULL;
 	char *outname = NULL;
-	udword_t width = 0;
+	struct options opt = {
+		.width = 0,
+		.top_down = false,
+		.crop_is_set = false,
+		.crop = {0, 0, 0, 0},
+		.checksum = 0,
+		.hash_only = false,
+		.sidecar = false,
+		.in_format = format_get(format_rgb565),
+		.out_format = format_get(format_rgb565),
+		.indexed = false,
+		.gray = NULL,
+		.truecolor = 0,
+		.composite = NULL,
+		.pointop = NULL,
+		.display = NULL,
+		.in_layout = NULL,
+		.out_layout = NULL,
+		.in_align = PIXMAP_ALIGNMENT,
+		.out_align = PIXMAP_ALIGNMENT,
+		.buffer_align = 1
+	};
+	struct checksum *sum = NULL;
+	FILE *sink = NULL;
+	bool grid_is_set = false;
+	struct grid grid = {0, 0, 0, 0};
+	char *rectsname = NULL;
+	struct region *cells = NULL;
+	size_t cell_count = 0;
+	bool max_memory_is_set = false;
+	size_t max_memory = 0;
+	char *batchname = NULL;
+	enum aio_engine engine = aio_auto;
+	FILE *batchfile = NULL;
+	char *packname = NULL;
+	char *servename = NULL;
+	udword_t workers = 0;
+	udword_t queue = SERVE_QUEUE;
+	bool tar_is_set = false;
+	bool tar_pic = false;
+	char *symbolname = NULL;
+	udword_t embed_alignment = EMBED_ALIGNMENT;
+	struct composite *composite = NULL;
+	struct pointop *pointop = NULL;
+	bool trim_is_set = false;
+	bool perf_is_set = false;
+	struct region trimmed = {0, 0, 0, 0};
+	udword_t trimmed_width = 0;
+	udword_t trimmed_height = 0;
+	udword_t alignment = ANIM_ALIGNMENT;
+	bool display_is_set = false;
+	struct display_options display = {display_ili9341, 0, 0, DISPLAY_CHUNK, DISPLAY_ALIGNMENT, false};
+	struct gray_options gray = {0, false, false};
+	struct embed *embed = NULL;
+	FILE *target = NULL;
+	struct layout in_layout = {layout_rows, 0, 0};
+	struct layout out_layout = {layout_rows, 0, 0};
 
+	struct arena *arena = NULL;
 	struct picture *pic = NULL;
 	struct pixmap *pix = NULL;
 	FILE *infile = NULL;
@@ -91,13 +533,82 @@ int main(int argc, char *argv[])
 
 	{
 		static int help_flag = 0;
+		static int top_down_flag = 0;
+		static int hash_only_flag = 0;
+		static int sidecar_flag = 0;
+		static int indexed_flag = 0;
+		static int delta_flag = 0;
+		static int info_flag = 0;
+		static int compare_flag = 0;
+		static int trim_flag = 0;
+		static int dither_flag = 0;
+		static int lsb_first_flag = 0;
+		static int equal_only_flag = 0;
+		static int perf_flag = 0;
+		static int landscape_flag = 0;
 		bool infile_is_set = false;
 		bool outfile_is_set = false;
 		bool width_is_set = false;
+		bool in_format_is_set = false;
+		bool unrecognized = false;
 		int c;
+		udword_t numbers[4];
+		size_t count = 0;
 		while (1) {
 			static struct option long_options[] = {
 				{"help", no_argument, &help_flag, true},
+				{"crop", required_argument, NULL, 'c'},
+				{"grid", required_argument, NULL, 'g'},
+				{"rects", required_argument, NULL, 'r'},
+				{"max-memory", required_argument, NULL, 'm'},
+				{"batch", required_argument, NULL, 'b'},
+				{"io-engine", required_argument, NULL, 'e'},
+				{"serve", required_argument, NULL, 'U'},
+				{"workers", required_argument, NULL, 'j'},
+				{"tar", required_argument, NULL, 't'},
+				{"queue", required_argument, NULL, 'q'},
+				{"pack", required_argument, NULL, 'p'},
+				{"delta", no_argument, &delta_flag, true},
+				{"info", no_argument, &info_flag, true},
+				{"compare", no_argument, &compare_flag, true},
+				{"trim", no_argument, &trim_flag, true},
+				{"equal-only", no_argument, &equal_only_flag, true},
+				{"perf", no_argument, &perf_flag, true},
+				{"align", required_argument, NULL, 'a'},
+				{"background", required_argument, NULL, 'B'},
+				{"background-image", required_argument, NULL, 'I'},
+				{"color-key", required_argument, NULL, 'k'},
+				{"gamma", required_argument, NULL, 'Y'},
+				{"brightness", required_argument, NULL, 'H'},
+				{"contrast", required_argument, NULL, 'K'},
+				{"gains", required_argument, NULL, 'J'},
+				{"desaturate", no_argument, NULL, 'D'},
+				{"remap", required_argument, NULL, 'X'},
+				{"display", required_argument, NULL, 'd'},
+				{"embed", required_argument, NULL, 'E'},
+				{"symbol", required_argument, NULL, 'S'},
+				{"embed-align", required_argument, NULL, 'N'},
+				{"window", required_argument, NULL, 'W'},
+				{"landscape", no_argument, &landscape_flag, true},
+				{"dma-chunk", required_argument, NULL, 'C'},
+				{"dma-align", required_argument, NULL, 'A'},
+				{"checksum", required_argument, NULL, 's'},
+				{"in-format", required_argument, NULL, 'F'},
+				{"out-format", required_argument, NULL, 'f'},
+				{"in-layout", required_argument, NULL, 'L'},
+				{"in-row-align", required_argument, NULL, 'R'},
+				{"out-row-align", required_argument, NULL, 'T'},
+				{"buffer-align", required_argument, NULL, 'Z'},
+				{"out-layout", required_argument, NULL, 'l'},
+				{"in-height", required_argument, NULL, 'h'},
+				{"hash-only", no_argument, &hash_only_flag, true},
+				{"sidecar", no_argument, &sidecar_flag, true},
+				{"indexed", no_argument, &indexed_flag, true},
+				{"gray", required_argument, NULL, 'G'},
+				{"truecolor", required_argument, NULL, 'V'},
+				{"dither", no_argument, &dither_flag, true},
+				{"lsb-first", no_argument, &lsb_first_flag, true},
+				{"top-down", no_argument, &top_down_flag, true},
 				{"infile", required_argument, NULL, 'i'},
 				{"outfile", required_argument, NULL, 'o'},
 				{"width", required_argument, NULL, 'w'},
@@ -137,32 +648,672 @@ int main(int argc, char *argv[])
 				outfile_is_set = true;
 				break;
 
+			case 'c':
+				if (opt.crop_is_set) {
+					help();
+					goto out;
+				}
+				rc = strto_ul_list(optarg, numbers, 4, &count);
+				if (rc == 0 && count != 4) {
+					fprintf(stderr, "Expected x,y,w,h: '%s'\n", optarg);
+					rc = 1;
+				}
+				if (rc)
+					goto out;
+				opt.crop.x = numbers[0];
+				opt.crop.y = numbers[1];
+				opt.crop.width = numbers[2];
+				opt.crop.height = numbers[3];
+				opt.crop_is_set = true;
+				break;
+
+			case 'g':
+				if (grid_is_set || rectsname != NULL) {
+					help();
+					goto out;
+				}
+				numbers[2] = 0;
+				numbers[3] = 0;
+				rc = strto_ul_list(optarg, numbers, 4, &count);
+				if (rc == 0 && count < 2) {
+					fprintf(stderr, "Expected w,h[,margin[,spacing]]: '%s'\n", optarg);
+					rc = 1;
+				}
+				if (rc)
+					goto out;
+				grid.cell_width = numbers[0];
+				grid.cell_height = numbers[1];
+				grid.margin = numbers[2];
+				grid.spacing = numbers[3];
+				grid_is_set = true;
+				break;
+
+			case 'r':
+				if (grid_is_set || rectsname != NULL) {
+					help();
+					goto out;
+				}
+				strnewcpy(&rectsname, optarg);
+				break;
+
+			case 'b':
+				if (batchname != NULL) {
+					help();
+					goto out;
+				}
+				strnewcpy(&batchname, optarg);
+				break;
+
+			case 'p':
+				if (packname != NULL) {
+					help();
+					goto out;
+				}
+				strnewcpy(&packname, optarg);
+				break;
+
+			case 'U':
+				if (servename != NULL) {
+					help();
+					goto out;
+				}
+				strnewcpy(&servename, optarg);
+				break;
+
+			case 't':
+				if (tar_is_set || (strcmp(optarg, "bmp") != 0 && strcmp(optarg, "raw") != 0)) {
+					help();
+					goto out;
+				}
+				tar_pic = (strcmp(optarg, "bmp") == 0);
+				tar_is_set = true;
+				break;
+
+			case 'j':
+			case 'q':
+				rc = strto_ul(optarg, (c == 'j') ? &workers : &queue);
+				if (rc)
+					goto out;
+				if ((c == 'j' && workers == 0) || (c == 'q' && queue == 0)) {
+					help();
+					goto out;
+				}
+				break;
+
+			case 'a':
+				rc = strto_ul(optarg, &alignment);
+				if (rc)
+					goto out;
+				if (alignment == 0) {
+					help();
+					goto out;
+				}
+				break;
+
+			case 'B':
+				rc = strto_hex(optarg, &(numbers[0]), 6);
+				if (rc)
+					goto out;
+				if (composite == NULL)
+					composite_new(&composite);
+				composite_set_color(composite, numbers[0]);
+				break;
+
+			case 'I':
+				{
+					numbers[0] = 0;
+					numbers[1] = 0;
+					count = 2;
+					char *comma = strchr(optarg, ',');
+					if (comma != NULL) {
+						*comma = '\0';
+						rc = strto_ul_list(comma + 1, numbers, 2, &count);
+					}
+					if (rc == 0 && count != 2) {
+						fprintf(stderr, "Expected file[,x,y]: '%s'\n", optarg);
+						rc = 1;
+					}
+					if (rc)
+						goto out;
+					if (composite == NULL)
+						composite_new(&composite);
+					rc = composite_load_background(composite, optarg, numbers[0], numbers[1]);
+					if (rc)
+						goto out;
+				}
+				break;
+
+			case 'k':
+				rc = strto_hex(optarg, &(numbers[0]), 4);
+				if (rc)
+					goto out;
+				if (composite == NULL)
+					composite_new(&composite);
+				composite_set_key(composite, numbers[0]);
+				break;
+
+			case 'Y':
+			case 'H':
+			case 'K':
+			case 'J':
+			case 'D':
+			case 'X':
+				if (pointop == NULL)
+					pointop_new(&pointop);
+				if (c == 'Y') {
+					rc = pointop_add_gamma(pointop, optarg);
+				} else if (c == 'H') {
+					bool negative = (optarg[0] == '-');
+					rc = strto_ul(optarg + negative, &(numbers[0]));
+					if (rc == 0 && numbers[0] > 255) {
+						help();
+						goto out;
+					}
+					if (rc == 0)
+						rc = pointop_add_brightness(pointop, negative ? -(long)numbers[0] : (long)numbers[0]);
+				} else if (c == 'K') {
+					rc = strto_ul(optarg, &(numbers[0]));
+					if (rc == 0)
+						rc = pointop_add_contrast(pointop, numbers[0]);
+				} else if (c == 'J') {
+					rc = strto_ul_list(optarg, numbers, 3, &count);
+					if (rc == 0 && count != 3) {
+						fprintf(stderr, "Expected r,g,b: '%s'\n", optarg);
+						rc = 1;
+					}
+					if (rc == 0)
+						rc = pointop_add_gains(pointop, numbers);
+				} else if (c == 'D') {
+					rc = pointop_add_desaturate(pointop);
+				} else {
+					char *comma = strchr(optarg, ',');
+					if (comma == NULL) {
+						fprintf(stderr, "Expected XXXX,YYYY: '%s'\n", optarg);
+						rc = 1;
+						goto out;
+					}
+					*comma = '\0';
+					rc = strto_hex(optarg, &(numbers[0]), 4);
+					if (rc == 0)
+						rc = strto_hex(comma + 1, &(numbers[1]), 4);
+					if (rc == 0)
+						rc = pointop_add_remap(pointop, numbers[0], numbers[1]);
+				}
+				if (rc)
+					goto out;
+				break;
+
+			case 'E':
+				if (embed != NULL || embed_new(&embed, optarg)) {
+					help();
+					goto out;
+				}
+				break;
+
+			case 'S':
+				if (symbolname != NULL) {
+					help();
+					goto out;
+				}
+				strnewcpy(&symbolname, optarg);
+				break;
+
+			case 'N':
+				rc = strto_ul(optarg, &embed_alignment);
+				if (rc)
+					goto out;
+				if (embed_alignment == 0 || (embed_alignment & (embed_alignment - 1)) != 0) {
+					help();
+					goto out;
+				}
+				break;
+
+			case 'G':
+				rc = strto_ul(optarg, &(numbers[0]));
+				if (rc)
+					goto out;
+				if (numbers[0] != 1 && numbers[0] != 4) {
+					help();
+					goto out;
+				}
+				gray.bits = numbers[0];
+				break;
+
+			case 'V':
+				rc = strto_ul(optarg, &(numbers[0]));
+				if (rc)
+					goto out;
+				if (numbers[0] != 24 && numbers[0] != 32) {
+					help();
+					goto out;
+				}
+				opt.truecolor = numbers[0];
+				break;
+
+			case 'd':
+				if (display_find(optarg, &(display.controller))) {
+					help();
+					goto out;
+				}
+				display_is_set = true;
+				break;
+
+			case 'W':
+				rc = strto_ul_list(optarg, numbers, 2, &count);
+				if (rc == 0 && count != 2) {
+					fprintf(stderr, "Expected x,y: '%s'\n", optarg);
+					rc = 1;
+				}
+				if (rc)
+					goto out;
+				display.x = numbers[0];
+				display.y = numbers[1];
+				break;
+
+			case 'C':
+				rc = strto_ul(optarg, &(display.chunk));
+				if (rc)
+					goto out;
+				if (display.chunk < BYTES_PER_PIXEL) {
+					help();
+					goto out;
+				}
+				break;
+
+			case 'A':
+				rc = strto_ul(optarg, &(display.alignment));
+				if (rc)
+					goto out;
+				if (display.alignment == 0) {
+					help();
+					goto out;
+				}
+				break;
+
+			case 'e':
+				if (strcmp(optarg, "auto") == 0) {
+					engine = aio_auto;
+				} else if (strcmp(optarg, "uring") == 0) {
+					engine = aio_uring;
+				} else if (strcmp(optarg, "threads") == 0) {
+					engine = aio_threads;
+				} else {
+					help();
+					goto out;
+				}
+				break;
+
+			case 's':
+				if (strcmp(optarg, "crc32") == 0) {
+					opt.checksum = CHECKSUM_CRC32;
+				} else if (strcmp(optarg, "xxh32") == 0) {
+					opt.checksum = CHECKSUM_XXH32;
+				} else if (strcmp(optarg, "all") == 0) {
+					opt.checksum = CHECKSUM_CRC32 | CHECKSUM_XXH32;
+				} else {
+					help();
+					goto out;
+				}
+				break;
+
+			case 'F':
+				opt.in_format = format_find(optarg);
+				if (opt.in_format == NULL) {
+					help();
+					goto out;
+				}
+				in_format_is_set = true;
+				break;
+
+			case 'f':
+				opt.out_format = format_find(optarg);
+				if (opt.out_format == NULL) {
+					help();
+					goto out;
+				}
+				break;
+
+			case 'L':
+			case 'l':
+				{
+					struct layout *layout = (c == 'L') ? &in_layout : &out_layout;
+					numbers[0] = 0;
+					char *comma = strchr(optarg, ',');
+					if (comma != NULL) {
+						*comma = '\0';
+						rc = strto_ul(comma + 1, &(numbers[0]));
+						if (rc)
+							goto out;
+					}
+					if (layout_find(optarg, numbers[0], layout)) {
+						help();
+						goto out;
+					}
+				}
+				break;
+
+			case 'h':
+				rc = strto_ul(optarg, &(in_layout.height));
+				if (rc)
+					goto out;
+				if (in_layout.height == 0) {
+					help();
+					goto out;
+				}
+				break;
+
+			case 'R':
+			case 'T':
+				{
+					udword_t *alignment = (c == 'R') ? &(opt.in_align) : &(opt.out_align);
+					rc = strto_ul(optarg, alignment);
+					if (rc)
+						goto out;
+					if (pixmap_check_alignment(*alignment)) {
+						help();
+						goto out;
+					}
+				}
+				break;
+
+			case 'Z':
+				rc = strto_ul(optarg, &(opt.buffer_align));
+				if (rc)
+					goto out;
+				if (opt.buffer_align == 0 || (opt.buffer_align & (opt.buffer_align - 1)) != 0) {
+					help();
+					goto out;
+				}
+				break;
+
+			case 'm':
+				if (max_memory_is_set) {
+					help();
+					goto out;
+				}
+				rc = strto_size(optarg, &max_memory);
+				if (rc)
+					goto out;
+				max_memory_is_set = true;
+				break;
+
 			case 'w':
 				if (width_is_set) {
 					help();
 					goto out;
 				}
-				rc = strto_ul(optarg, &width);
+				rc = strto_ul(optarg, &(opt.width));
 				width_is_set = true;
 				break;
 
+			// the options after it are still read, for --compare
 			case '?':
-				help();
-				goto out;
+				unrecognized = true;
+				break;
 
 			default:
 				abort();
 			}
 		}
+		if (unrecognized) {
+			help();
+			// 0 would read as equal
+			if (compare_flag)
+				rc = 2;
+			goto out;
+		}
+		opt.top_down = top_down_flag;
+		opt.hash_only = hash_only_flag;
+		opt.sidecar = sidecar_flag;
+		opt.indexed = indexed_flag;
+		opt.composite = composite;
+		if (pointop != NULL) {
+			pointop_compile(pointop, opt.out_format);
+			opt.pointop = pointop;
+		}
+		gray.dither = dither_flag;
+		gray.lsb_first = lsb_first_flag;
+		if (embed == NULL && (symbolname != NULL || embed_alignment != EMBED_ALIGNMENT)) {
+			help();
+			goto out;
+		}
+		if (embed != NULL) {
+			if (symbolname != NULL && embed_set_symbol(embed, symbolname)) {
+				help();
+				goto out;
+			}
+			embed_set_alignment(embed, embed_alignment);
+		}
+		if (gray.bits == 0 && (dither_flag || lsb_first_flag)) {
+			help();
+			goto out;
+		}
+		if (gray.bits != 0)
+			opt.gray = &gray;
+		if (!display_is_set && landscape_flag) {
+			help();
+			goto out;
+		}
+		display.landscape = landscape_flag;
+		if (display_is_set) {
+			rc = display_check_format(opt.out_format);
+			if (rc)
+				goto out;
+		}
+		if (display_is_set)
+			opt.display = &display;
+		// the other layouts have no padding rows
+		if (in_layout.height != 0 && in_layout.id != layout_tiles && in_layout.id != layout_morton) {
+			help();
+			goto out;
+		}
+		if (in_layout.id != layout_rows)
+			opt.in_layout = &in_layout;
+		if (out_layout.id != layout_rows)
+			opt.out_layout = &out_layout;
+		// the truecolor pixels are an output format of their own
+		if (opt.truecolor != 0 && (opt.indexed || opt.gray != NULL || display_is_set
+		    || opt.out_layout != NULL)) {
+			help();
+			goto out;
+		}
+		trim_is_set = trim_flag;
+		if ((opt.hash_only || opt.sidecar) && opt.checksum == 0)
+			opt.checksum = CHECKSUM_CRC32;
+
+		// the report goes to stderr, apart from the output of the mode; the server
+		// and tar workers aren't profiled
+		if (perf_flag) {
+			if (info_flag || servename != NULL || tar_is_set) {
+				help();
+				goto out;
+			}
+			perf_open();
+			perf_is_set = true;
+		}
+
+		// only the headers of the remaining arguments
+		if (info_flag) {
+			if (infile_is_set || outfile_is_set || optind == argc || embed != NULL || servename != NULL) {
+				help();
+				goto out;
+			}
+			rc = print_info(&(argv[optind]), argc - optind);
+			goto out;
+		}
+
+		// two inputs and no output, like cmp(1)
+		if (compare_flag) {
+			if (infile_is_set || outfile_is_set || argc - optind != 2
+			    || grid_is_set || rectsname != NULL || max_memory_is_set || opt.indexed
+			    || display_is_set || opt.gray != NULL || embed != NULL || servename != NULL
+			    || pointop != NULL || opt.truecolor != 0 || batchname != NULL || packname != NULL
+			    || tar_is_set || trim_flag || opt.checksum != 0 || opt.sidecar) {
+				// 0 would read as equal
+				help();
+				rc = 2;
+				goto out;
+			}
+			bool equal = false;
+			rc = compare_files(&opt, &(argv[optind]), equal_only_flag, &equal);
+			if (rc)
+				rc = 2;
+			else if (!equal)
+				rc = 1;
+			goto out;
+		}
+
+		// the batch list replaces -i and -o, and takes plain conversions
+		if (batchname != NULL) {
+			if (infile_is_set || outfile_is_set || opt.crop_is_set || trim_flag
+			    || grid_is_set || rectsname != NULL || max_memory_is_set || embed != NULL
+			    || servename != NULL
+			    || conflicting_outputs(&opt)) {
+				help();
+				goto out;
+			}
+			batchfile = fopen(batchname, "r");
+			if (batchfile == NULL) {
+				printf("Cannot open file '%s'\n", batchname);
+				rc = 1;
+				goto out;
+			}
+			rc = batch_run(&opt, batchfile, engine);
+			goto out;
+		}
+
+		// the entries of the archives are converted like one input each, from
+		// memory streams, which the region readers cannot pread()
+		if (tar_is_set) {
+			if (!infile_is_set || !outfile_is_set || packname != NULL || servename != NULL
+			    || opt.crop_is_set || trim_flag || grid_is_set || rectsname != NULL
+			    || max_memory_is_set || embed != NULL || opt.checksum != 0 || optind != argc
+			    || queue != SERVE_QUEUE
+			    || conflicting_outputs(&opt)) {
+				help();
+				goto out;
+			}
+			infile = fopen(inname, "r");
+			if (infile == NULL) {
+				printf("Cannot open file '%s'\n", inname);
+				rc = 1;
+				goto out;
+			}
+			rc = open_outfile(outname, &outfile);
+			if (rc)
+				goto out;
+			rc = tar_run(&opt, infile, outfile, tar_pic, workers);
+			if (fclose(outfile) != 0)
+				rc = 1;
+			outfile = NULL;
+			goto out;
+		}
+
+		// the clients send the inputs and get the outputs, the other options are shared
+		if (servename == NULL && (workers != 0 || queue != SERVE_QUEUE)) {
+			help();
+			goto out;
+		}
+		if (servename != NULL) {
+			if (infile_is_set || outfile_is_set || packname != NULL || opt.crop_is_set || trim_flag
+			    || grid_is_set || rectsname != NULL || max_memory_is_set || embed != NULL
+			    || opt.checksum != 0 || optind != argc
+			    || conflicting_outputs(&opt)) {
+				help();
+				goto out;
+			}
+			rc = serve_run(&opt, servename, workers, queue);
+			goto out;
+		}
+
+		// the frames replace -i, they are converted like one input each, and
+		// --align places them in the output instead of --buffer-align
+		if (packname != NULL) {
+			if (infile_is_set || !outfile_is_set || opt.buffer_align != 1 || grid_is_set || rectsname != NULL
+			    || max_memory_is_set || opt.indexed || trim_flag || display_is_set
+			    || opt.out_layout != NULL || opt.gray != NULL || opt.truecolor != 0) {
+				help();
+				goto out;
+			}
+			rc = open_sink(&opt, outname, &outfile, &sum, &sink);
+			if (rc)
+				goto out;
+			target = (embed != NULL) ? embed_open(embed, outname, sink) : sink;
+			rc = anim_pack(&opt, packname, target, delta_flag, alignment);
+			if (rc == 0 && embed != NULL)
+				rc = embed_close(embed, target);
+			if (rc)
+				goto out;
+			rc = close_sink(&opt, outname, sum, sink);
+			sink = NULL;
+			if (rc == 0 && embed != NULL && !opt.hash_only)
+				rc = embed_write_stub(embed, outname);
+			goto out;
+		}
+
 		if (!infile_is_set || !outfile_is_set) {
 			help();
 			goto out;
 		}
-		if (!(is_pic(inname) || is_pic(outname))) {
+		// cropping, slicing and the pixel transforms are also useful between pixmaps
+		bool reshape = opt.crop_is_set || grid_is_set || rectsname != NULL || trim_flag;
+		// the slicer writes many outputs, which aren't checksummed
+		if ((grid_is_set || rectsname != NULL) && opt.checksum != 0) {
 			help();
 			goto out;
 		}
-		if (!is_pic(inname) && is_pic(outname) && !width_is_set) {
+		bool transform = reshape || opt.indexed || opt.gray != NULL || opt.truecolor != 0
+			|| composite != NULL || pointop != NULL
+			|| display_is_set
+			|| embed != NULL
+			|| opt.in_layout != NULL || opt.out_layout != NULL
+			|| opt.in_align != opt.out_align || opt.buffer_align != 1
+			|| !format_equal(opt.in_format, opt.out_format);
+		if (!(is_pic(inname) || is_pic(outname) || transform)) {
+			help();
+			goto out;
+		}
+		if (!is_pic(inname) && !width_is_set) {
+			help();
+			goto out;
+		}
+		// a picture describes its own pixel layout
+		if ((is_pic(inname) && (in_format_is_set || opt.in_layout != NULL))
+		    || (is_pic(outname) && opt.out_layout != NULL)) {
+			help();
+			goto out;
+		}
+		// streaming converts between exactly one picture and one pixmap
+		if (max_memory_is_set && (reshape || opt.indexed || composite != NULL || pointop != NULL || embed != NULL
+		    || opt.in_layout != NULL || opt.out_layout != NULL || is_pic(inname) == is_pic(outname))) {
+			help();
+			goto out;
+		}
+		if ((opt.indexed || trim_flag || embed != NULL) && (grid_is_set || rectsname != NULL)) {
+			help();
+			goto out;
+		}
+		// the command stream is an output of its own
+		if (display_is_set && (is_pic(outname) || opt.indexed || max_memory_is_set
+		    || grid_is_set || rectsname != NULL)) {
+			help();
+			goto out;
+		}
+		// the gray levels are an output format of their own
+		if (opt.gray != NULL && (opt.indexed || display_is_set || opt.out_layout != NULL
+		    || max_memory_is_set || grid_is_set || rectsname != NULL
+		    || (gray.lsb_first && is_pic(outname)))) {
+			help();
+			goto out;
+		}
+		if (opt.truecolor != 0 && (max_memory_is_set || grid_is_set || rectsname != NULL)) {
+			help();
+			goto out;
+		}
+		// the layouts are of whole pixmaps, the cells and the palette are rows
+		if ((opt.in_layout != NULL && opt.crop_is_set)
+		    || (opt.out_layout != NULL && (opt.indexed || display_is_set
+		    || grid_is_set || rectsname != NULL))) {
 			help();
 			goto out;
 		}
@@ -175,54 +1326,112 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
-	picture_new(&pic);
-
-	if (is_pic(inname)) {
-		rc = picture_read(pic, infile);
+	if (max_memory_is_set) {
+		rc = open_sink(&opt, outname, &outfile, &sum, &sink);
 		if (rc)
 			goto out;
-		pix = picture_get_pixmap(pic);
-	} else {
-		pixmap_new(&pix, width);
-		rc = pixmap_read(pix, infile);
+
+		if (is_pic(inname))
+			rc = stream_picture_to_pixmap(infile, sink, opt.out_format,
+				opt.out_align, opt.buffer_align, max_memory);
+		else
+			rc = stream_pixmap_to_picture(infile, sink, opt.width, opt.in_align, opt.top_down,
+				opt.in_format, opt.out_format, max_memory);
 		if (rc)
 			goto out;
-	}
 
-	if (access(outname, F_OK) == 0) {
-		printf("File '%s' already exists.\n", outname);
-		rc = 1;
+		rc = close_sink(&opt, outname, sum, sink);
+		sink = NULL;
 		goto out;
 	}
-	outfile = fopen(outname, "w+");
-	if (outfile == NULL) {
-		printf("Cannot open file '%s'\n", outname);
-		rc = 1;
+
+	arena_new(&arena, 0);
+	picture_new(&pic, arena);
+
+	rc = convert_read(&opt, infile, is_pic(inname), pic, &pix, arena);
+	if (rc)
 		goto out;
-	}
 
-	if (is_pic(outname)) {
-		picture_set_pixmap(pic, pix);
-		pix = NULL;
-		rc = picture_write(pic, outfile);
-		if (rc)
-			goto out;
-	} else {
-		rc = pixmap_write(pix, outfile);
+	if (grid_is_set || rectsname != NULL) {
+		if (grid_is_set) {
+			rc = slicer_grid(pixmap_get_x(pix), pixmap_get_y(pix), &grid, &cells, &cell_count);
+		} else {
+			FILE *rectsfile = fopen(rectsname, "r");
+			if (rectsfile == NULL) {
+				printf("Cannot open file '%s'\n", rectsname);
+				rc = 1;
+				goto out;
+			}
+			rc = slicer_read_rects(rectsfile, &cells, &cell_count);
+			fclose(rectsfile);
+		}
 		if (rc)
 			goto out;
+
+		rc = slicer_write(pix, cells, cell_count, outname, opt.top_down, opt.out_format, opt.out_align);
+		goto out;
 	}
 
+	if (trim_is_set) {
+		trimmed_width = pixmap_get_x(pix);
+		trimmed_height = pixmap_get_y(pix);
+		if (trim_bounds(pix, opt.out_format, &trimmed)) {
+			print_warning();
+			fprintf(stderr, "The image is all border, only one pixel is left.\n");
+		}
+		trim(&pix, &trimmed, arena);
+	}
+
+	rc = open_sink(&opt, outname, &outfile, &sum, &sink);
+	if (rc)
+		goto out;
+
+	target = (embed != NULL) ? embed_open(embed, outname, sink) : sink;
+	rc = convert_write(&opt, target, is_pic(outname), pic, pix);
+	pix = NULL;
+	if (rc == 0 && embed != NULL)
+		rc = embed_close(embed, target);
+	if (rc)
+		goto out;
+
+	rc = close_sink(&opt, outname, sum, sink);
+	sink = NULL;
+	if (rc == 0 && embed != NULL && !opt.hash_only)
+		rc = embed_write_stub(embed, outname);
+	if (rc == 0 && trim_is_set && !opt.hash_only)
+		rc = trim_write_sidecar(outname, &trimmed, trimmed_width, trimmed_height);
+
 out:
 	picture_free(pic);
 	pixmap_free(pix);
+	arena_free(arena);
+
+	if (perf_is_set) {
+		perf_print_json(stderr);
+		perf_close();
+	}
+
+	if (sum != NULL && sink != NULL)
+		checksum_fclose(sum, sink);
+	checksum_free(sum);
 
+	if (batchfile != NULL)
+		fclose(batchfile);
 	if (infile != NULL)
 		fclose(infile);
 	if (outfile != NULL)
 		fclose(outfile);
 
+	free(cells);
 	free(inname);
 	free(outname);
+	free(rectsname);
+	free(batchname);
+	free(packname);
+	free(servename);
+	free(symbolname);
+	embed_free(embed);
+	composite_free(composite);
+	pointop_free(pointop);
 	return rc;
 }
@@ -0,0 +1,406 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_utils.h"
+#include "format.h"
+#include "jobs.h"
+#include "palette.h"
+#include "pixmap.h"
+
+#define HASH_SLOTS (2 * PALETTE_SIZE) // a power of 2
+#define LOOKUP_BLOCK 1024u // the colors searched per job
+
+struct palette
+{
+	const struct pixel_format *format;
+	uint16_t colors[PALETTE_SIZE];
+	unsigned char rgba[PALETTE_SIZE][4];
+	unsigned count;
+
+	// with exact colors, the index of each color by hash
+	bool exact;
+	int32_t keys[HASH_SLOTS]; // -1 if the slot is empty
+	unsigned char values[HASH_SLOTS];
+
+	// else the index of every color of the input, or PALETTE_SIZE
+	uint16_t *lookup;
+};
+
+static size_t hash(uint16_t color)
+{
+	return ((color * 40503u) >> 7) & (HASH_SLOTS - 1);
+}
+
+// the slot of color, or of the empty slot where it belongs
+static size_t slot(const struct palette *ptr, uint16_t color)
+{
+	size_t i = hash(color);
+	while (ptr->keys[i] != -1 && ptr->keys[i] != color)
+		i = (i + 1) & (HASH_SLOTS - 1);
+	return i;
+}
+
+static void add_color(struct palette *ptr, uint16_t color)
+{
+	ptr->colors[ptr->count] = color;
+	format_unpack(ptr->format, color, ptr->rgba[ptr->count]);
+	ptr->count++;
+}
+
+// collect the colors, fails as soon as there are more than PALETTE_SIZE
+static bool count_exact(struct palette *ptr, uint16_t **rows, udword_t width, udword_t height)
+{
+	for (size_t i = 0; i < HASH_SLOTS; i++)
+		ptr->keys[i] = -1;
+
+	for (udword_t y = 0; y < height; y++) {
+		for (udword_t x = 0; x < width; x++) {
+			uint16_t color = rows[y][x];
+			size_t i = slot(ptr, color);
+			if (ptr->keys[i] != -1)
+				continue;
+			if (ptr->count == PALETTE_SIZE)
+				return false;
+
+			ptr->keys[i] = color;
+			ptr->values[i] = ptr->count;
+			add_color(ptr, color);
+		}
+	}
+	return true;
+}
+
+struct entry
+{
+	uint16_t color;
+	unsigned char rgba[4];
+	unsigned char key; // the channel being sorted
+	udword_t pixels;
+};
+
+struct box
+{
+	size_t first;
+	size_t count;
+};
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct entry *x = a;
+	const struct entry *y = b;
+	return (int)x->key - (int)y->key;
+}
+
+// the channel with the widest range, returns the range
+static unsigned widest_channel(const struct entry *entries, const struct box *box, int *channel)
+{
+	unsigned range = 0;
+	for (int c = 0; c < 4; c++) {
+		unsigned char lo = UCHAR_MAX;
+		unsigned char hi = 0;
+		for (size_t i = box->first; i < box->first + box->count; i++) {
+			if (entries[i].rgba[c] < lo)
+				lo = entries[i].rgba[c];
+			if (entries[i].rgba[c] > hi)
+				hi = entries[i].rgba[c];
+		}
+		if (hi - lo >= (int)range) {
+			range = hi - lo;
+			*channel = c;
+		}
+	}
+	return range;
+}
+
+// the color of the palette nearest to color
+static unsigned char search(const struct palette *ptr, uint16_t color)
+{
+	unsigned char rgba[4];
+	format_unpack(ptr->format, color, rgba);
+
+	unsigned best = 0;
+	unsigned long best_distance = ULONG_MAX;
+	for (unsigned i = 0; i < ptr->count; i++) {
+		unsigned long distance = 0;
+		for (int c = 0; c < 4; c++) {
+			long d = (long)rgba[c] - ptr->rgba[i][c];
+			distance += d * d;
+		}
+		if (distance < best_distance) {
+			best_distance = distance;
+			best = i;
+		}
+	}
+	return best;
+}
+
+struct lookup_ctx
+{
+	struct palette *palette;
+	const struct entry *entries;
+	size_t count;
+};
+
+static int fill_lookup(void *arg, size_t index)
+{
+	struct lookup_ctx *ctx = arg;
+	size_t last = (index + 1) * LOOKUP_BLOCK;
+	if (last > ctx->count)
+		last = ctx->count;
+
+	for (size_t i = index * LOOKUP_BLOCK; i < last; i++)
+		ctx->palette->lookup[ctx->entries[i].color] = search(ctx->palette, ctx->entries[i].color);
+	return 0;
+}
+
+static void median_cut(struct palette *ptr, uint16_t **rows, udword_t width, udword_t height)
+{
+	udword_t *histogram = calloc(UINT16_MAX + 1, sizeof(udword_t));
+	if (histogram == NULL)
+		abort();
+
+	size_t count = 0;
+	for (udword_t y = 0; y < height; y++) {
+		for (udword_t x = 0; x < width; x++) {
+			if (histogram[rows[y][x]]++ == 0)
+				count++;
+		}
+	}
+
+	struct entry *entries = malloc(count * sizeof(struct entry));
+	if (entries == NULL)
+		abort();
+
+	size_t n = 0;
+	for (size_t color = 0; color <= UINT16_MAX; color++) {
+		if (histogram[color] == 0)
+			continue;
+		entries[n].color = color;
+		entries[n].pixels = histogram[color];
+		format_unpack(ptr->format, color, entries[n].rgba);
+		n++;
+	}
+	free(histogram);
+
+	// split the box with the widest channel range at its pixel median
+	struct box boxes[PALETTE_SIZE] = {{0, count}};
+	unsigned box_count = 1;
+	while (box_count < PALETTE_SIZE) {
+		unsigned widest = 0;
+		unsigned best = box_count;
+		int channel = 0;
+		for (unsigned i = 0; i < box_count; i++) {
+			int c = 0;
+			if (boxes[i].count < 2)
+				continue;
+			unsigned range = widest_channel(entries, &(boxes[i]), &c);
+			if (best == box_count || range > widest) {
+				widest = range;
+				best = i;
+				channel = c;
+			}
+		}
+		if (best == box_count)
+			break;
+
+		struct box *box = &(boxes[best]);
+		struct entry *first = &(entries[box->first]);
+		uint64_t total = 0;
+		for (size_t i = 0; i < box->count; i++) {
+			first[i].key = first[i].rgba[channel];
+			total += first[i].pixels;
+		}
+		qsort(first, box->count, sizeof(struct entry), compare_entries);
+
+		size_t split = 1;
+		uint64_t below = first[0].pixels;
+		while (split < box->count - 1 && 2 * below < total) {
+			below += first[split].pixels;
+			split++;
+		}
+
+		boxes[box_count].first = box->first + split;
+		boxes[box_count].count = box->count - split;
+		box->count = split;
+		box_count++;
+	}
+
+	// the pixel weighted mean of each box
+	for (unsigned i = 0; i < box_count; i++) {
+		uint64_t sum[4] = {0};
+		uint64_t pixels = 0;
+		for (size_t j = boxes[i].first; j < boxes[i].first + boxes[i].count; j++) {
+			for (int c = 0; c < 4; c++)
+				sum[c] += (uint64_t)entries[j].rgba[c] * entries[j].pixels;
+			pixels += entries[j].pixels;
+		}
+		unsigned char rgba[4];
+		for (int c = 0; c < 4; c++)
+			rgba[c] = (sum[c] + pixels / 2) / pixels;
+		add_color(ptr, format_pack(ptr->format, rgba));
+	}
+
+	// search once per color of the input, not once per pixel
+	ptr->lookup = malloc((UINT16_MAX + 1) * sizeof(uint16_t));
+	if (ptr->lookup == NULL)
+		abort();
+	for (size_t color = 0; color <= UINT16_MAX; color++)
+		ptr->lookup[color] = PALETTE_SIZE;
+	struct lookup_ctx ctx = {ptr, entries, count};
+	jobs_run((count + LOOKUP_BLOCK - 1) / LOOKUP_BLOCK, 0, fill_lookup, &ctx);
+	free(entries);
+}
+
+void palette_new(struct palette **ptr, struct pixmap *pix, const struct pixel_format *format)
+{
+	assert(ptr != NULL);
+	assert(pix != NULL);
+	assert(format != NULL);
+
+	struct palette *new = malloc(sizeof(struct palette));
+	if (new == NULL)
+		abort();
+
+	new->format = format;
+	new->count = 0;
+	new->lookup = NULL;
+
+	uint16_t **rows = pixmap_get_rows(pix);
+	new->exact = count_exact(new, rows, pixmap_get_x(pix), pixmap_get_y(pix));
+	if (!new->exact) {
+		new->count = 0;
+		median_cut(new, rows, pixmap_get_x(pix), pixmap_get_y(pix));
+	}
+	free(rows);
+
+	*ptr = new;
+}
+
+void palette_free(struct palette *ptr)
+{
+	if (ptr != NULL)
+		free(ptr->lookup);
+	free(ptr);
+}
+
+unsigned palette_get_count(struct palette *ptr)
+{
+	assert(ptr != NULL);
+	return ptr->count;
+}
+
+// the colors as 0x00RRGGBB
+void palette_get_rgb(struct palette *ptr, udword_t colors[PALETTE_SIZE])
+{
+	assert(ptr != NULL);
+	for (unsigned i = 0; i < PALETTE_SIZE; i++) {
+		colors[i] = 0;
+		if (i < ptr->count) {
+			colors[i] = (udword_t)ptr->rgba[i][0] << 16
+				| (udword_t)ptr->rgba[i][1] << 8
+				| ptr->rgba[i][2];
+		}
+	}
+}
+
+static unsigned char nearest(const struct palette *ptr, uint16_t color)
+{
+	if (ptr->exact)
+		return ptr->values[slot(ptr, color)];
+	if (ptr->lookup[color] < PALETTE_SIZE)
+		return ptr->lookup[color];
+	return search(ptr, color);
+}
+
+struct map_ctx
+{
+	const struct palette *palette;
+	uint16_t **rows;
+	udword_t width;
+	unsigned char *indices;
+};
+
+static int map_row(void *arg, size_t index)
+{
+	struct map_ctx *ctx = arg;
+	unsigned char *out = ctx->indices + index * ctx->width;
+	for (udword_t x = 0; x < ctx->width; x++)
+		out[x] = nearest(ctx->palette, ctx->rows[index][x]);
+	return 0;
+}
+
+// the index of every pixel, row by row, the rows are mapped in parallel
+int palette_map(struct palette *ptr, struct pixmap *pix, unsigned char **indices)
+{
+	assert(ptr != NULL);
+	assert(pix != NULL);
+	assert(indices != NULL);
+
+	struct map_ctx ctx = {
+		.palette = ptr,
+		.rows = pixmap_get_rows(pix),
+		.width = pixmap_get_x(pix)
+	};
+	ctx.indices = malloc((size_t)ctx.width * pixmap_get_y(pix) + 1);
+	if (ctx.indices == NULL)
+		abort();
+
+	int rc = jobs_run(pixmap_get_y(pix), 0, map_row, &ctx);
+	free(ctx.rows);
+
+	*indices = ctx.indices;
+	return rc;
+}
+
+/*
+ * The raw indexed layout: PALETTE_SIZE colors of 2 bytes, in the format of
+ * the palette, then the rows of 1 byte indices, padded to a multiple of
+ * alignment. The whole output is padded to a multiple of buffer_align.
+ */
+int palette_write(struct palette *ptr, const unsigned char *indices, udword_t width, udword_t height,
+	udword_t alignment, udword_t buffer_align, FILE *fp)
+{
+	assert(ptr != NULL);
+	assert(fp != NULL);
+	assert(alignment != 0 && alignment <= PIXMAP_MAX_ALIGNMENT);
+	assert(buffer_align != 0);
+	int rc = 0;
+
+	for (unsigned i = 0; i < PALETTE_SIZE && rc == 0; i++) {
+		uint16_t color = 0;
+		if (i < ptr->count)
+			color = ptr->colors[i];
+		rc = fput_uword(color, fp);
+	}
+
+	static const unsigned char zero[PIXMAP_MAX_ALIGNMENT] = {0};
+	size_t padding = (alignment - width % alignment) % alignment;
+	for (udword_t y = 0; y < height && rc == 0; y++) {
+		rc = (fwrite(indices + (size_t)y * width, 1, width, fp) != width);
+		if (rc == 0 && padding != 0)
+			rc = (fwrite(zero, 1, padding, fp) != padding);
+	}
+
+	uint64_t size = 2 * PALETTE_SIZE + ((uint64_t)width + padding) * height;
+	uint64_t missing = (buffer_align - size % buffer_align) % buffer_align;
+	while (missing > 0 && rc == 0) {
+		size_t count = (missing < sizeof(zero)) ? missing : sizeof(zero);
+		rc = (fwrite(zero, 1, count, fp) != count);
+		missing -= count;
+	}
+
+	if (rc) {
+		print_error();
+		fprintf(stderr, "Cannot write the output file.\n");
+	}
+	return rc;
+}
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_PALETTE_H
+#define PIXMAP565_PALETTE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "file_utils.h"
+#include "pixmap.h"
+
+/*
+ * palette:
+ *
+ * Up to 256 colors for 8 bit indexed output. An image with at most 256
+ * colors keeps them exactly, any other image is quantized with median cut.
+ */
+
+#define PALETTE_SIZE 256
+
+struct palette;
+struct pixel_format;
+
+void palette_new(struct palette **ptr, struct pixmap *pix, const struct pixel_format *format);
+void palette_free(struct palette *ptr);
+
+unsigned palette_get_count(struct palette *ptr);
+void palette_get_rgb(struct palette *ptr, udword_t colors[PALETTE_SIZE]);
+int palette_map(struct palette *ptr, struct pixmap *pix, unsigned char **indices);
+int palette_write(struct palette *ptr, const unsigned char *indices, udword_t width, udword_t height,
+	udword_t alignment, udword_t buffer_align, FILE *fp);
+
+#endif /* PIXMAP565_PALETTE_H */
@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perf.h"
+
+#define PERF_COUNTERS 4
+#define PERF_DEPTH 8
+
+static const char *const stage_names[PERF_STAGES] = {"header", "pixels", "flip", "convert", "write"};
+static const char *const counter_names[PERF_COUNTERS] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+
+struct sample
+{
+	uint64_t ns;
+	uint64_t counts[PERF_COUNTERS];
+};
+
+struct totals
+{
+	uint64_t calls;
+	struct sample sum;
+};
+
+// there is one profile, perf_enter() is called too deep to pass it along
+static struct
+{
+	bool open;
+	int fds[PERF_COUNTERS]; // -1 if the counter is missing
+	int error;              // why the first missing counter is missing
+	bool user_only;         // the kernel is not counted
+	struct totals stages[PERF_STAGES];
+	enum perf_stage stack[PERF_DEPTH];
+	unsigned depth; // may be over PERF_DEPTH, the extra stages aren't charged
+	struct sample mark; // when the innermost stage was entered or resumed
+} profile;
+
+static __thread bool profiling = false;
+
+#if defined(__linux__)
+static int open_counter(uint64_t config, bool user_only)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.inherit = 1;
+	attr.exclude_kernel = user_only;
+	attr.exclude_hv = 1;
+
+	// this thread, on any CPU
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static void open_counters(void)
+{
+	for (unsigned i = 0; i < PERF_COUNTERS; i++)
+		profile.fds[i] = -1;
+
+#if defined(__linux__)
+	static const uint64_t configs[PERF_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES
+	};
+	// perf_event_paranoid 2 allows only the user space counts
+	profile.user_only = false;
+	profile.fds[0] = open_counter(configs[0], false);
+	if (profile.fds[0] < 0 && (errno == EACCES || errno == EPERM)) {
+		profile.user_only = true;
+		profile.fds[0] = open_counter(configs[0], true);
+	}
+	if (profile.fds[0] < 0)
+		profile.error = errno;
+
+	for (unsigned i = 1; i < PERF_COUNTERS; i++) {
+		profile.fds[i] = open_counter(configs[i], profile.user_only);
+		if (profile.fds[i] < 0 && profile.error == 0)
+			profile.error = errno;
+	}
+#else
+	profile.error = ENOSYS;
+#endif
+}
+
+static void take_sample(struct sample *s)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	s->ns = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+
+	for (unsigned i = 0; i < PERF_COUNTERS; i++) {
+		s->counts[i] = 0;
+		// the count, and for how long it was enabled and running
+		uint64_t values[3] = {0, 0, 0};
+		if (profile.fds[i] < 0 || read(profile.fds[i], values, sizeof(values)) != sizeof(values))
+			continue;
+		// scaled up if the counters were multiplexed
+		if (values[2] != 0 && values[2] < values[1])
+			values[0] = (uint64_t)((double)values[0] * values[1] / values[2]);
+		s->counts[i] = values[0];
+	}
+}
+
+// charge the time since the mark to the innermost stage
+static void charge(const struct sample *now)
+{
+	if (profile.depth == 0 || profile.depth > PERF_DEPTH)
+		return;
+
+	struct sample *sum = &(profile.stages[profile.stack[profile.depth - 1]].sum);
+	sum->ns += now->ns - profile.mark.ns;
+	for (unsigned i = 0; i < PERF_COUNTERS; i++)
+		sum->counts[i] += now->counts[i] - profile.mark.counts[i];
+}
+
+// start profiling the stages of this thread
+void perf_open(void)
+{
+	assert(!profile.open);
+	memset(&profile, 0, sizeof(profile));
+	open_counters();
+	profile.open = true;
+	profiling = true;
+}
+
+void perf_close(void)
+{
+	if (!profile.open)
+		return;
+
+	for (unsigned i = 0; i < PERF_COUNTERS; i++) {
+		if (profile.fds[i] >= 0)
+			close(profile.fds[i]);
+	}
+	profile.open = false;
+	profiling = false;
+}
+
+void perf_enter(enum perf_stage stage)
+{
+	if (!profiling)
+		return;
+	assert(stage < PERF_STAGES);
+
+	struct sample now;
+	take_sample(&now);
+	charge(&now);
+	if (profile.depth < PERF_DEPTH) {
+		profile.stack[profile.depth] = stage;
+		profile.stages[stage].calls++;
+	}
+	profile.depth++;
+	profile.mark = now;
+}
+
+void perf_leave(enum perf_stage stage)
+{
+	if (!profiling)
+		return;
+	assert(profile.depth > 0);
+	assert(profile.depth > PERF_DEPTH || profile.stack[profile.depth - 1] == stage);
+	(void)stage;
+
+	struct sample now;
+	take_sample(&now);
+	charge(&now);
+	profile.depth--;
+	profile.mark = now;
+}
+
+/*
+ * Print the stages as a JSON object. The missing counters are null, with
+ * the reason in "error".
+ */
+int perf_print_json(FILE *fp)
+{
+	assert(fp != NULL);
+
+	fprintf(fp, "{\"counters\": {");
+	for (unsigned i = 0; i < PERF_COUNTERS; i++)
+		fprintf(fp, "%s\"%s\": %s", i ? ", " : "", counter_names[i], profile.fds[i] >= 0 ? "true" : "false");
+	fprintf(fp, "}, \"user_only\": %s, \"error\": ", profile.user_only ? "true" : "false");
+	if (profile.error != 0)
+		fprintf(fp, "\"%s\"", strerror(profile.error));
+	else
+		fprintf(fp, "null");
+
+	fprintf(fp, ", \"stages\": [\n");
+	for (unsigned s = 0; s < PERF_STAGES; s++) {
+		const struct totals *t = &(profile.stages[s]);
+		fprintf(fp, "  {\"stage\": \"%s\", \"calls\": %llu, \"ns\": %llu",
+			stage_names[s], (unsigned long long)t->calls, (unsigned long long)t->sum.ns);
+		for (unsigned i = 0; i < PERF_COUNTERS; i++) {
+			if (profile.fds[i] >= 0)
+				fprintf(fp, ", \"%s\": %llu", counter_names[i], (unsigned long long)t->sum.counts[i]);
+			else
+				fprintf(fp, ", \"%s\": null", counter_names[i]);
+		}
+		fprintf(fp, "}%s\n", (s + 1 < PERF_STAGES) ? "," : "");
+	}
+	fprintf(fp, "]}\n");
+	return ferror(fp);
+}
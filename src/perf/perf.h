@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_PERF_H
+#define PIXMAP565_PERF_H
+
+#include <stdio.h>
+
+/*
+ * perf:
+ *
+ * The time, cycles, instructions, cache misses and branch misses of each
+ * stage of a conversion, from the Linux perf_event_open() counters. The
+ * profile is of the whole process, like the counters, but only the thread
+ * that opened it enters and leaves the stages; the threads it starts are
+ * counted in its stage once they are joined.
+ *
+ * The stages nest, each one is charged only while it is the innermost.
+ * Without a profile perf_enter() and perf_leave() do nothing, without the
+ * counters only the time is measured.
+ */
+
+enum perf_stage
+{
+	perf_header,  // parse the picture header
+	perf_pixels,  // read the pixels
+	perf_flip,    // orient the rows and columns
+	perf_convert, // convert the pixel format, flatten
+	perf_write,   // write the output
+	PERF_STAGES
+};
+
+void perf_open(void);
+void perf_close(void);
+
+void perf_enter(enum perf_stage stage);
+void perf_leave(enum perf_stage stage);
+
+int perf_print_json(FILE *fp);
+
+#endif /* PIXMAP565_PERF_H */
@@ -11,7 +11,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "file_utils.h"
+#include "format.h"
+#include "perf.h"
 #include "picture.h"
 #include "pixmap.h"
 
@@ -32,32 +35,39 @@ struct picture
 	dword_t  height; // signed integer
 #define COLOR_PLANES 1ul
 #define BITS_PER_PIXEL 16u
-#define COMPRESSION_METHOD 3ul // BI_BITFIELDS, required for RGB565
+	uword_t  bits_per_pixel; // 16, 24 or 32, or 1, 4 or 8 with a color table
+#define BI_RGB 0ul            // implies RGB555
+#define BI_BITFIELDS 3ul      // the layout is given by the bit masks
+#define BI_ALPHABITFIELDS 6ul // the same, with an alpha mask
+	udword_t compression_method;
 	udword_t image_size; // in bytes
+	uint64_t image_bytes; // the size to write, before it is stored in 32 bits
 	dword_t  horizontal_resolution; // pixels per meter, signed integer
 	dword_t  vertical_resolution;   // pixels per meter, signed integer
 	udword_t palette_colors;
 	udword_t important_colors;
 
-// Extra bit masks (bytes 54~65)
-#define RED_BITMASK   0b1111100000000000ul
-#define GREEN_BITMASK 0b0000011111100000ul
-#define BLUE_BITMASK  0b0000000000011111ul
+// Extra bit masks (bytes 54~65), or part of a BITMAPV3INFOHEADER (bytes 54~69)
+	struct pixel_format format;
 
 // Color table
+	const udword_t *color_table; // 0x00RRGGBB, for 1, 4 or 8 bits per pixel
+
 // Gap1
 // Pixel array
 	struct pixmap *matrix;
+	const unsigned char *indices; // for 1, 4, 8, 24 or 32 bits per pixel, top-down
 
 // Gap 2
 // ICC color profile
+
+	bool top_down; // write a negative height and skip the Y flip
+	struct arena *arena;
 };
 
-void picture_new(struct picture **ptr)
+void picture_new(struct picture **ptr, struct arena *arena)
 {
-	struct picture *new = malloc(sizeof(struct picture));
-	if (new == NULL)
-		abort();
+	struct picture *new = arena_alloc(arena, sizeof(struct picture));
 
 // Bitmap file header
 	new->file_bytes = 14; // (14 is the size of this header)
@@ -67,22 +77,30 @@ void picture_new(struct picture **ptr)
 
 // DIB header (BITMAPINFOHEADER)
 	new->DIB_bytes = 40;
+	new->bits_per_pixel = BITS_PER_PIXEL;
 	new->file_bytes += new->DIB_bytes;
 	new->pixel_array_offset += new->DIB_bytes;
 	new->width = 0;
 	new->height = 0;
 	new->image_size = 0;
+	new->image_bytes = 0;
 	new->horizontal_resolution = 0;
 	new->vertical_resolution = 0;
 	new->palette_colors = 0;
 	new->important_colors = 0;
 
 // Extra bit masks
-	new->file_bytes += 12;
-	new->pixel_array_offset += 12;
+	picture_set_format(new, format_get(format_rgb565));
+
+// Color table
+	new->color_table = NULL;
 
 // Pixel array
 	new->matrix = NULL;
+	new->indices = NULL;
+
+	new->top_down = false;
+	new->arena = arena;
 
 	*ptr = new;
 }
@@ -93,7 +111,13 @@ void picture_free(struct picture *ptr)
 		return;
 
 	pixmap_free(ptr->matrix);
-	free(ptr);
+	arena_release(ptr->arena, ptr);
+}
+
+void picture_set_top_down(struct picture *ptr, bool top_down)
+{
+	assert(ptr != NULL);
+	ptr->top_down = top_down;
 }
 
 void picture_set_pixmap(struct picture *ptr, struct pixmap *matrix)
@@ -101,25 +125,145 @@ void picture_set_pixmap(struct picture *ptr, struct pixmap *matrix)
 	assert(ptr != NULL);
 	assert(ptr->matrix == NULL);
 
-	pixmap_flip_y(matrix);
+	/*
+	 * A pixmap is stored top-down. A positive height tells the reader that
+	 * the rows are stored bottom-up, a negative one that they are top-down.
+	 */
+	if (!ptr->top_down)
+		pixmap_flip_y(matrix);
 
 	ptr->matrix = matrix;
-	ptr->width = pixmap_get_x(matrix);
-	ptr->height = pixmap_get_y(matrix);
+	picture_set_size(ptr, pixmap_get_x(matrix), pixmap_get_y(matrix));
+}
 
-	ptr->image_size = dword_abs(ptr->width) * BYTES_PER_PIXEL;
-	ptr->image_size += ptr->image_size % 4;
-	ptr->image_size *= dword_abs(ptr->height);
+/*
+ * Set the pixel layout to write. Without alpha the masks follow a
+ * BITMAPINFOHEADER, an alpha mask needs a BITMAPV3INFOHEADER.
+ */
+void picture_set_format(struct picture *ptr, const struct pixel_format *format)
+{
+	assert(ptr != NULL);
+	assert(format != NULL);
+	ptr->format = *format;
+	ptr->compression_method = BI_BITFIELDS;
+	if (format->mask[3] != 0) {
+		ptr->DIB_bytes = 56;
+		ptr->pixel_array_offset = 14 + 56;
+	} else {
+		ptr->DIB_bytes = 40;
+		ptr->pixel_array_offset = 14 + 40 + 12;
+	}
+	ptr->file_bytes = ptr->image_size + ptr->pixel_array_offset;
+}
+
+/*
+ * The sizes are 32 bit fields, picture_write() refuses the larger images.
+ * Any width or height past the signed 32 bit fields is also past them.
+ */
+static void set_image_bytes(struct picture *ptr, uint64_t stride, udword_t height)
+{
+	if (__builtin_mul_overflow(stride, (uint64_t)height, &(ptr->image_bytes)))
+		ptr->image_bytes = UINT64_MAX;
+	ptr->image_size = ptr->image_bytes;
 	ptr->file_bytes = ptr->image_size + ptr->pixel_array_offset;
 }
 
+// the bytes of a row of indices, without padding
+static size_t index_row_bytes(udword_t width, uword_t bits)
+{
+	return ((size_t)width * bits + CHAR_BIT - 1) / CHAR_BIT;
+}
+
+// BI_RGB rows of packed bytes, with a color table of count colors
+static void set_packed(struct picture *ptr, udword_t width, udword_t height, uword_t bits,
+	const udword_t *colors, udword_t count, const unsigned char *indices)
+{
+	ptr->bits_per_pixel = bits;
+	ptr->compression_method = BI_RGB;
+	ptr->DIB_bytes = 40;
+	ptr->palette_colors = count;
+	ptr->important_colors = 0;
+	ptr->color_table = colors;
+	ptr->indices = indices;
+
+	ptr->pixel_array_offset = 14 + 40 + 4 * count;
+	ptr->width = width;
+	ptr->height = height;
+	if (ptr->top_down)
+		ptr->height *= -1;
+	uint64_t row_bytes = index_row_bytes(width, bits);
+	set_image_bytes(ptr, (row_bytes + (4 - row_bytes % 4) % 4), height);
+}
+
+/*
+ * Write 1, 4 or 8 bit indices instead of a pixmap. The indices are rows
+ * of packed bytes, top-down and unpadded, the first pixel of each byte in
+ * its high bits. The color table and the indices must outlive
+ * picture_write(), they are not copied.
+ */
+void picture_set_indexed(struct picture *ptr, udword_t width, udword_t height, uword_t bits,
+	const udword_t *colors, udword_t count, const unsigned char *indices)
+{
+	assert(ptr != NULL);
+	assert(ptr->matrix == NULL);
+	assert(bits == 1 || bits == 4 || bits == 8);
+	assert(count <= (1u << bits));
+	set_packed(ptr, width, height, bits, colors, count, indices);
+}
+
+/*
+ * Write 24 or 32 bit BGR(A) pixels instead of a pixmap, rows like the
+ * indices of picture_set_indexed() and without a color table.
+ */
+void picture_set_truecolor(struct picture *ptr, udword_t width, udword_t height, uword_t bits,
+	const unsigned char *pixels)
+{
+	assert(ptr != NULL);
+	assert(ptr->matrix == NULL);
+	assert(bits == 24 || bits == 32);
+	set_packed(ptr, width, height, bits, NULL, 0, pixels);
+}
+
+const struct pixel_format *picture_get_format(struct picture *ptr)
+{
+	assert(ptr != NULL);
+	return &(ptr->format);
+}
+
+// set the dimensions without a pixmap, for writing the rows separately
+void picture_set_size(struct picture *ptr, udword_t width, udword_t height)
+{
+	assert(ptr != NULL);
+	ptr->width = width;
+	ptr->height = height;
+	if (ptr->top_down)
+		ptr->height *= -1;
+
+	set_image_bytes(ptr, pixmap_stride(width, PIXMAP_ALIGNMENT), height);
+}
+
+dword_t picture_get_width(struct picture *ptr)
+{
+	return(ptr->width);
+}
+
+dword_t picture_get_height(struct picture *ptr)
+{
+	return(ptr->height);
+}
+
+udword_t picture_get_pixel_array_offset(struct picture *ptr)
+{
+	return(ptr->pixel_array_offset);
+}
+
 struct pixmap *picture_get_pixmap(struct picture *ptr)
 {
 	struct pixmap *ret = NULL;
 	ret = ptr->matrix;
 	ptr->matrix = NULL;
 
-	// by default the image is stored upside down
+	// by default the image is stored upside down, top-down needs no flip
 	if (ptr->height > 0)
 		pixmap_flip_y(ret);
 
@@ -190,6 +334,7 @@ enum item_ids{
 	red_bitmask,
 	green_bitmask,
 	blue_bitmask,
+	alpha_bitmask,
 
 	gap,        // space gap
 	pixel_line, // pixel(s)
@@ -232,6 +377,7 @@ int type(int item)
 		udword,
 		udword,
 		udword,
+		udword,
 
 		skip, // gap1
 		pixel,
@@ -241,7 +387,11 @@ int type(int item)
 	return (type[item]);
 }
 
-int picture_read(struct picture *ptr, FILE *fp)
+/*
+ * Parse the file sequentially. With header_only set, stop as soon as the
+ * header fields are validated, before the gap and the pixel array.
+ */
+static int picture_parse(struct picture *ptr, FILE *fp, bool header_only)
 {
 	assert(ptr != NULL);
 	assert(fp != NULL);
@@ -251,15 +401,19 @@ int picture_read(struct picture *ptr, FILE *fp)
 
 	int rc = 0;
 
-	udword_t offset = 0; // byte offset of the current item
-	udword_t byte = 0;   // # of bytes from the file start
+	uint64_t offset = 0; // byte offset of the current item
+	uint64_t byte = 0;   // # of bytes from the file start
 
 	uword_t uw_value = 0;
 	dword_t dw_value = 0;
 	udword_t udw_value = 0;
 	int item = 0;
 
-	int skip_bytes = 0;
+	uint64_t skip_bytes = 0;
+	enum perf_stage stage = perf_header;
+	perf_enter(stage);
+
+	unsigned long masks[4] = {0};
 
 	while (rc == 0) {
 		int ch = fgetc(fp);
@@ -284,7 +438,7 @@ int picture_read(struct picture *ptr, FILE *fp)
 			goto out;
 		}
 
-		udword_t item_size = 0;
+		uint64_t item_size = 0;
 		switch (type(item)) {
 		case uword:
 			uw_value += ((uword_t)ch) << (byte - offset) * CHAR_BIT;
@@ -315,7 +469,7 @@ int picture_read(struct picture *ptr, FILE *fp)
 				pixmap_add(ptr->matrix, uw_value);
 				uw_value = 0;
 			}
-			item_size = dword_abs(ptr->width) * BYTES_PER_PIXEL;
+			item_size = (uint64_t)dword_abs(ptr->width) * BYTES_PER_PIXEL;
 			break;
 		}
 		byte++;
@@ -330,9 +484,9 @@ int picture_read(struct picture *ptr, FILE *fp)
 				break;
 
 			case file_bytes:
-				if (udw_value < 14 + 40 + 12) {
+				if (udw_value < 14 + 40) {
 					bad_data("Bitmap file header", "filesize");
-					fprintf(stderr, "expected:  >= %u\n", 14 + 40 + 12);
+					fprintf(stderr, "expected:  >= %u\n", 14 + 40);
 					rc = 1;
 				} else {
 					ptr->file_bytes = udw_value;
@@ -372,38 +526,29 @@ int picture_read(struct picture *ptr, FILE *fp)
 					print_warning();
 					fprintf(stderr, "negative width\n");
 				}
-				/*
-				 * Because we are converting from signed to unsigned, and BYTES_PER_PIXEL <= 2:
-				 * abs(dw_value) <= ULONG_MAX / BYTES_PER_PIXEL
-				 */
-				if (dword_abs(dw_value) * BYTES_PER_PIXEL > (ptr->file_bytes - ptr->pixel_array_offset)) {
+				// the products of the dimensions are 64 bit, the sizes are 32 bit
+				if ((uint64_t)dword_abs(dw_value) * BYTES_PER_PIXEL > (ptr->file_bytes - ptr->pixel_array_offset)) {
 					conflicting_data();
 					fprintf(stderr, "width * %u > filesize - pixel_array_offset\n", BYTES_PER_PIXEL);
 					fprintf(stderr, "(i.e., too many pixels or too little space)\n");
 					rc = 1;
 				} else {
 					ptr->width = dw_value;
-					assert(ptr->matrix == NULL);
-					pixmap_new(&(ptr->matrix), dword_abs(ptr->width));
 				}
 				break;
 
 			case height:
-				if (dw_value <= 0) {
+				// a negative height is valid, the rows are stored top-down
+				if (dw_value == 0) {
 					print_warning();
-					fprintf(stderr, "negative height\n");
+					fprintf(stderr, "zero height\n");
 				}
 				if (dword_abs(dw_value) > (ptr->file_bytes - ptr->pixel_array_offset)) {
 					conflicting_data();
 					fprintf(stderr, "height * %u > filesize - pixel_array_offset\n", BYTES_PER_PIXEL);
 					fprintf(stderr, "(i.e., too many pixels or too little space)\n");
 					rc = 1;
-				} else if (dword_abs(dw_value) * BYTES_PER_PIXEL > ULONG_MAX /  dword_abs(ptr->width)) {
-					conflicting_data();
-					fprintf(stderr, "height * width * %u > %lu\n", BYTES_PER_PIXEL, ULONG_MAX);
-					fprintf(stderr, "(i.e., too many pixels)\n");
-					rc = 1;
-				} else if (dword_abs(ptr->width) * dword_abs(dw_value) * BYTES_PER_PIXEL > ptr->file_bytes - ptr->pixel_array_offset) {
+				} else if ((uint64_t)dword_abs(ptr->width) * dword_abs(dw_value) * BYTES_PER_PIXEL > ptr->file_bytes - ptr->pixel_array_offset) {
 					conflicting_data();
 					fprintf(stderr, "height * width * %u > filesize - pixel_array_offset\n", BYTES_PER_PIXEL);
 					fprintf(stderr, "(i.e., too many pixels or too little space)\n");
@@ -430,17 +575,19 @@ int picture_read(struct picture *ptr, FILE *fp)
 				break;
 
 			case compression_method:
-				if (udw_value != COMPRESSION_METHOD) {
+				if (udw_value != BI_RGB && udw_value != BI_BITFIELDS && udw_value != BI_ALPHABITFIELDS) {
 					bad_data("DIB header", "compression method");
-					fprintf(stderr, "expected:  %lu\n", COMPRESSION_METHOD);
+					fprintf(stderr, "expected:  %lu, %lu or %lu\n", BI_RGB, BI_BITFIELDS, BI_ALPHABITFIELDS);
 					rc = 1;
+				} else {
+					ptr->compression_method = udw_value;
 				}
 				break;
 
 			case image_size:
 				{
-					udword_t tmp = dword_abs(ptr->width) * BYTES_PER_PIXEL;
-					if (udw_value != (tmp + tmp % 4) * dword_abs(ptr->height)) {
+					uint64_t tmp = pixmap_stride(dword_abs(ptr->width), PIXMAP_ALIGNMENT);
+					if (udw_value != tmp * dword_abs(ptr->height)) {
 						conflicting_data();
 						fprintf(stderr, "image_size != (width + padding) * height * %u\n", BYTES_PER_PIXEL);
 						fprintf(stderr, "(i.e., too many pixels or too little space)\n");
@@ -457,27 +604,11 @@ int picture_read(struct picture *ptr, FILE *fp)
 			//case important_colors:
 
 			case red_bitmask:
-				if (udw_value != RED_BITMASK) {
-					bad_data("Extra bit masks", "red bitmask");
-					fprintf(stderr, "expected:  %lu\n", RED_BITMASK);
-					rc = 1;
-				}
-				break;
-
 			case green_bitmask:
-				if (udw_value != GREEN_BITMASK) {
-					bad_data("Extra bit masks", "green bitmask");
-					fprintf(stderr, "expected:  %lu\n", GREEN_BITMASK);
-					rc = 1;
-				}
-				break;
-
 			case blue_bitmask:
-				if (udw_value != BLUE_BITMASK) {
-					bad_data("Extra bit masks", "blue bitmask");
-					fprintf(stderr, "expected:  %lu\n", BLUE_BITMASK);
-					rc = 1;
-				}
+			case alpha_bitmask:
+				// validated together, before the pixel array
+				masks[item - red_bitmask] = udw_value;
 				break;
 
 			//case gap:
@@ -499,13 +630,42 @@ int picture_read(struct picture *ptr, FILE *fp)
 			skip_bytes = 0;
 			do {
 				item++; // we assume (item < gap2)
+
+				// BI_RGB has no masks, unless they are part of the DIB header
+				if (item == red_bitmask && ptr->compression_method == BI_RGB && ptr->DIB_bytes < 52)
+					item = gap;
+				if (item == alpha_bitmask && ptr->compression_method != BI_ALPHABITFIELDS && ptr->DIB_bytes < 56)
+					item = gap;
+
 				if (item == gap) {
+					if (byte > ptr->pixel_array_offset) {
+						conflicting_data();
+						fprintf(stderr, "The bit masks and the pixel array overlap.\n");
+						rc = 1;
+						goto out;
+					}
+					if (ptr->compression_method == BI_RGB) {
+						ptr->format = *format_get(format_rgb555);
+					} else if (format_from_masks(&(ptr->format), masks[0], masks[1], masks[2], masks[3])) {
+						bad_data("Extra bit masks", "bit masks");
+						fprintf(stderr, "expected:  non-overlapping, contiguous 16 bit masks\n");
+						rc = 1;
+						goto out;
+					}
+					if (header_only)
+						goto out;
+					perf_leave(stage);
+					stage = perf_pixels;
+					perf_enter(stage);
+					assert(ptr->matrix == NULL);
+					pixmap_new(&(ptr->matrix), dword_abs(ptr->width), ptr->arena);
 					assert(byte <= ptr->pixel_array_offset);
 					skip_bytes = ptr->pixel_array_offset - byte;
 				}
 				if (item == padding) {
-					if ((dword_abs(ptr->width) * BYTES_PER_PIXEL) % 4 != 0)
-						skip_bytes = 4 - ((dword_abs(ptr->width) * BYTES_PER_PIXEL) % 4);
+					uint64_t row_bytes = (uint64_t)dword_abs(ptr->width) * BYTES_PER_PIXEL;
+					if (pixmap_stride(dword_abs(ptr->width), PIXMAP_ALIGNMENT) != row_bytes)
+						skip_bytes = pixmap_stride(dword_abs(ptr->width), PIXMAP_ALIGNMENT) - row_bytes;
 					else if (byte < ptr->pixel_array_offset + ptr->image_size)
 						item = pixel_line;
 				}
@@ -524,21 +684,182 @@ int picture_read(struct picture *ptr, FILE *fp)
 		}
 	}
 out:
+	perf_leave(stage);
 	if (rc)
 		fprintf(stderr, "\n");
 
 	return rc;
 }
 
-int picture_write(struct picture *ptr, FILE *fp)
+int picture_read(struct picture *ptr, FILE *fp)
+{
+	return picture_parse(ptr, fp, false);
+}
+
+int picture_read_header(struct picture *ptr, FILE *fp)
+{
+	return picture_parse(ptr, fp, true);
+}
+
+static void print_json_string(const char *str, FILE *fp)
+{
+	fputc('"', fp);
+	for (const unsigned char *ch = (const unsigned char *)str; *ch != '\0'; ch++) {
+		if (*ch == '"' || *ch == '\\')
+			fprintf(fp, "\\%c", *ch);
+		else if (*ch < 0x20)
+			fprintf(fp, "\\u%04x", *ch);
+		else
+			fputc(*ch, fp);
+	}
+	fputc('"', fp);
+}
+
+/*
+ * Print the header fields as a JSON object, after picture_read_header().
+ * The dimensions are absolute, their signs are the orientation.
+ */
+int picture_print_info(struct picture *ptr, const char *name, FILE *fp)
+{
+	assert(ptr != NULL);
+	assert(name != NULL);
+	assert(fp != NULL);
+
+	fprintf(fp, "{\"file\": ");
+	print_json_string(name, fp);
+	fprintf(fp,
+		", \"file_bytes\": %llu, \"pixel_array_offset\": %llu, \"DIB_bytes\": %llu"
+		", \"width\": %llu, \"height\": %llu, \"top_down\": %s, \"right_to_left\": %s"
+		", \"bits_per_pixel\": %u, \"compression_method\": %llu, \"image_size\": %llu"
+		", \"bitmasks\": {\"red\": %u, \"green\": %u, \"blue\": %u, \"alpha\": %u}"
+		", \"format\": \"%s\"}",
+		(unsigned long long)ptr->file_bytes,
+		(unsigned long long)ptr->pixel_array_offset,
+		(unsigned long long)ptr->DIB_bytes,
+		(unsigned long long)dword_abs(ptr->width),
+		(unsigned long long)dword_abs(ptr->height),
+		ptr->height < 0 ? "true" : "false",
+		ptr->width < 0 ? "true" : "false",
+		BITS_PER_PIXEL,
+		(unsigned long long)ptr->compression_method,
+		(unsigned long long)ptr->image_size,
+		ptr->format.mask[0], ptr->format.mask[1], ptr->format.mask[2], ptr->format.mask[3],
+		format_name(&(ptr->format))
+	);
+	return ferror(fp);
+}
+
+int picture_read_region(struct picture *ptr, FILE *fp, const struct region *area)
+{
+	assert(ptr != NULL);
+	assert(fp != NULL);
+	assert(area != NULL);
+
+	int rc = picture_read_header(ptr, fp);
+	if (rc)
+		goto out;
+
+	udword_t abs_width = dword_abs(ptr->width);
+	udword_t abs_height = dword_abs(ptr->height);
+	if (area->width == 0 || area->height == 0
+	    || area->x > abs_width || area->width > abs_width - area->x
+	    || area->y > abs_height || area->height > abs_height - area->y) {
+		print_error();
+		fprintf(stderr, "The region is outside of the %llux%llu image.\n",
+			(unsigned long long)abs_width, (unsigned long long)abs_height);
+		rc = 1;
+		goto out;
+	}
+
+	/*
+	 * Read the rows and columns in file order, and keep the signs of the
+	 * dimensions, so that picture_get_pixmap() orients the region the same
+	 * way it would orient the whole image.
+	 */
+	udword_t first_row = area->y;
+	if (ptr->height > 0)
+		first_row = abs_height - area->y - area->height;
+
+	udword_t first_column = area->x;
+	if (ptr->width < 0)
+		first_column = abs_width - area->x - area->width;
+
+	uint64_t stride = pixmap_stride(abs_width, PIXMAP_ALIGNMENT);
+
+	perf_enter(perf_pixels);
+	pixmap_new(&(ptr->matrix), area->width, ptr->arena);
+	for (udword_t i = 0; i < area->height && rc == 0; i++) {
+		off_t row_offset = (off_t)ptr->pixel_array_offset
+			+ (off_t)(first_row + i) * stride
+			+ (off_t)first_column * BYTES_PER_PIXEL;
+		rc = pixmap_pread_row(ptr->matrix, fileno(fp), row_offset);
+	}
+	perf_leave(perf_pixels);
+
+	if (ptr->width < 0)
+		ptr->width = -(dword_t)area->width;
+	else
+		ptr->width = area->width;
+
+	if (ptr->height < 0)
+		ptr->height = -(dword_t)area->height;
+	else
+		ptr->height = area->height;
+
+out:
+	if (rc)
+		fprintf(stderr, "\n");
+
+	return rc;
+}
+
+// the rows of a bottom-up picture are stored last to first
+static int write_indices(struct picture *ptr, FILE *fp)
+{
+	static const unsigned char zero[4] = {0};
+	size_t width = index_row_bytes(dword_abs(ptr->width), ptr->bits_per_pixel);
+	udword_t height = dword_abs(ptr->height);
+	size_t padding = (4 - width % 4) % 4;
+
+	int rc = 0;
+	for (udword_t i = 0; i < height && rc == 0; i++) {
+		udword_t y = i;
+		if (ptr->height > 0)
+			y = height - 1 - i;
+		rc = (fwrite(ptr->indices + (size_t)y * width, 1, width, fp) != width);
+		if (rc == 0 && padding != 0)
+			rc = (fwrite(zero, 1, padding, fp) != padding);
+	}
+	return rc;
+}
+
+/*
+ * Write the file sequentially. With header_only set, stop at the start of
+ * the pixel array.
+ */
+static int picture_emit(struct picture *ptr, FILE *fp, bool header_only)
 {
 	assert(fp != NULL);
 
 	int rc = 0;
-	udword_t byte = 0;
+	uint64_t byte = 0;
+
+	if (ptr->image_bytes > UDWORD_MAX - ptr->pixel_array_offset) {
+		print_error();
+		fprintf(stderr, "The image is larger than the %llu bytes of a %s file, split it with --grid.\n",
+			(unsigned long long)UDWORD_MAX, PICTURE_TYPE);
+		return 1;
+	}
 
 	int item = 0;
 	while (rc == 0) {
+		// BI_RGB has no masks, and only a BITMAPV3INFOHEADER has alpha
+		if ((item >= red_bitmask && item <= alpha_bitmask && ptr->compression_method == BI_RGB)
+		    || (item == alpha_bitmask && ptr->DIB_bytes < 56)) {
+			item++;
+			continue;
+		}
+
 		switch(item) {
 		// Bitmap file header
 		case magic_number:
@@ -583,11 +904,11 @@ int picture_write(struct picture *ptr, FILE *fp)
 			break;
 
 		case bits_per_pixel:
-			rc = fput_uword(BITS_PER_PIXEL, fp);
+			rc = fput_uword(ptr->bits_per_pixel, fp);
 			break;
 
 		case compression_method:
-			rc = fput_udword(COMPRESSION_METHOD, fp);
+			rc = fput_udword(ptr->compression_method, fp);
 			break;
 
 		case image_size:
@@ -612,24 +933,31 @@ int picture_write(struct picture *ptr, FILE *fp)
 
 		// Extra bit masks
 		case red_bitmask:
-			rc = fput_udword(RED_BITMASK, fp);
-			break;
-
 		case green_bitmask:
-			rc = fput_udword(GREEN_BITMASK, fp);
+		case blue_bitmask:
+			rc = fput_udword(ptr->format.mask[item - red_bitmask], fp);
 			break;
 
-		case blue_bitmask:
-			rc = fput_udword(BLUE_BITMASK, fp);
+		case alpha_bitmask:
+			rc = fput_udword(ptr->format.mask[3], fp);
 			break;
 
 		case gap:
+			for (udword_t i = 0; ptr->color_table != NULL && i < ptr->palette_colors && rc == 0; i++) {
+				rc = fput_udword(ptr->color_table[i], fp);
+				byte += 4;
+			}
 			for (; byte < ptr->pixel_array_offset && rc == 0; byte++)
 				rc = (fputc(0, fp) != rc);
 			break;
 
 		case pixel_line:
-			rc = pixmap_write(ptr->matrix, fp);
+			if (header_only)
+				goto out;
+			if (ptr->indices != NULL)
+				rc = write_indices(ptr, fp);
+			else
+				rc = pixmap_write(ptr->matrix, fp, PIXMAP_ALIGNMENT);
 			break;
 
 		case gap2:
@@ -666,3 +994,13 @@ out:
 
 	return rc;
 }
+
+int picture_write(struct picture *ptr, FILE *fp)
+{
+	return picture_emit(ptr, fp, false);
+}
+
+int picture_write_header(struct picture *ptr, FILE *fp)
+{
+	return picture_emit(ptr, fp, true);
+}
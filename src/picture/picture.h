@@ -9,21 +9,38 @@
 #define PICTURE_EXTENSION ".bmp"
 #define PICTURE_TYPE "BMP565"
 
+#include <stdbool.h>
 #include <stdio.h>
 
 #include "pixmap.h"
 
 struct picture;
+struct pixel_format;
 
-void picture_new(struct picture **ptr);
+void picture_new(struct picture **ptr, struct arena *arena);
 void picture_free(struct picture *ptr);
 
+void picture_set_top_down(struct picture *ptr, bool top_down);
 void picture_set_pixmap(struct picture *ptr, struct pixmap *matrix);
+void picture_set_size(struct picture *ptr, udword_t width, udword_t height);
+void picture_set_format(struct picture *ptr, const struct pixel_format *format);
+const struct pixel_format *picture_get_format(struct picture *ptr);
+void picture_set_indexed(struct picture *ptr, udword_t width, udword_t height, uword_t bits,
+	const udword_t *colors, udword_t count, const unsigned char *indices);
+void picture_set_truecolor(struct picture *ptr, udword_t width, udword_t height, uword_t bits,
+	const unsigned char *pixels);
+dword_t picture_get_width(struct picture *ptr);
+dword_t picture_get_height(struct picture *ptr);
+udword_t picture_get_pixel_array_offset(struct picture *ptr);
 struct pixmap *picture_get_pixmap(struct picture *ptr);
 
 bool is_pic(char *filename);
 
 int picture_read(struct picture *ptr, FILE *fp);
+int picture_read_header(struct picture *ptr, FILE *fp);
+int picture_print_info(struct picture *ptr, const char *name, FILE *fp);
+int picture_read_region(struct picture *ptr, FILE *fp, const struct region *area);
 int picture_write(struct picture *ptr, FILE *fp);
+int picture_write_header(struct picture *ptr, FILE *fp);
 
 #endif /* PIXMAP565_PICTURE_H */
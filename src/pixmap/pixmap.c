@@ -7,8 +7,11 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
+#include "arena.h"
 #include "file_utils.h"
+#include "perf.h"
 #include "pixmap.h"
 #include "llnode.h"
 
@@ -18,53 +21,58 @@ struct pixmap
 	udword_t resy;
 	struct llnode *first;
 	struct llnode *last;
+	struct arena *arena;
 };
 
-void pixmap_new(struct pixmap **ptr, udword_t x)
+void pixmap_new(struct pixmap **ptr, udword_t x, struct arena *arena)
 {
 	assert(ptr != NULL);
 	assert(*ptr == NULL);
 
-	struct pixmap *new = malloc(sizeof(struct pixmap));
-	if (new == NULL)
-		abort();
+	struct pixmap *new = arena_alloc(arena, sizeof(struct pixmap));
 
 	new->resx = x;
 	new->resy = 0;
 	new->first = NULL;
 	new->last = NULL;
+	new->arena = arena;
 
 	*ptr = new;
 }
 
 void pixmap_free(struct pixmap *ptr)
 {
-	if (ptr != NULL)
-		llnode_free(ptr->first);
+	if (ptr == NULL)
+		return;
 
-	free(ptr);
+	llnode_free(ptr->first);
+	arena_release(ptr->arena, ptr);
 }
 
 void pixmap_flip_x(struct pixmap *ptr)
 {
 	assert(ptr != NULL);
+	perf_enter(perf_flip);
 	llnode_reverse_data(ptr->first);
+	perf_leave(perf_flip);
 }
 
 void pixmap_flip_y(struct pixmap *ptr)
 {
 	assert(ptr != NULL);
+	perf_enter(perf_flip);
 	llnode_reverse_nodes(ptr->first);
 	struct llnode *tmp = ptr->first;
 	ptr->first = ptr->last;
 	ptr->last = tmp;
+	perf_leave(perf_flip);
 }
 
 void pixmap_add(struct pixmap *ptr, uint16_t pixel)
 {
 	assert(ptr != NULL);
 	if (ptr->first == NULL) {
-		llnode_new(&(ptr->first), ptr->resx);
+		llnode_new(&(ptr->first), ptr->resx, ptr->arena);
 		ptr->last = ptr->first;
 		ptr->resy += 1;
 	}
@@ -74,6 +82,34 @@ void pixmap_add(struct pixmap *ptr, uint16_t pixel)
 		ptr->resy += 1;
 }
 
+// append resx pixels
+void pixmap_add_row(struct pixmap *ptr, const uint16_t *row)
+{
+	assert(ptr != NULL);
+	assert(row != NULL);
+	for (udword_t i = 0; i < ptr->resx; i++)
+		pixmap_add(ptr, row[i]);
+}
+
+/*
+ * Index the rows for random access, top to bottom.
+ * The caller must free() the returned array, but not the rows.
+ */
+uint16_t **pixmap_get_rows(struct pixmap *ptr)
+{
+	assert(ptr != NULL);
+	uint16_t **rows = malloc(sizeof(uint16_t *) * ((size_t)ptr->resy + 1));
+	if (rows == NULL)
+		abort();
+
+	udword_t i = 0;
+	for (struct llnode *node = ptr->first; node != NULL; node = llnode_get_next(node))
+		rows[i++] = llnode_get_array(node);
+
+	assert(i == ptr->resy);
+	return rows;
+}
+
 udword_t pixmap_get_x(struct pixmap *ptr)
 {
 	return(ptr->resx);
@@ -84,10 +120,32 @@ udword_t pixmap_get_y(struct pixmap *ptr)
 	return(ptr->resy);
 }
 
-int pixmap_read(struct pixmap *ptr, FILE *fp)
+// the bytes of a row of width pixels and its padding, which fit in 64 bits
+uint64_t pixmap_stride(udword_t width, udword_t alignment)
+{
+	assert(alignment != 0);
+	uint64_t bytes = (uint64_t)width * BYTES_PER_PIXEL;
+	return (bytes + alignment - 1) / alignment * alignment;
+}
+
+// the bytes of height rows, nonzero if they don't fit in 64 bits
+int pixmap_size(udword_t width, udword_t height, udword_t alignment, uint64_t *size)
+{
+	assert(size != NULL);
+	return __builtin_mul_overflow(pixmap_stride(width, alignment), (uint64_t)height, size);
+}
+
+// the alignment must be a power of 2, at most PIXMAP_MAX_ALIGNMENT
+int pixmap_check_alignment(udword_t alignment)
+{
+	return (alignment == 0 || alignment > PIXMAP_MAX_ALIGNMENT || (alignment & (alignment - 1)) != 0);
+}
+
+int pixmap_read(struct pixmap *ptr, FILE *fp, udword_t alignment)
 {
 	assert(ptr != NULL);
 	int rc = 0;
+	uint64_t padding_bytes = pixmap_stride(ptr->resx, alignment) - (uint64_t)ptr->resx * BYTES_PER_PIXEL;
 
 	enum item_ids{
 		pixel_line, // pixel(s)
@@ -102,12 +160,12 @@ int pixmap_read(struct pixmap *ptr, FILE *fp)
 		skip
 	};
 
-	udword_t offset = 0; // byte offset of the current item
-	udword_t byte = 0;   // # of bytes from the file start
+	uint64_t offset = 0; // byte offset of the current item
+	uint64_t byte = 0;   // # of bytes from the file start
 
 	uword_t uw_value = 0;
 	int item = 0;
-	int skip_bytes = 0;
+	uint64_t skip_bytes = 0;
 
 	while (rc != 1) {
 		int ch = fgetc(fp);
@@ -133,20 +191,27 @@ int pixmap_read(struct pixmap *ptr, FILE *fp)
 			goto out;
 		}
 
-		udword_t item_size = 0;
+		uint64_t item_size = 0;
 		switch (type[item]) {
 		case skip:
 			item_size = skip_bytes;
 			break;
 
 		case pixel:
+			// the row count is 32 bits
+			if (byte == offset && ptr->resy == UDWORD_MAX && llnode_is_full(ptr->last)) {
+				print_error();
+				fprintf(stderr, "The pixmap has more than %llu rows.\n", (unsigned long long)UDWORD_MAX);
+				rc = 1;
+				goto out;
+			}
 			uw_value += ((uword_t)ch) << ((byte - offset) % BYTES_PER_PIXEL) * CHAR_BIT;
 			if ((byte - offset) % BYTES_PER_PIXEL == BYTES_PER_PIXEL - 1) {
 				pixmap_add(ptr, uw_value);
 				uw_value = 0;
 			}
 			assert(ptr->resx != 0);
-			item_size = ptr->resx * BYTES_PER_PIXEL;
+			item_size = (uint64_t)ptr->resx * BYTES_PER_PIXEL;
 			break;
 		}
 		byte++;
@@ -155,8 +220,8 @@ int pixmap_read(struct pixmap *ptr, FILE *fp)
 			skip_bytes = 0;
 			switch (item) {
 			case pixel_line:
-				if ((ptr->resx * BYTES_PER_PIXEL) % 4 != 0) {
-					skip_bytes = 4 - ((ptr->resx * BYTES_PER_PIXEL) % 4);
+				if (padding_bytes != 0) {
+					skip_bytes = padding_bytes;
 					item = padding;
 				}
 				break;
@@ -174,10 +239,88 @@ out:
 	return rc;
 }
 
-int pixmap_write(struct pixmap *ptr, FILE *fp)
+/*
+ * Append one row of resx pixels, read from the given byte offset of fd
+ * without moving its file position.
+ */
+int pixmap_pread_row(struct pixmap *ptr, int fd, off_t offset)
+{
+	assert(ptr != NULL);
+	int rc = 0;
+
+	size_t row_bytes = (size_t)ptr->resx * BYTES_PER_PIXEL;
+	unsigned char *buffer = malloc(row_bytes);
+	if (buffer == NULL)
+		abort();
+
+	rc = pread_all(fd, buffer, row_bytes, offset);
+	if (rc)
+		goto out;
+
+	for (size_t i = 0; i < row_bytes; i += BYTES_PER_PIXEL) {
+		uword_t uw_value = 0;
+		for (size_t j = 0; j < BYTES_PER_PIXEL; j++)
+			uw_value += ((uword_t)buffer[i + j]) << j * CHAR_BIT;
+
+		pixmap_add(ptr, uw_value);
+	}
+
+out:
+	free(buffer);
+	return rc;
+}
+
+/*
+ * Read only the rows of the region from a pixmap that is width pixels wide.
+ * The pixmap must have been created with the width of the region.
+ */
+int pixmap_read_region(struct pixmap *ptr, FILE *fp, udword_t width, udword_t alignment, const struct region *area)
+{
+	assert(ptr != NULL);
+	assert(fp != NULL);
+	assert(area != NULL);
+	assert(ptr->resx == area->width);
+	int rc = 0;
+
+	struct stat st;
+	if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+		print_error();
+		fprintf(stderr, "The input file must be a regular file.\n");
+		rc = 1;
+		goto out;
+	}
+
+	off_t stride = pixmap_stride(width, alignment);
+
+	off_t height = 0;
+	if (stride != 0)
+		height = st.st_size / stride;
+
+	if (area->width == 0 || area->height == 0
+	    || area->x > width || area->width > width - area->x
+	    || area->y > height || area->height > height - area->y) {
+		print_error();
+		fprintf(stderr, "The region is outside of the %llux%llu pixmap.\n",
+			(unsigned long long)width, (unsigned long long)height);
+		rc = 1;
+		goto out;
+	}
+
+	for (udword_t i = 0; i < area->height && rc == 0; i++) {
+		off_t row_offset = (off_t)(area->y + i) * stride
+			+ (off_t)area->x * BYTES_PER_PIXEL;
+		rc = pixmap_pread_row(ptr, fileno(fp), row_offset);
+	}
+
+out:
+	return rc;
+}
+
+int pixmap_write(struct pixmap *ptr, FILE *fp, udword_t alignment)
 {
 	assert(ptr != NULL);
 	int rc = 0;
-	rc = llnode_write(ptr->first, fp);
+	size_t padding = pixmap_stride(ptr->resx, alignment) - (size_t)ptr->resx * BYTES_PER_PIXEL;
+	rc = llnode_write(ptr->first, fp, padding);
 	return rc;
 }
@@ -8,7 +8,9 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
+#include "arena.h"
 #include "file_utils.h"
 
 /*
@@ -20,15 +22,44 @@
 
 struct pixmap;
 
-void pixmap_new(struct pixmap **ptr, udword_t x);
+/*
+ * The rows of a raw pixmap, and of a picture, are padded with zero bytes
+ * to a multiple of the alignment. 1 leaves them unpadded.
+ */
+
+#define PIXMAP_ALIGNMENT 4u
+#define PIXMAP_MAX_ALIGNMENT 4096u
+
+/*
+ * region:
+ *
+ * A rectangle of pixels, (x, y) is the top left corner.
+ */
+
+struct region
+{
+	udword_t x;
+	udword_t y;
+	udword_t width;
+	udword_t height;
+};
+
+void pixmap_new(struct pixmap **ptr, udword_t x, struct arena *arena);
 void pixmap_free(struct pixmap *ptr);
 
 void pixmap_flip_x(struct pixmap *ptr);
 void pixmap_flip_y(struct pixmap *ptr);
 void pixmap_add(struct pixmap *ptr, uint16_t pixel);
+void pixmap_add_row(struct pixmap *ptr, const uint16_t *row);
+uint16_t **pixmap_get_rows(struct pixmap *ptr);
 udword_t pixmap_get_x(struct pixmap *ptr);
 udword_t pixmap_get_y(struct pixmap *ptr);
-int pixmap_read(struct pixmap *ptr, FILE *fp);
-int pixmap_write(struct pixmap *ptr, FILE *fp);
+uint64_t pixmap_stride(udword_t width, udword_t alignment);
+int pixmap_size(udword_t width, udword_t height, udword_t alignment, uint64_t *size);
+int pixmap_check_alignment(udword_t alignment);
+int pixmap_read(struct pixmap *ptr, FILE *fp, udword_t alignment);
+int pixmap_pread_row(struct pixmap *ptr, int fd, off_t offset);
+int pixmap_read_region(struct pixmap *ptr, FILE *fp, udword_t width, udword_t alignment, const struct region *area);
+int pixmap_write(struct pixmap *ptr, FILE *fp, udword_t alignment);
 
 #endif /* PIXMAP565_PIXMAP_H */
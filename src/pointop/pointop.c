@@ -0,0 +1,386 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_utils.h"
+#include "format.h"
+#include "jobs.h"
+#include "pixmap.h"
+#include "pointop.h"
+
+#define POINTOP_TABLE_SIZE 65536u
+#define POINTOP_BAND 64 // rows of one job
+
+enum pointop_kind
+{
+	pointop_curve,      // the same 8 bit table for red, green and blue
+	pointop_gains,      // scale each channel
+	pointop_desaturate, // the luma in every channel
+	pointop_remap       // replace one pixel
+};
+
+struct adjustment
+{
+	enum pointop_kind kind;
+	unsigned char curve[256];
+	udword_t gains[3]; // in percent
+	uint16_t from;
+	uint16_t to;
+};
+
+struct pointop
+{
+	struct adjustment chain[POINTOP_MAX];
+	size_t count;
+	struct pixel_format format; // of the table
+	bool compiled;
+	uint16_t *table;
+};
+
+// the curves 255 * (x / 255)^(1 / gamma), and the sRGB transfer functions
+static const struct
+{
+	const char *name;
+	unsigned char curve[256];
+} builtin_curves[] = {
+	{"1.8", {
+		  0,  12,  17,  22,  25,  29,  32,  35,  37,  40,  42,  44,  47,  49,  51,  53,
+		 55,  57,  58,  60,  62,  64,  65,  67,  69,  70,  72,  73,  75,  76,  78,  79,
+		 80,  82,  83,  85,  86,  87,  89,  90,  91,  92,  94,  95,  96,  97,  98, 100,
+		101, 102, 103, 104, 105, 107, 108, 109, 110, 111, 112, 113, 114, 115, 116, 117,
+		118, 119, 120, 121, 122, 123, 124, 125, 126, 127, 128, 129, 130, 131, 132, 133,
+		134, 135, 136, 137, 138, 139, 139, 140, 141, 142, 143, 144, 145, 146, 146, 147,
+		148, 149, 150, 151, 152, 152, 153, 154, 155, 156, 157, 157, 158, 159, 160, 161,
+		161, 162, 163, 164, 165, 165, 166, 167, 168, 169, 169, 170, 171, 172, 172, 173,
+		174, 175, 175, 176, 177, 178, 178, 179, 180, 181, 181, 182, 183, 183, 184, 185,
+		186, 186, 187, 188, 188, 189, 190, 191, 191, 192, 193, 193, 194, 195, 195, 196,
+		197, 198, 198, 199, 200, 200, 201, 202, 202, 203, 204, 204, 205, 206, 206, 207,
+		208, 208, 209, 209, 210, 211, 211, 212, 213, 213, 214, 215, 215, 216, 217, 217,
+		218, 218, 219, 220, 220, 221, 222, 222, 223, 223, 224, 225, 225, 226, 226, 227,
+		228, 228, 229, 230, 230, 231, 231, 232, 233, 233, 234, 234, 235, 236, 236, 237,
+		237, 238, 238, 239, 240, 240, 241, 241, 242, 243, 243, 244, 244, 245, 245, 246,
+		247, 247, 248, 248, 249, 249, 250, 251, 251, 252, 252, 253, 253, 254, 254, 255
+	}},
+	{"2.2", {
+		  0,  21,  28,  34,  39,  43,  46,  50,  53,  56,  59,  61,  64,  66,  68,  70,
+		 72,  74,  76,  78,  80,  82,  84,  85,  87,  89,  90,  92,  93,  95,  96,  98,
+		 99, 101, 102, 103, 105, 106, 107, 109, 110, 111, 112, 114, 115, 116, 117, 118,
+		119, 120, 122, 123, 124, 125, 126, 127, 128, 129, 130, 131, 132, 133, 134, 135,
+		136, 137, 138, 139, 140, 141, 142, 143, 144, 144, 145, 146, 147, 148, 149, 150,
+		151, 151, 152, 153, 154, 155, 156, 156, 157, 158, 159, 160, 160, 161, 162, 163,
+		164, 164, 165, 166, 167, 167, 168, 169, 170, 170, 171, 172, 173, 173, 174, 175,
+		175, 176, 177, 178, 178, 179, 180, 180, 181, 182, 182, 183, 184, 184, 185, 186,
+		186, 187, 188, 188, 189, 190, 190, 191, 192, 192, 193, 194, 194, 195, 195, 196,
+		197, 197, 198, 199, 199, 200, 200, 201, 202, 202, 203, 203, 204, 205, 205, 206,
+		206, 207, 207, 208, 209, 209, 210, 210, 211, 212, 212, 213, 213, 214, 214, 215,
+		215, 216, 217, 217, 218, 218, 219, 219, 220, 220, 221, 221, 222, 223, 223, 224,
+		224, 225, 225, 226, 226, 227, 227, 228, 228, 229, 229, 230, 230, 231, 231, 232,
+		232, 233, 233, 234, 234, 235, 235, 236, 236, 237, 237, 238, 238, 239, 239, 240,
+		240, 241, 241, 242, 242, 243, 243, 244, 244, 245, 245, 246, 246, 247, 247, 248,
+		248, 249, 249, 249, 250, 250, 251, 251, 252, 252, 253, 253, 254, 254, 255, 255
+	}},
+	{"2.4", {
+		  0,  25,  34,  40,  45,  50,  53,  57,  60,  63,  66,  69,  71,  74,  76,  78,
+		 80,  83,  84,  86,  88,  90,  92,  94,  95,  97,  98, 100, 102, 103, 105, 106,
+		107, 109, 110, 111, 113, 114, 115, 117, 118, 119, 120, 121, 123, 124, 125, 126,
+		127, 128, 129, 130, 131, 133, 134, 135, 136, 137, 138, 139, 140, 141, 141, 142,
+		143, 144, 145, 146, 147, 148, 149, 150, 151, 151, 152, 153, 154, 155, 156, 156,
+		157, 158, 159, 160, 161, 161, 162, 163, 164, 164, 165, 166, 167, 168, 168, 169,
+		170, 170, 171, 172, 173, 173, 174, 175, 175, 176, 177, 178, 178, 179, 180, 180,
+		181, 182, 182, 183, 184, 184, 185, 186, 186, 187, 188, 188, 189, 189, 190, 191,
+		191, 192, 193, 193, 194, 194, 195, 196, 196, 197, 197, 198, 199, 199, 200, 200,
+		201, 202, 202, 203, 203, 204, 204, 205, 206, 206, 207, 207, 208, 208, 209, 209,
+		210, 211, 211, 212, 212, 213, 213, 214, 214, 215, 215, 216, 216, 217, 217, 218,
+		218, 219, 220, 220, 221, 221, 222, 222, 223, 223, 224, 224, 225, 225, 226, 226,
+		227, 227, 228, 228, 229, 229, 229, 230, 230, 231, 231, 232, 232, 233, 233, 234,
+		234, 235, 235, 236, 236, 237, 237, 238, 238, 238, 239, 239, 240, 240, 241, 241,
+		242, 242, 242, 243, 243, 244, 244, 245, 245, 246, 246, 246, 247, 247, 248, 248,
+		249, 249, 250, 250, 250, 251, 251, 252, 252, 252, 253, 253, 254, 254, 255, 255
+	}},
+	{"srgb", {
+		  0,  13,  22,  28,  34,  38,  42,  46,  50,  53,  56,  59,  61,  64,  66,  69,
+		 71,  73,  75,  77,  79,  81,  83,  85,  86,  88,  90,  92,  93,  95,  96,  98,
+		 99, 101, 102, 104, 105, 106, 108, 109, 110, 112, 113, 114, 115, 117, 118, 119,
+		120, 121, 122, 124, 125, 126, 127, 128, 129, 130, 131, 132, 133, 134, 135, 136,
+		137, 138, 139, 140, 141, 142, 143, 144, 145, 146, 147, 148, 148, 149, 150, 151,
+		152, 153, 154, 155, 155, 156, 157, 158, 159, 159, 160, 161, 162, 163, 163, 164,
+		165, 166, 167, 167, 168, 169, 170, 170, 171, 172, 173, 173, 174, 175, 175, 176,
+		177, 178, 178, 179, 180, 180, 181, 182, 182, 183, 184, 185, 185, 186, 187, 187,
+		188, 189, 189, 190, 190, 191, 192, 192, 193, 194, 194, 195, 196, 196, 197, 197,
+		198, 199, 199, 200, 200, 201, 202, 202, 203, 203, 204, 205, 205, 206, 206, 207,
+		208, 208, 209, 209, 210, 210, 211, 212, 212, 213, 213, 214, 214, 215, 215, 216,
+		216, 217, 218, 218, 219, 219, 220, 220, 221, 221, 222, 222, 223, 223, 224, 224,
+		225, 226, 226, 227, 227, 228, 228, 229, 229, 230, 230, 231, 231, 232, 232, 233,
+		233, 234, 234, 235, 235, 236, 236, 237, 237, 238, 238, 238, 239, 239, 240, 240,
+		241, 241, 242, 242, 243, 243, 244, 244, 245, 245, 246, 246, 246, 247, 247, 248,
+		248, 249, 249, 250, 250, 251, 251, 251, 252, 252, 253, 253, 254, 254, 255, 255
+	}},
+	{"linear", {
+		  0,   0,   0,   0,   0,   0,   0,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+		  1,   1,   2,   2,   2,   2,   2,   2,   2,   2,   3,   3,   3,   3,   3,   3,
+		  4,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,   6,   7,   7,   7,
+		  8,   8,   8,   8,   9,   9,   9,  10,  10,  10,  11,  11,  12,  12,  12,  13,
+		 13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  17,  18,  18,  19,  19,  20,
+		 20,  21,  22,  22,  23,  23,  24,  24,  25,  25,  26,  27,  27,  28,  29,  29,
+		 30,  30,  31,  32,  32,  33,  34,  35,  35,  36,  37,  37,  38,  39,  40,  41,
+		 41,  42,  43,  44,  45,  45,  46,  47,  48,  49,  50,  51,  51,  52,  53,  54,
+		 55,  56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,
+		 71,  72,  73,  74,  76,  77,  78,  79,  80,  81,  82,  84,  85,  86,  87,  88,
+		 90,  91,  92,  93,  95,  96,  97,  99, 100, 101, 103, 104, 105, 107, 108, 109,
+		111, 112, 114, 115, 116, 118, 119, 121, 122, 124, 125, 127, 128, 130, 131, 133,
+		134, 136, 138, 139, 141, 142, 144, 146, 147, 149, 151, 152, 154, 156, 157, 159,
+		161, 163, 164, 166, 168, 170, 171, 173, 175, 177, 179, 181, 183, 184, 186, 188,
+		190, 192, 194, 196, 198, 200, 202, 204, 206, 208, 210, 212, 214, 216, 218, 220,
+		222, 224, 226, 229, 231, 233, 235, 237, 239, 242, 244, 246, 248, 250, 253, 255
+	}}
+};
+
+void pointop_new(struct pointop **ptr)
+{
+	assert(ptr != NULL);
+	assert(*ptr == NULL);
+	*ptr = malloc(sizeof(struct pointop));
+	if (*ptr == NULL)
+		abort();
+
+	(*ptr)->count = 0;
+	(*ptr)->compiled = false;
+	(*ptr)->table = NULL;
+}
+
+void pointop_free(struct pointop *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	free(ptr->table);
+	free(ptr);
+}
+
+static struct adjustment *append(struct pointop *ptr, enum pointop_kind kind)
+{
+	assert(ptr != NULL);
+	if (ptr->count == POINTOP_MAX) {
+		print_error();
+		fprintf(stderr, "More than %u point operations.\n", POINTOP_MAX);
+		return NULL;
+	}
+	ptr->compiled = false;
+	struct adjustment *adj = &(ptr->chain[ptr->count++]);
+	adj->kind = kind;
+	return adj;
+}
+
+static unsigned char clamp(long value)
+{
+	if (value < 0)
+		return 0;
+	if (value > 255)
+		return 255;
+	return value;
+}
+
+// a built-in curve, or the gamma as a number
+int pointop_add_gamma(struct pointop *ptr, const char *curve)
+{
+	assert(curve != NULL);
+	for (size_t i = 0; i < sizeof(builtin_curves) / sizeof(builtin_curves[0]); i++) {
+		if (strcmp(curve, builtin_curves[i].name) == 0) {
+			struct adjustment *adj = append(ptr, pointop_curve);
+			if (adj == NULL)
+				return 1;
+			memcpy(adj->curve, builtin_curves[i].curve, sizeof(adj->curve));
+			return 0;
+		}
+	}
+
+	char *end = NULL;
+	double gamma = strtod(curve, &end);
+	if (end == curve || *end != '\0' || !(gamma >= 0.1 && gamma <= 10.0)) {
+		print_error();
+		fprintf(stderr, "Expected a gamma in [0.1, 10], 1.8, 2.2, 2.4, srgb or linear: '%s'\n", curve);
+		return 1;
+	}
+	struct adjustment *adj = append(ptr, pointop_curve);
+	if (adj == NULL)
+		return 1;
+	for (unsigned x = 0; x < 256; x++)
+		adj->curve[x] = lround(255.0 * pow(x / 255.0, 1.0 / gamma));
+	return 0;
+}
+
+int pointop_add_brightness(struct pointop *ptr, long offset)
+{
+	struct adjustment *adj = append(ptr, pointop_curve);
+	if (adj == NULL)
+		return 1;
+	for (long x = 0; x < 256; x++)
+		adj->curve[x] = clamp(x + offset);
+	return 0;
+}
+
+// around the middle gray
+int pointop_add_contrast(struct pointop *ptr, udword_t percent)
+{
+	struct adjustment *adj = append(ptr, pointop_curve);
+	if (adj == NULL)
+		return 1;
+	for (long x = 0; x < 256; x++)
+		adj->curve[x] = clamp(128 + ((x - 128) * (long)percent + (x < 128 ? -50 : 50)) / 100);
+	return 0;
+}
+
+// the calibration of a panel, percent of red, green and blue
+int pointop_add_gains(struct pointop *ptr, const udword_t percent[3])
+{
+	struct adjustment *adj = append(ptr, pointop_gains);
+	if (adj == NULL)
+		return 1;
+	memcpy(adj->gains, percent, sizeof(adj->gains));
+	return 0;
+}
+
+int pointop_add_desaturate(struct pointop *ptr)
+{
+	return (append(ptr, pointop_desaturate) == NULL);
+}
+
+// from and to are pixels of the format of the table
+int pointop_add_remap(struct pointop *ptr, uint16_t from, uint16_t to)
+{
+	struct adjustment *adj = append(ptr, pointop_remap);
+	if (adj == NULL)
+		return 1;
+	adj->from = from;
+	adj->to = to;
+	return 0;
+}
+
+static void build_table(const struct pointop *ptr, const struct pixel_format *format, uint16_t *table)
+{
+	for (unsigned pixel = 0; pixel < POINTOP_TABLE_SIZE; pixel++) {
+		unsigned char rgba[4];
+		format_unpack(format, pixel, rgba);
+		bool remapped = false;
+		uint16_t result = 0;
+
+		for (size_t i = 0; i < ptr->count; i++) {
+			const struct adjustment *adj = &(ptr->chain[i]);
+			switch (adj->kind) {
+			case pointop_curve:
+				for (int c = 0; c < 3; c++)
+					rgba[c] = adj->curve[rgba[c]];
+				remapped = false;
+				break;
+			case pointop_gains:
+				for (int c = 0; c < 3; c++)
+					rgba[c] = clamp(((long)rgba[c] * adj->gains[c] + 50) / 100);
+				remapped = false;
+				break;
+			case pointop_desaturate:
+				rgba[0] = (77 * rgba[0] + 150 * rgba[1] + 29 * rgba[2] + 128) >> 8;
+				rgba[1] = rgba[0];
+				rgba[2] = rgba[0];
+				remapped = false;
+				break;
+			case pointop_remap:
+				// compared as the pixel would be written
+				if ((remapped ? result : format_pack(format, rgba)) == adj->from) {
+					format_unpack(format, adj->to, rgba);
+					result = adj->to;
+					remapped = true;
+				}
+				break;
+			default:
+				abort();
+			}
+		}
+		// the bits outside the masks are kept
+		uint16_t kept = pixel & ~(format->mask[0] | format->mask[1] | format->mask[2] | format->mask[3]);
+		// a remapped pixel is exact, even with bits outside the masks
+		table[pixel] = remapped ? result : (format_pack(format, rgba) | kept);
+	}
+}
+
+// the table of the format, for every conversion that writes it
+void pointop_compile(struct pointop *ptr, const struct pixel_format *format)
+{
+	assert(ptr != NULL);
+	assert(format != NULL);
+	if (ptr->compiled && format_equal(&(ptr->format), format))
+		return;
+
+	if (ptr->table == NULL) {
+		ptr->table = malloc(POINTOP_TABLE_SIZE * sizeof(uint16_t));
+		if (ptr->table == NULL)
+			abort();
+	}
+	build_table(ptr, format, ptr->table);
+	ptr->format = *format;
+	ptr->compiled = true;
+}
+
+struct apply_ctx
+{
+	uint16_t **rows;
+	udword_t width;
+	udword_t height;
+	const uint16_t *table;
+};
+
+static int apply_band(void *arg, size_t index)
+{
+	struct apply_ctx *ctx = arg;
+	udword_t last = (index + 1) * POINTOP_BAND;
+	if (last > ctx->height)
+		last = ctx->height;
+
+	const uint16_t *table = ctx->table;
+	for (udword_t y = index * POINTOP_BAND; y < last; y++) {
+		uint16_t *row = ctx->rows[y];
+		for (udword_t x = 0; x < ctx->width; x++)
+			row[x] = table[row[x]];
+	}
+	return 0;
+}
+
+/*
+ * Apply the chain to the pixels of pix, in format. Another format than
+ * the compiled one gets a table of its own.
+ */
+int pointop_apply(const struct pointop *ptr, struct pixmap *pix, const struct pixel_format *format)
+{
+	assert(ptr != NULL);
+	assert(pix != NULL);
+	assert(format != NULL);
+
+	uint16_t *table = NULL;
+	if (!ptr->compiled || !format_equal(&(ptr->format), format)) {
+		table = malloc(POINTOP_TABLE_SIZE * sizeof(uint16_t));
+		if (table == NULL)
+			abort();
+		build_table(ptr, format, table);
+	}
+
+	struct apply_ctx ctx = {
+		.rows = pixmap_get_rows(pix),
+		.width = pixmap_get_x(pix),
+		.height = pixmap_get_y(pix),
+		.table = (table != NULL) ? table : ptr->table
+	};
+	int rc = jobs_run((ctx.height + POINTOP_BAND - 1) / POINTOP_BAND, 0, apply_band, &ctx);
+
+	free(ctx.rows);
+	free(table);
+	return rc;
+}
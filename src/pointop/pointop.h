@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_POINTOP_H
+#define PIXMAP565_POINTOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "file_utils.h"
+#include "pixmap.h"
+
+/*
+ * pointop:
+ *
+ * A chain of per-pixel adjustments, in the order they are added, compiled
+ * into one table of all the 65536 pixels of a format. Applying the whole
+ * chain is then one lookup per pixel, in bands of rows on every CPU.
+ *
+ * The adjustments work on the 8 bit red, green and blue of the pixels,
+ * the alpha is kept. The common gamma curves are built-in tables.
+ */
+
+#define POINTOP_MAX 16u // adjustments in a chain
+
+struct pointop;
+struct pixel_format;
+
+void pointop_new(struct pointop **ptr);
+void pointop_free(struct pointop *ptr);
+
+int pointop_add_gamma(struct pointop *ptr, const char *curve);
+int pointop_add_brightness(struct pointop *ptr, long offset);
+int pointop_add_contrast(struct pointop *ptr, udword_t percent);
+int pointop_add_gains(struct pointop *ptr, const udword_t percent[3]);
+int pointop_add_desaturate(struct pointop *ptr);
+int pointop_add_remap(struct pointop *ptr, uint16_t from, uint16_t to);
+
+void pointop_compile(struct pointop *ptr, const struct pixel_format *format);
+int pointop_apply(const struct pointop *ptr, struct pixmap *pix, const struct pixel_format *format);
+
+#endif /* PIXMAP565_POINTOP_H */
@@ -0,0 +1,508 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#define _GNU_SOURCE // fmemopen(), open_memstream(), MSG_NOSIGNAL
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "convert.h"
+#include "file_utils.h"
+#include "format.h"
+#include "jobs.h"
+#include "picture.h"
+#include "serve.h"
+
+struct server
+{
+	const struct options *opt;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	int *queue; // the accepted connections, a ring
+	unsigned capacity;
+	unsigned head;
+	unsigned count;
+	bool stopping;
+	int *active; // the connection of every worker, or -1
+};
+
+struct worker
+{
+	struct server *server;
+	unsigned index;
+	pthread_t thread;
+	struct arena *arena;
+	unsigned char *input; // kept between the requests
+	size_t capacity;
+
+	// the connection, read through a buffer
+	int fd;
+	char buffer[SERVE_MAX_LINE];
+	size_t start;
+	size_t end;
+};
+
+struct request
+{
+	const char *input;   // a path, or NULL for an inline input
+	size_t input_size;
+	const char *output;  // a path, or NULL to send the output
+	int input_pic;       // -1 until it is known
+	int output_pic;
+	struct options opt;
+};
+
+static volatile sig_atomic_t stop_signal = 0;
+
+static void on_signal(int signal)
+{
+	(void)signal;
+	stop_signal = 1;
+}
+
+// 0 with the next line, nonzero at the end of the connection or if the line is too long
+static int read_line(struct worker *w, char **line)
+{
+	while (1) {
+		char *newline = memchr(w->buffer + w->start, '\n', w->end - w->start);
+		if (newline != NULL) {
+			*newline = '\0';
+			*line = w->buffer + w->start;
+			w->start = newline + 1 - w->buffer;
+			return 0;
+		}
+		if (w->start > 0) {
+			memmove(w->buffer, w->buffer + w->start, w->end - w->start);
+			w->end -= w->start;
+			w->start = 0;
+		}
+		if (w->end == sizeof(w->buffer))
+			return 1;
+
+		ssize_t count = recv(w->fd, w->buffer + w->end, sizeof(w->buffer) - w->end, 0);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return 1;
+		w->end += count;
+	}
+}
+
+// the rest of the buffer first, then straight from the connection
+static int read_bytes(struct worker *w, unsigned char *data, size_t size)
+{
+	size_t buffered = w->end - w->start;
+	if (buffered > size)
+		buffered = size;
+	memcpy(data, w->buffer + w->start, buffered);
+	w->start += buffered;
+
+	for (size_t done = buffered; done < size;) {
+		ssize_t count = recv(w->fd, data + done, size - done, 0);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return 1;
+		done += count;
+	}
+	return 0;
+}
+
+static int send_all(int fd, const void *data, size_t size)
+{
+	for (size_t done = 0; done < size;) {
+		ssize_t count = send(fd, (const char *)data + done, size - done, MSG_NOSIGNAL);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return 1;
+		done += count;
+	}
+	return 0;
+}
+
+static int reply_error(int fd, const char *reason)
+{
+	char line[128];
+	int length = snprintf(line, sizeof(line), "error %s\n", reason);
+	return send_all(fd, line, length);
+}
+
+static int parse_type(const char *value, int *is_pic)
+{
+	if (strcmp(value, "bmp") == 0)
+		*is_pic = true;
+	else if (strcmp(value, "raw") == 0)
+		*is_pic = false;
+	else
+		return 1;
+	return 0;
+}
+
+static int parse_number(const char *value, unsigned long long max, unsigned long long *number)
+{
+	char *end = NULL;
+	errno = 0;
+	*number = strtoull(value, &end, 10);
+	return (value[0] < '0' || value[0] > '9' || *end != '\0' || errno != 0 || *number > max);
+}
+
+static int parse_request(char *line, struct request *req)
+{
+	bool has_size = false;
+	char *save = NULL;
+	for (char *field = strtok_r(line, " ", &save); field != NULL; field = strtok_r(NULL, " ", &save)) {
+		char *value = strchr(field, '=');
+		if (value == NULL)
+			return 1;
+		*value++ = '\0';
+
+		unsigned long long number = 0;
+		int rc = 0;
+		if (strcmp(field, "input") == 0) {
+			req->input = value;
+		} else if (strcmp(field, "input-size") == 0) {
+			rc = parse_number(value, SIZE_MAX, &number);
+			req->input_size = number;
+			has_size = true;
+		} else if (strcmp(field, "output") == 0) {
+			req->output = value;
+		} else if (strcmp(field, "input-type") == 0) {
+			rc = parse_type(value, &(req->input_pic));
+		} else if (strcmp(field, "output-type") == 0) {
+			rc = parse_type(value, &(req->output_pic));
+		} else if (strcmp(field, "width") == 0) {
+			rc = parse_number(value, UDWORD_MAX, &number);
+			req->opt.width = number;
+		} else if (strcmp(field, "in-format") == 0) {
+			req->opt.in_format = format_find(value);
+			rc = (req->opt.in_format == NULL);
+		} else if (strcmp(field, "out-format") == 0) {
+			req->opt.out_format = format_find(value);
+			rc = (req->opt.out_format == NULL);
+		} else if (strcmp(field, "top-down") == 0) {
+			rc = parse_number(value, 1, &number);
+			req->opt.top_down = number;
+		} else {
+			rc = 1;
+		}
+		if (rc)
+			return 1;
+	}
+	// exactly one input
+	if ((req->input != NULL) == has_size)
+		return 1;
+
+	if (req->input_pic < 0)
+		req->input_pic = (req->input != NULL && is_pic((char *)req->input));
+	if (req->output_pic < 0)
+		req->output_pic = (req->output != NULL && is_pic((char *)req->output));
+	return 0;
+}
+
+// nonzero if the connection can't go on
+static int handle(struct worker *w, char *line)
+{
+	struct request req = {NULL, 0, NULL, -1, -1, *(w->server->opt)};
+	FILE *infile = NULL;
+	FILE *outfile = NULL;
+	char *data = NULL;
+	size_t size = 0;
+	int rc = 0;
+
+	// the length of an inline input is unknown, so the connection is closed
+	if (parse_request(line, &req)) {
+		reply_error(w->fd, "bad request");
+		return 1;
+	}
+	if (req.input == NULL && req.input_size > SERVE_MAX_INPUT) {
+		reply_error(w->fd, "input too large");
+		return 1;
+	}
+
+	if (req.input == NULL) {
+		if (req.input_size > w->capacity) {
+			free(w->input);
+			w->capacity = req.input_size;
+			w->input = malloc(w->capacity);
+			if (w->input == NULL)
+				abort();
+		}
+		if (read_bytes(w, w->input, req.input_size))
+			return 1;
+		if (req.input_size == 0)
+			return reply_error(w->fd, "empty input");
+		infile = fmemopen(w->input, req.input_size, "r");
+	} else {
+		infile = fopen(req.input, "r");
+	}
+	if (infile == NULL)
+		return reply_error(w->fd, "cannot open the input");
+
+	if (req.output != NULL)
+		outfile = fopen(req.output, "wx");
+	else
+		outfile = open_memstream(&data, &size);
+	if (outfile == NULL) {
+		fclose(infile);
+		return reply_error(w->fd, "cannot open the output");
+	}
+
+	int job_rc = convert(&(req.opt), infile, req.input_pic, outfile, req.output_pic, w->arena);
+	arena_reset(w->arena);
+	fclose(infile);
+	if (fclose(outfile) != 0)
+		job_rc = 1;
+
+	if (job_rc) {
+		if (req.output != NULL)
+			unlink(req.output);
+		rc = reply_error(w->fd, "conversion failed");
+	} else {
+		char header[64];
+		size_t length = snprintf(header, sizeof(header), "ok %zu\n", size);
+		rc = send_all(w->fd, header, length);
+		if (rc == 0)
+			rc = send_all(w->fd, data, size);
+	}
+	free(data);
+	return rc;
+}
+
+// -1 once the server stops
+static int queue_pop(struct server *s, unsigned index)
+{
+	pthread_mutex_lock(&(s->lock));
+	while (s->count == 0 && !s->stopping)
+		pthread_cond_wait(&(s->not_empty), &(s->lock));
+
+	int fd = -1;
+	if (!s->stopping) {
+		fd = s->queue[s->head];
+		s->head = (s->head + 1) % s->capacity;
+		s->count--;
+		s->active[index] = fd;
+		pthread_cond_signal(&(s->not_full));
+	}
+	pthread_mutex_unlock(&(s->lock));
+	return fd;
+}
+
+// wait while the queue is full, false once the server stops
+static bool queue_push(struct server *s, int fd)
+{
+	pthread_mutex_lock(&(s->lock));
+	while (s->count == s->capacity && !stop_signal) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 100 * 1000 * 1000;
+		if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000 * 1000 * 1000;
+		}
+		pthread_cond_timedwait(&(s->not_full), &(s->lock), &deadline);
+	}
+
+	bool pushed = !stop_signal;
+	if (pushed) {
+		s->queue[(s->head + s->count) % s->capacity] = fd;
+		s->count++;
+		pthread_cond_signal(&(s->not_empty));
+	}
+	pthread_mutex_unlock(&(s->lock));
+	return pushed;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct server *s = w->server;
+
+	while ((w->fd = queue_pop(s, w->index)) >= 0) {
+		w->start = 0;
+		w->end = 0;
+		char *line = NULL;
+		while (read_line(w, &line) == 0 && handle(w, line) == 0)
+			;
+
+		pthread_mutex_lock(&(s->lock));
+		s->active[w->index] = -1;
+		close(w->fd);
+		pthread_mutex_unlock(&(s->lock));
+	}
+	return NULL;
+}
+
+static int open_socket(const char *path, unsigned backlog, int *listener)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		print_error();
+		fprintf(stderr, "The socket path is too long.\n");
+		return 1;
+	}
+	strcpy(address.sun_path, path);
+
+	if (access(path, F_OK) == 0) {
+		printf("File '%s' already exists.\n", path);
+		return 1;
+	}
+
+	*listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (*listener < 0) {
+		print_error();
+		fprintf(stderr, "Cannot create the socket.\n");
+		return 1;
+	}
+
+	// only the owner may connect
+	mode_t mask = umask(0077);
+	int rc = bind(*listener, (struct sockaddr *)&address, sizeof(address));
+	umask(mask);
+	if (rc == 0)
+		rc = listen(*listener, backlog);
+	if (rc) {
+		print_error();
+		fprintf(stderr, "Cannot listen on '%s'.\n", path);
+		close(*listener);
+		*listener = -1;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Serve until SIGINT or SIGTERM. The connections in progress are shut
+ * down, the queued ones are closed. 0 workers is one per CPU.
+ */
+int serve_run(const struct options *opt, const char *path, unsigned workers, unsigned queue)
+{
+	assert(opt != NULL);
+	assert(path != NULL);
+	assert(queue != 0);
+
+	if (workers == 0)
+		workers = jobs_threads();
+
+	int listener = -1;
+	int rc = open_socket(path, queue, &listener);
+	if (rc)
+		return rc;
+
+	struct server s = {
+		.opt = opt,
+		.capacity = queue,
+		.head = 0,
+		.count = 0,
+		.stopping = false
+	};
+	s.queue = malloc(sizeof(int) * queue);
+	s.active = malloc(sizeof(int) * workers);
+	struct worker *pool = calloc(workers, sizeof(struct worker));
+	if (s.queue == NULL || s.active == NULL || pool == NULL)
+		abort();
+	if (pthread_mutex_init(&(s.lock), NULL) != 0
+	    || pthread_cond_init(&(s.not_empty), NULL) != 0
+	    || pthread_cond_init(&(s.not_full), NULL) != 0)
+		abort();
+
+	// the signals interrupt the main thread only
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_signal;
+	sigemptyset(&(action.sa_mask));
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	sigset_t signals;
+	sigset_t old_signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+	unsigned started = 0;
+	for (; started < workers; started++) {
+		struct worker *w = &(pool[started]);
+		w->server = &s;
+		w->index = started;
+		s.active[started] = -1;
+		arena_new(&(w->arena), 0);
+		if (pthread_create(&(w->thread), NULL, worker_main, w) != 0) {
+			arena_free(w->arena);
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (started == 0) {
+		print_error();
+		fprintf(stderr, "Cannot start the workers.\n");
+		rc = 1;
+	}
+
+	while (rc == 0 && !stop_signal) {
+		struct pollfd ready = {listener, POLLIN, 0};
+		if (poll(&ready, 1, 250) <= 0)
+			continue;
+
+		int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0 && (errno == EINTR || errno == ECONNABORTED))
+			continue;
+		if (fd < 0) {
+			print_error();
+			fprintf(stderr, "Cannot accept a connection.\n");
+			rc = 1;
+			break;
+		}
+		if (!queue_push(&s, fd))
+			close(fd);
+	}
+
+	pthread_mutex_lock(&(s.lock));
+	s.stopping = true;
+	for (; s.count > 0; s.count--) {
+		close(s.queue[s.head]);
+		s.head = (s.head + 1) % s.capacity;
+	}
+	for (unsigned i = 0; i < started; i++) {
+		if (s.active[i] >= 0)
+			shutdown(s.active[i], SHUT_RDWR);
+	}
+	pthread_cond_broadcast(&(s.not_empty));
+	pthread_mutex_unlock(&(s.lock));
+
+	for (unsigned i = 0; i < started; i++) {
+		pthread_join(pool[i].thread, NULL);
+		arena_free(pool[i].arena);
+		free(pool[i].input);
+	}
+
+	close(listener);
+	unlink(path);
+	pthread_cond_destroy(&(s.not_full));
+	pthread_cond_destroy(&(s.not_empty));
+	pthread_mutex_destroy(&(s.lock));
+	free(pool);
+	free(s.active);
+	free(s.queue);
+	return rc;
+}
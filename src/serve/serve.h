@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_SERVE_H
+#define PIXMAP565_SERVE_H
+
+#include "convert.h"
+
+/*
+ * serve:
+ *
+ * Convert on request, on a UNIX domain socket. A pool of workers, each
+ * with its own arena and input buffer, serves one connection at a time.
+ * The accepted connections wait in a queue, when it is full no more are
+ * accepted until a worker is free, so the clients wait in connect().
+ *
+ * A connection carries any number of requests, each one a line of
+ * space-separated key=value fields:
+ *
+ * input=<path>         the input file, or
+ * input-size=<bytes>   the input follows the line
+ * output=<path>        write the output to a new file, instead of sending it
+ * input-type=bmp|raw   by default the type of the path, else raw
+ * output-type=bmp|raw  the same
+ * width=<pixels>       of a raw input
+ * in-format=<format>, out-format=<format>, top-down=0|1
+ *
+ * The other options are those of the server. Every request is answered
+ * with "ok <bytes>\n" and the output, or "error <reason>\n".
+ */
+
+#define SERVE_QUEUE 64u
+#define SERVE_MAX_LINE 4096u
+#define SERVE_MAX_INPUT (256u << 20)
+
+int serve_run(const struct options *opt, const char *path, unsigned workers, unsigned queue);
+
+#endif /* PIXMAP565_SERVE_H */
@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file_utils.h"
+#include "jobs.h"
+#include "picture.h"
+#include "pixmap.h"
+#include "slicer.h"
+
+static void cells_add(struct region **cells, size_t *count, size_t *size, struct region cell)
+{
+	if (*count == *size) {
+		*size = 2 * *size + 8;
+		*cells = realloc(*cells, sizeof(struct region) * *size);
+		if (*cells == NULL)
+			abort();
+	}
+	(*cells)[*count] = cell;
+	*count += 1;
+}
+
+int slicer_grid(udword_t width, udword_t height, const struct grid *spec, struct region **cells, size_t *count)
+{
+	assert(spec != NULL);
+	assert(cells != NULL);
+	assert(count != NULL);
+	int rc = 0;
+	size_t size = 0;
+
+	*cells = NULL;
+	*count = 0;
+
+	if (spec->cell_width == 0 || spec->cell_height == 0) {
+		print_error();
+		fprintf(stderr, "The grid cells must not be empty.\n");
+		rc = 1;
+		goto out;
+	}
+
+	// 64 bit arithmetic, so that cell + spacing can't overflow
+	for (unsigned long long y = spec->margin; y + spec->cell_height <= height; y += spec->cell_height + spec->spacing) {
+		for (unsigned long long x = spec->margin; x + spec->cell_width <= width; x += spec->cell_width + spec->spacing) {
+			struct region cell = {x, y, spec->cell_width, spec->cell_height};
+			cells_add(cells, count, &size, cell);
+		}
+	}
+	if (*count == 0) {
+		print_error();
+		fprintf(stderr, "No grid cell fits in the %llux%llu image.\n",
+			(unsigned long long)width, (unsigned long long)height);
+		rc = 1;
+	}
+out:
+	return rc;
+}
+
+/*
+ * One rectangle per line: x,y,w,h (commas or whitespace).
+ * Empty lines and lines starting with '#' are ignored.
+ */
+int slicer_read_rects(FILE *fp, struct region **cells, size_t *count)
+{
+	assert(fp != NULL);
+	assert(cells != NULL);
+	assert(count != NULL);
+	int rc = 0;
+	size_t size = 0;
+	char line[256];
+	unsigned long lineno = 0;
+
+	*cells = NULL;
+	*count = 0;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		for (char *ch = line; *ch != '\0'; ch++) {
+			if (*ch == ',')
+				*ch = ' ';
+		}
+		char first = '\0';
+		if (sscanf(line, " %c", &first) != 1 || first == '#')
+			continue;
+
+		unsigned long long value[4];
+		char trailing = '\0';
+		int found = sscanf(line, "%llu %llu %llu %llu %c", &value[0], &value[1], &value[2], &value[3], &trailing);
+		if (found != 4
+		    || value[0] > UDWORD_MAX || value[1] > UDWORD_MAX
+		    || value[2] > UDWORD_MAX || value[3] > UDWORD_MAX) {
+			print_error();
+			fprintf(stderr, "Invalid rectangle on line %lu, expected: x,y,w,h\n", lineno);
+			rc = 1;
+			goto out;
+		}
+		struct region cell = {value[0], value[1], value[2], value[3]};
+		cells_add(cells, count, &size, cell);
+	}
+	if (ferror(fp)) {
+		print_error();
+		fprintf(stderr, "Unexpected end of file, caused by I/O error.\n");
+		rc = 1;
+	}
+out:
+	return rc;
+}
+
+// <stem>_<index><extension>, the caller must free() the name
+static char *cell_name(const char *outname, size_t index)
+{
+	const char *slash = strrchr(outname, '/');
+	const char *dot = strrchr(outname, '.');
+	if (dot == NULL || (slash != NULL && dot < slash) || dot == outname || dot[-1] == '/')
+		dot = outname + strlen(outname);
+
+	int size = snprintf(NULL, 0, "%.*s_%zu%s", (int)(dot - outname), outname, index, dot);
+	char *name = malloc(size + 1);
+	if (name == NULL)
+		abort();
+
+	snprintf(name, size + 1, "%.*s_%zu%s", (int)(dot - outname), outname, index, dot);
+	return name;
+}
+
+struct slice_ctx
+{
+	uint16_t **rows;
+	udword_t width;
+	udword_t height;
+	const struct region *cells;
+	const char *outname;
+	bool top_down;
+	const struct pixel_format *format;
+	udword_t alignment; // of the rows of the pixmap cells
+};
+
+static int slice_one(void *arg, size_t index)
+{
+	struct slice_ctx *ctx = arg;
+	const struct region *cell = &(ctx->cells[index]);
+	int rc = 0;
+
+	struct pixmap *pix = NULL;
+	struct picture *pic = NULL;
+	FILE *outfile = NULL;
+	char *name = cell_name(ctx->outname, index);
+
+	if (cell->width == 0 || cell->height == 0
+	    || cell->x > ctx->width || cell->width > ctx->width - cell->x
+	    || cell->y > ctx->height || cell->height > ctx->height - cell->y) {
+		print_error();
+		fprintf(stderr, "Cell %zu is outside of the %llux%llu image.\n", index,
+			(unsigned long long)ctx->width, (unsigned long long)ctx->height);
+		rc = 1;
+		goto out;
+	}
+
+	pixmap_new(&pix, cell->width, NULL);
+	for (udword_t y = 0; y < cell->height; y++)
+		pixmap_add_row(pix, ctx->rows[cell->y + y] + cell->x);
+
+	if (access(name, F_OK) == 0) {
+		printf("File '%s' already exists.\n", name);
+		rc = 1;
+		goto out;
+	}
+	outfile = fopen(name, "w+");
+	if (outfile == NULL) {
+		printf("Cannot open file '%s'\n", name);
+		rc = 1;
+		goto out;
+	}
+
+	if (is_pic(name)) {
+		picture_new(&pic, NULL);
+		picture_set_top_down(pic, ctx->top_down);
+		picture_set_format(pic, ctx->format);
+		picture_set_pixmap(pic, pix);
+		pix = NULL;
+		rc = picture_write(pic, outfile);
+	} else {
+		rc = pixmap_write(pix, outfile, ctx->alignment);
+	}
+
+out:
+	picture_free(pic);
+	pixmap_free(pix);
+	if (outfile != NULL)
+		fclose(outfile);
+
+	free(name);
+	return rc;
+}
+
+int slicer_write(struct pixmap *sheet, const struct region *cells, size_t count, const char *outname, bool top_down,
+	const struct pixel_format *format, udword_t alignment)
+{
+	assert(sheet != NULL);
+	assert(outname != NULL);
+
+	struct slice_ctx ctx = {
+		.rows = pixmap_get_rows(sheet),
+		.width = pixmap_get_x(sheet),
+		.height = pixmap_get_y(sheet),
+		.cells = cells,
+		.outname = outname,
+		.top_down = top_down,
+		.format = format,
+		.alignment = alignment
+	};
+	int rc = jobs_run(count, 0, slice_one, &ctx);
+
+	free(ctx.rows);
+	return rc;
+}
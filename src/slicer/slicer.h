@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_SLICER_H
+#define PIXMAP565_SLICER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "file_utils.h"
+#include "pixmap.h"
+
+struct pixel_format;
+
+/*
+ * slicer:
+ *
+ * Split a sprite sheet into cells. The sheet is read once, and the cells
+ * are written in parallel to <outfile stem>_<index><outfile extension>.
+ */
+
+struct grid
+{
+	udword_t cell_width;
+	udword_t cell_height;
+	udword_t margin;  // space before the first row and column
+	udword_t spacing; // space between the cells
+};
+
+int slicer_grid(udword_t width, udword_t height, const struct grid *spec, struct region **cells, size_t *count);
+int slicer_read_rects(FILE *fp, struct region **cells, size_t *count);
+int slicer_write(struct pixmap *sheet, const struct region *cells, size_t count, const char *outname, bool top_down,
+	const struct pixel_format *format, udword_t alignment);
+
+#endif /* PIXMAP565_SLICER_H */
@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "file_utils.h"
+#include "format.h"
+#include "picture.h"
+#include "stream.h"
+
+struct rows
+{
+	int fd;
+	off_t offset;    // of the first row in the input
+	udword_t width;  // pixels per row
+	udword_t height;
+	size_t stride;   // bytes per row, padding included
+	bool reverse;    // emit the input rows last to first
+	bool mirrored;   // the input pixels are stored right to left
+	const struct pixel_format *from; // the input pixel layout
+	const struct pixel_format *to;   // the output pixel layout
+	off_t end;       // input bytes past the end are read as zero padding
+};
+
+static void mirror(unsigned char *row, udword_t width)
+{
+	for (udword_t i = 0; i < width / 2; i++) {
+		unsigned char *left = row + i * BYTES_PER_PIXEL;
+		unsigned char *right = row + (width - 1 - i) * BYTES_PER_PIXEL;
+		for (size_t j = 0; j < BYTES_PER_PIXEL; j++) {
+			unsigned char tmp = left[j];
+			left[j] = right[j];
+			right[j] = tmp;
+		}
+	}
+}
+
+/*
+ * Fill the buffer with as many rows as fit, read them with one pread() and
+ * write them out top to bottom, with padding to out_stride. Then pad the
+ * output to a multiple of buffer_align.
+ */
+static int stream_rows(struct rows *in, FILE *outfile, size_t out_stride, udword_t buffer_align, size_t max_memory)
+{
+	int rc = 0;
+	size_t row_bytes = (size_t)in->width * BYTES_PER_PIXEL;
+	size_t capacity = max_memory / in->stride;
+	if (capacity == 0) {
+		print_error();
+		fprintf(stderr, "The memory budget must hold at least one row (%zu bytes).\n", in->stride);
+		return 1;
+	}
+	if (capacity > in->height)
+		capacity = in->height;
+
+	unsigned char *buffer = malloc(capacity * in->stride);
+	if (buffer == NULL)
+		abort();
+
+	static const unsigned char zero[PIXMAP_MAX_ALIGNMENT] = {0};
+	for (udword_t done = 0; done < in->height && rc == 0;) {
+		udword_t count = capacity;
+		if (count > in->height - done)
+			count = in->height - done;
+
+		// rows [done, done + count) from the top
+		udword_t first = done;
+		if (in->reverse)
+			first = in->height - done - count;
+
+		off_t start = in->offset + (off_t)first * in->stride;
+		size_t size = count * in->stride;
+		size_t missing = 0;
+		if (start + (off_t)size > in->end)
+			missing = start + size - in->end;
+
+		memset(buffer + size - missing, 0, missing);
+		rc = pread_all(in->fd, buffer, size - missing, start);
+		for (udword_t i = 0; i < count && rc == 0; i++) {
+			unsigned char *row = buffer + (size_t)i * in->stride;
+			if (in->reverse)
+				row = buffer + (size_t)(count - 1 - i) * in->stride;
+
+			if (in->mirrored)
+				mirror(row, in->width);
+
+			format_convert_bytes(in->from, in->to, row, in->width);
+
+			rc = (fwrite(row, 1, row_bytes, outfile) != row_bytes);
+			if (rc == 0 && out_stride > row_bytes)
+				rc = (fwrite(zero, 1, out_stride - row_bytes, outfile) != out_stride - row_bytes);
+			if (rc) {
+				print_error();
+				fprintf(stderr, "Cannot write the output file.\n");
+			}
+		}
+		done += count;
+	}
+
+	size_t missing = (buffer_align - (size_t)in->height * out_stride % buffer_align) % buffer_align;
+	while (rc == 0 && missing > 0) {
+		size_t n = (missing < sizeof(zero)) ? missing : sizeof(zero);
+		rc = (fwrite(zero, 1, n, outfile) != n);
+		if (rc) {
+			print_error();
+			fprintf(stderr, "Cannot write the output file.\n");
+		}
+		missing -= n;
+	}
+
+	free(buffer);
+	return rc;
+}
+
+int stream_picture_to_pixmap(FILE *infile, FILE *outfile, const struct pixel_format *out_format,
+	udword_t out_align, udword_t buffer_align, size_t max_memory)
+{
+	assert(infile != NULL);
+	assert(outfile != NULL);
+
+	struct picture *pic = NULL;
+	picture_new(&pic, NULL);
+
+	int rc = picture_read_header(pic, infile);
+	if (rc)
+		goto out;
+
+	struct rows in = {
+		.fd = fileno(infile),
+		.offset = picture_get_pixel_array_offset(pic),
+		.width = dword_abs(picture_get_width(pic)),
+		.height = dword_abs(picture_get_height(pic)),
+		.reverse = (picture_get_height(pic) > 0),
+		.mirrored = (picture_get_width(pic) < 0),
+		.from = picture_get_format(pic),
+		.to = out_format
+	};
+	in.stride = pixmap_stride(in.width, PIXMAP_ALIGNMENT);
+	in.end = in.offset + (off_t)in.height * in.stride;
+
+	rc = stream_rows(&in, outfile, pixmap_stride(in.width, out_align), buffer_align, max_memory);
+out:
+	picture_free(pic);
+	return rc;
+}
+
+int stream_pixmap_to_picture(FILE *infile, FILE *outfile, udword_t width, udword_t in_align, bool top_down,
+	const struct pixel_format *in_format, const struct pixel_format *out_format, size_t max_memory)
+{
+	assert(infile != NULL);
+	assert(outfile != NULL);
+	int rc = 0;
+
+	struct picture *pic = NULL;
+	picture_new(&pic, NULL);
+
+	struct stat st;
+	if (fstat(fileno(infile), &st) != 0 || !S_ISREG(st.st_mode)) {
+		print_error();
+		fprintf(stderr, "The input file must be a regular file.\n");
+		rc = 1;
+		goto out;
+	}
+
+	// like pixmap_read(), the padding of the last row may be missing
+	size_t row_bytes = (size_t)width * BYTES_PER_PIXEL;
+	size_t stride = pixmap_stride(width, in_align);
+	off_t height = 0;
+	off_t remainder = 0;
+	if (stride != 0) {
+		height = st.st_size / (off_t)stride;
+		remainder = st.st_size % (off_t)stride;
+	}
+	if (remainder != 0 && remainder >= (off_t)row_bytes) {
+		height += 1;
+	} else if (remainder != 0) {
+		print_error();
+		fprintf(stderr, "Unexpected end of file.\n");
+		rc = 1;
+		goto out;
+	}
+	if (width == 0 || width > INT32_MAX || height == 0 || height > INT32_MAX) {
+		print_error();
+		fprintf(stderr, "Unsupported pixmap dimensions.\n");
+		rc = 1;
+		goto out;
+	}
+
+	picture_set_top_down(pic, top_down);
+	picture_set_format(pic, out_format);
+	picture_set_size(pic, width, height);
+	rc = picture_write_header(pic, outfile);
+	if (rc)
+		goto out;
+
+	struct rows in = {
+		.fd = fileno(infile),
+		.offset = 0,
+		.width = width,
+		.height = height,
+		.stride = stride,
+		.reverse = !top_down,
+		.mirrored = false,
+		.from = in_format,
+		.to = out_format,
+		.end = st.st_size
+	};
+	rc = stream_rows(&in, outfile, pixmap_stride(width, PIXMAP_ALIGNMENT), 1, max_memory);
+out:
+	picture_free(pic);
+	return rc;
+}
@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_STREAM_H
+#define PIXMAP565_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "file_utils.h"
+
+struct pixel_format;
+
+/*
+ * stream:
+ *
+ * Convert without building a pixmap. The rows go through a buffer of at
+ * most max_memory bytes, so the memory use doesn't depend on the image
+ * dimensions. Bottom-up pictures are handled by reading the input rows
+ * back to front with pread(), so the input must be a regular file.
+ */
+
+int stream_picture_to_pixmap(FILE *infile, FILE *outfile, const struct pixel_format *out_format,
+	udword_t out_align, udword_t buffer_align, size_t max_memory);
+int stream_pixmap_to_picture(FILE *infile, FILE *outfile, udword_t width, udword_t in_align, bool top_down,
+	const struct pixel_format *in_format, const struct pixel_format *out_format, size_t max_memory);
+
+#endif /* PIXMAP565_STREAM_H */
@@ -0,0 +1,542 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "convert.h"
+#include "file_utils.h"
+#include "jobs.h"
+#include "picture.h"
+#include "tar.h"
+
+// the entries in flight, per worker
+#define DEPTH 2
+
+// the name and the prefix, joined by a '/'
+#define NAME_MAX_SIZE 256
+
+// the largest size of an entry, 11 octal digits
+#define SIZE_MAX_DIGITS 11
+
+struct header
+{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char padding[12];
+};
+
+enum slot_state
+{
+	slot_free,
+	slot_queued, // waits for a worker
+	slot_busy,
+	slot_done    // waits for the writer
+};
+
+struct slot
+{
+	enum slot_state state;
+	struct header header; // of the output
+	char inname[NAME_MAX_SIZE + 1];
+	char outname[NAME_MAX_SIZE + 1];
+	unsigned char *input;
+	size_t input_size;
+	char *output;
+	size_t output_size;
+	int rc;
+};
+
+struct archive
+{
+	const struct options *opt;
+	bool out_pic;
+	FILE *out;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct slot *slots; // a ring
+	size_t capacity;
+	size_t read;     // the entries read
+	size_t taken;    // the entries taken by the workers
+	size_t written;  // the entries written or dropped
+	bool done;       // no more entries are read
+	bool failed;     // the output cannot be written
+	int rc;          // of the writer
+};
+
+struct worker
+{
+	struct archive *archive;
+	pthread_t thread;
+	struct arena *arena;
+};
+
+static const char ustar_magic[6] = "ustar";
+static const char ustar_version[2] = "00";
+// the GNU format has no prefix, its fields are elsewhere
+static const char gnu_magic[8] = "ustar  ";
+
+// a number of octal digits, padded with spaces or NUL
+static int parse_octal(const char *field, size_t size, uint64_t *value)
+{
+	size_t i = 0;
+	while (i < size && field[i] == ' ')
+		i++;
+
+	uint64_t number = 0;
+	size_t digits = 0;
+	for (; i < size && field[i] >= '0' && field[i] <= '7'; i++, digits++) {
+		if (digits == SIZE_MAX_DIGITS)
+			return 1;
+		number = 8 * number + (field[i] - '0');
+	}
+	for (; i < size; i++) {
+		if (field[i] != ' ' && field[i] != '\0')
+			return 1;
+	}
+	*value = number;
+	return 0;
+}
+
+static void put_octal(char *field, size_t size, uint64_t value)
+{
+	char digits[16];
+	assert(size <= sizeof(digits));
+	snprintf(digits, sizeof(digits), "%0*llo", (int)(size - 1), (unsigned long long)value);
+	memcpy(field, digits, size);
+}
+
+// the sum of the bytes, with the checksum field as spaces
+static unsigned header_checksum(const struct header *h)
+{
+	const unsigned char *bytes = (const unsigned char *)h;
+	unsigned sum = 0;
+	for (size_t i = 0; i < TAR_BLOCK; i++)
+		sum += bytes[i];
+	for (size_t i = 0; i < sizeof(h->checksum); i++)
+		sum += ' ' - (unsigned char)h->checksum[i];
+	return sum;
+}
+
+static void seal_header(struct header *h)
+{
+	memcpy(h->magic, ustar_magic, sizeof(h->magic));
+	memcpy(h->version, ustar_version, sizeof(h->version));
+	memset(h->checksum, ' ', sizeof(h->checksum));
+	// six digits, a NUL and a space
+	put_octal(h->checksum, 7, header_checksum(h));
+}
+
+static bool is_zero(const struct header *h)
+{
+	const unsigned char *bytes = (const unsigned char *)h;
+	for (size_t i = 0; i < TAR_BLOCK; i++) {
+		if (bytes[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+static void get_name(const struct header *h, char name[NAME_MAX_SIZE + 1])
+{
+	size_t length = 0;
+	if (memcmp(h->magic, gnu_magic, sizeof(gnu_magic)) != 0) {
+		length = strnlen(h->prefix, sizeof(h->prefix));
+		memcpy(name, h->prefix, length);
+		if (length > 0)
+			name[length++] = '/';
+	}
+	size_t rest = strnlen(h->name, sizeof(h->name));
+	memcpy(name + length, h->name, rest);
+	name[length + rest] = '\0';
+}
+
+// split the name at a '/' if it is too long for the name field
+static int set_name(struct header *h, const char *name)
+{
+	size_t length = strlen(name);
+	memset(h->name, 0, sizeof(h->name));
+	memset(h->prefix, 0, sizeof(h->prefix));
+	if (length <= sizeof(h->name)) {
+		memcpy(h->name, name, length);
+		return 0;
+	}
+
+	for (size_t split = length - 1; split > 0; split--) {
+		if (name[split] != '/')
+			continue;
+		if (length - split - 1 > sizeof(h->name))
+			break;
+		if (split <= sizeof(h->prefix) && split + 1 < length) {
+			memcpy(h->prefix, name, split);
+			memcpy(h->name, name + split + 1, length - split - 1);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// name with PICTURE_EXTENSION appended, or removed
+static int rename_output(char *name, bool out_pic, char renamed[NAME_MAX_SIZE + 1])
+{
+	size_t length = strlen(name);
+	if (is_pic(name) && !out_pic)
+		length -= strlen(PICTURE_EXTENSION);
+	if (!is_pic(name) && out_pic && length + strlen(PICTURE_EXTENSION) > NAME_MAX_SIZE)
+		return 1;
+
+	memcpy(renamed, name, length);
+	renamed[length] = '\0';
+	if (!is_pic(name) && out_pic)
+		strcat(renamed, PICTURE_EXTENSION);
+	return 0;
+}
+
+static int unexpected_end(FILE *in)
+{
+	print_error();
+	if (ferror(in))
+		fprintf(stderr, "Unexpected end of file, caused by I/O error.\n");
+	else
+		fprintf(stderr, "Unexpected end of file.\n");
+	return 1;
+}
+
+/*
+ * Read the next entry into the slot, up to the end of its last block. The
+ * end of the archive is a block of zeros, or the end of the file.
+ */
+static int read_entry(FILE *in, bool out_pic, struct slot *slot, bool *end)
+{
+	struct header *h = &(slot->header);
+	size_t length = fread(h, 1, TAR_BLOCK, in);
+	*end = false;
+	if (length == 0 && !ferror(in)) {
+		*end = true;
+		return 0;
+	}
+	if (length != TAR_BLOCK)
+		return unexpected_end(in);
+	if (is_zero(h)) {
+		*end = true;
+		return 0;
+	}
+
+	uint64_t checksum = 0;
+	uint64_t size = 0;
+	if (parse_octal(h->checksum, sizeof(h->checksum), &checksum) || checksum != header_checksum(h)
+	    || memcmp(h->magic, ustar_magic, sizeof(ustar_magic) - 1) != 0
+	    || parse_octal(h->size, sizeof(h->size), &size)) {
+		print_error();
+		fprintf(stderr, "The input is not a ustar archive.\n");
+		return 1;
+	}
+	get_name(h, slot->inname);
+
+	bool regular = (h->typeflag == '0' || h->typeflag == '\0' || h->typeflag == '7');
+	bool link = (h->typeflag == '1' || h->typeflag == '2');
+	if (!regular && !link && h->typeflag != '5') {
+		print_error();
+		fprintf(stderr, "'%s': Unsupported entry type '%c'.\n", slot->inname, h->typeflag);
+		return 1;
+	}
+	if (size > TAR_MAX_ENTRY) {
+		print_error();
+		fprintf(stderr, "'%s': The entry is larger than %u bytes.\n", slot->inname, TAR_MAX_ENTRY);
+		return 1;
+	}
+
+	slot->input = malloc(size + 1);
+	if (slot->input == NULL)
+		abort();
+	slot->input_size = size;
+	if (size > 0 && fread(slot->input, size, 1, in) != 1)
+		return unexpected_end(in);
+
+	unsigned char padding[TAR_BLOCK];
+	size_t rest = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+	if (rest > 0 && fread(padding, rest, 1, in) != 1)
+		return unexpected_end(in);
+
+	/*
+	 * The hard links to a renamed file are renamed like it, and point to
+	 * the renamed file. The other links are copied.
+	 */
+	bool renamed_link = false;
+	if (h->typeflag == '1') {
+		char target[NAME_MAX_SIZE + 1];
+		char renamed[NAME_MAX_SIZE + 1];
+		memcpy(target, h->linkname, sizeof(h->linkname));
+		target[sizeof(h->linkname)] = '\0';
+		if (rename_output(target, out_pic, renamed) == 0 && strcmp(target, renamed) != 0
+		    && strlen(renamed) <= sizeof(h->linkname)) {
+			strncpy(h->linkname, renamed, sizeof(h->linkname));
+			renamed_link = true;
+		}
+	}
+
+	strcpy(slot->outname, slot->inname);
+	slot->rc = (regular || renamed_link) ? rename_output(slot->inname, out_pic, slot->outname) : 0;
+	if (slot->rc == 0)
+		slot->rc = set_name(h, slot->outname);
+	if (slot->rc) {
+		print_error();
+		fprintf(stderr, "'%s': The name is too long for a ustar archive.\n", slot->outname);
+	}
+	if (slot->rc == 0 && !regular) {
+		put_octal(h->size, sizeof(h->size), 0);
+		seal_header(h);
+	}
+	slot->state = (regular && slot->rc == 0) ? slot_queued : slot_done;
+	return 0;
+}
+
+// convert the input of the slot into a new memory buffer
+static int convert_entry(const struct options *opt, bool out_pic, struct slot *slot, struct arena *arena)
+{
+	int rc = 0;
+	FILE *infile = NULL;
+	FILE *outfile = NULL;
+
+	if (slot->input_size == 0) {
+		print_error();
+		fprintf(stderr, "'%s': Unexpected end of file.\n", slot->inname);
+		rc = 1;
+		goto out;
+	}
+	infile = fmemopen(slot->input, slot->input_size, "r");
+	outfile = open_memstream(&(slot->output), &(slot->output_size));
+	if (infile == NULL || outfile == NULL)
+		abort();
+
+	rc = convert(opt, infile, is_pic(slot->inname), outfile, out_pic, arena);
+out:
+	arena_reset(arena);
+	if (infile != NULL)
+		fclose(infile);
+	if (outfile != NULL && fclose(outfile) != 0)
+		rc = 1;
+	if (rc == 0 && slot->output_size >> (3 * SIZE_MAX_DIGITS) != 0) {
+		print_error();
+		fprintf(stderr, "'%s': The output is too large for a ustar archive.\n", slot->outname);
+		rc = 1;
+	}
+
+	if (rc == 0) {
+		put_octal(slot->header.size, sizeof(slot->header.size), slot->output_size);
+		seal_header(&(slot->header));
+	}
+	return rc;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct archive *a = w->archive;
+
+	pthread_mutex_lock(&(a->lock));
+	while (1) {
+		while (a->taken == a->read && !a->done)
+			pthread_cond_wait(&(a->changed), &(a->lock));
+		if (a->taken == a->read)
+			break;
+
+		struct slot *slot = &(a->slots[a->taken % a->capacity]);
+		a->taken++;
+		// the copied entries are only passed, for the writer
+		if (slot->state != slot_queued) {
+			pthread_cond_broadcast(&(a->changed));
+			continue;
+		}
+		slot->state = slot_busy;
+		pthread_mutex_unlock(&(a->lock));
+
+		slot->rc = convert_entry(a->opt, a->out_pic, slot, w->arena);
+		free(slot->input);
+		slot->input = NULL;
+
+		pthread_mutex_lock(&(a->lock));
+		slot->state = slot_done;
+		pthread_cond_broadcast(&(a->changed));
+	}
+	pthread_mutex_unlock(&(a->lock));
+	return NULL;
+}
+
+static int write_entry(FILE *out, struct slot *slot)
+{
+	static const unsigned char zeros[TAR_BLOCK];
+	size_t rest = (TAR_BLOCK - slot->output_size % TAR_BLOCK) % TAR_BLOCK;
+
+	if (fwrite(&(slot->header), TAR_BLOCK, 1, out) != 1
+	    || (slot->output_size > 0 && fwrite(slot->output, slot->output_size, 1, out) != 1)
+	    || (rest > 0 && fwrite(zeros, rest, 1, out) != 1))
+		return 1;
+	return 0;
+}
+
+// write the outputs in the order of the inputs, the failed ones are dropped
+static void *writer_main(void *arg)
+{
+	struct archive *a = arg;
+	bool failed = false;
+
+	pthread_mutex_lock(&(a->lock));
+	while (1) {
+		// the workers are past the entry, so its slot isn't theirs to look at
+		struct slot *slot = &(a->slots[a->written % a->capacity]);
+		while (!(a->written < a->taken && slot->state == slot_done) && !(a->done && a->written == a->read))
+			pthread_cond_wait(&(a->changed), &(a->lock));
+		if (a->written == a->read)
+			break;
+		pthread_mutex_unlock(&(a->lock));
+
+		if (slot->rc) {
+			fprintf(stderr, "Cannot convert '%s' to '%s'\n", slot->inname, slot->outname);
+			a->rc = 1;
+		} else if (!failed && write_entry(a->out, slot)) {
+			print_error();
+			fprintf(stderr, "Cannot write the output archive.\n");
+			a->rc = 1;
+			failed = true;
+		}
+		free(slot->input);
+		free(slot->output);
+		slot->input = NULL;
+		slot->output = NULL;
+		slot->output_size = 0;
+
+		pthread_mutex_lock(&(a->lock));
+		slot->state = slot_free;
+		a->written++;
+		a->failed = failed;
+		pthread_cond_broadcast(&(a->changed));
+	}
+	pthread_mutex_unlock(&(a->lock));
+	return NULL;
+}
+
+int tar_run(const struct options *opt, FILE *in, FILE *out, bool out_pic, unsigned workers)
+{
+	assert(opt != NULL);
+	assert(in != NULL);
+	assert(out != NULL);
+	assert(sizeof(struct header) == TAR_BLOCK);
+
+	if (workers == 0)
+		workers = jobs_threads();
+
+	int rc = 0;
+	struct archive a = {
+		.opt = opt,
+		.out_pic = out_pic,
+		.out = out,
+		.capacity = DEPTH * workers,
+		.read = 0,
+		.taken = 0,
+		.written = 0,
+		.done = false,
+		.failed = false,
+		.rc = 0
+	};
+	a.slots = calloc(a.capacity, sizeof(struct slot));
+	struct worker *pool = calloc(workers, sizeof(struct worker));
+	if (a.slots == NULL || pool == NULL)
+		abort();
+	if (pthread_mutex_init(&(a.lock), NULL) != 0 || pthread_cond_init(&(a.changed), NULL) != 0)
+		abort();
+
+	unsigned started = 0;
+	for (; started < workers; started++) {
+		struct worker *w = &(pool[started]);
+		w->archive = &a;
+		arena_new(&(w->arena), 0);
+		if (pthread_create(&(w->thread), NULL, worker_main, w) != 0) {
+			arena_free(w->arena);
+			break;
+		}
+	}
+	pthread_t writer;
+	bool writing = (started > 0 && pthread_create(&writer, NULL, writer_main, &a) == 0);
+	if (!writing) {
+		print_error();
+		fprintf(stderr, "Cannot start the workers.\n");
+		rc = 1;
+	}
+
+	while (rc == 0) {
+		pthread_mutex_lock(&(a.lock));
+		while (a.read - a.written == a.capacity)
+			pthread_cond_wait(&(a.changed), &(a.lock));
+		bool failed = a.failed;
+		pthread_mutex_unlock(&(a.lock));
+		if (failed)
+			break;
+
+		// the slot is free, and the reader's until it is counted
+		struct slot *slot = &(a.slots[a.read % a.capacity]);
+		bool end = false;
+		rc = read_entry(in, out_pic, slot, &end);
+		if (rc || end) {
+			free(slot->input);
+			slot->input = NULL;
+			break;
+		}
+
+		pthread_mutex_lock(&(a.lock));
+		a.read++;
+		pthread_cond_broadcast(&(a.changed));
+		pthread_mutex_unlock(&(a.lock));
+	}
+
+	pthread_mutex_lock(&(a.lock));
+	a.done = true;
+	pthread_cond_broadcast(&(a.changed));
+	pthread_mutex_unlock(&(a.lock));
+
+	for (unsigned i = 0; i < started; i++) {
+		pthread_join(pool[i].thread, NULL);
+		arena_free(pool[i].arena);
+	}
+	if (writing) {
+		pthread_join(writer, NULL);
+		rc |= a.rc;
+	}
+
+	// the end of the archive, two blocks of zeros
+	static const unsigned char zeros[2 * TAR_BLOCK];
+	if (writing && !a.failed && fwrite(zeros, sizeof(zeros), 1, out) != 1) {
+		print_error();
+		fprintf(stderr, "Cannot write the output archive.\n");
+		rc = 1;
+	}
+
+	pthread_cond_destroy(&(a.changed));
+	pthread_mutex_destroy(&(a.lock));
+	free(pool);
+	free(a.slots);
+	return rc;
+}
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_TAR_H
+#define PIXMAP565_TAR_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "convert.h"
+
+/*
+ * tar:
+ *
+ * Convert the files of a ustar archive into the files of another one,
+ * without unpacking them. The entries are read one after the other, each
+ * one is converted by a pool of workers from an in-memory stream into
+ * another, and the outputs are appended in the order of the inputs while
+ * the next entries are converted.
+ *
+ * The type of an input is that of its name, like -i. The outputs are
+ * renamed to the output type: PICTURE_EXTENSION is appended to, or removed
+ * from, the name, and the hard links to a renamed file are renamed like
+ * it. Directories and links are copied, other entries, like the pax and
+ * GNU extended headers, are refused.
+ */
+
+#define TAR_BLOCK 512u
+#define TAR_MAX_ENTRY (256u << 20)
+
+int tar_run(const struct options *opt, FILE *in, FILE *out, bool out_pic, unsigned workers);
+
+#endif /* PIXMAP565_TAR_H */
@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "arena.h"
+#include "file_utils.h"
+#include "format.h"
+#include "pixmap.h"
+#include "trim.h"
+
+struct border
+{
+	uint16_t key;
+	uint16_t alpha; // the alpha mask if transparent pixels are border, else 0
+};
+
+static bool is_border(const struct border *b, uint16_t pixel)
+{
+	return pixel == b->key || (b->alpha != 0 && (pixel & b->alpha) == 0);
+}
+
+// the number of border pixels at the start of the row
+static udword_t border_left(const struct border *b, const uint16_t *row, udword_t width)
+{
+	udword_t x = 0;
+#if defined(__SSE2__)
+	const __m128i key = _mm_set1_epi16((short)b->key);
+	const __m128i alpha = _mm_set1_epi16((short)b->alpha);
+	const __m128i transparent = _mm_set1_epi16(b->alpha != 0 ? -1 : 0);
+	for (; x + 8 <= width; x += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+		__m128i clear = _mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(v, alpha), _mm_setzero_si128()), transparent);
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi16(v, key), clear)) != 0xffff)
+			break;
+	}
+#endif
+	while (x < width && is_border(b, row[x]))
+		x++;
+	return x;
+}
+
+// the number of border pixels at the end of the row
+static udword_t border_right(const struct border *b, const uint16_t *row, udword_t width)
+{
+	udword_t x = width;
+#if defined(__SSE2__)
+	const __m128i key = _mm_set1_epi16((short)b->key);
+	const __m128i alpha = _mm_set1_epi16((short)b->alpha);
+	const __m128i transparent = _mm_set1_epi16(b->alpha != 0 ? -1 : 0);
+	for (; x >= 8; x -= 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(row + x - 8));
+		__m128i clear = _mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(v, alpha), _mm_setzero_si128()), transparent);
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi16(v, key), clear)) != 0xffff)
+			break;
+	}
+#endif
+	while (x > 0 && is_border(b, row[x - 1]))
+		x--;
+	return width - x;
+}
+
+/*
+ * The smallest box that holds every pixel that isn't border. Returns
+ * non-zero, with a 1x1 box, if the whole image is border.
+ */
+int trim_bounds(struct pixmap *pix, const struct pixel_format *format, struct region *box)
+{
+	assert(pix != NULL);
+	assert(format != NULL);
+	assert(box != NULL);
+
+	udword_t width = pixmap_get_x(pix);
+	udword_t height = pixmap_get_y(pix);
+	if (width == 0 || height == 0) {
+		*box = (struct region){0, 0, 0, 0};
+		return 1;
+	}
+	uint16_t **rows = pixmap_get_rows(pix);
+
+	struct border b = {
+		.key = rows[0][0],
+		.alpha = 0
+	};
+	if (format->mask[3] != 0 && (b.key & format->mask[3]) == 0)
+		b.alpha = format->mask[3];
+
+	// whole rows from the top and the bottom, then columns within them
+	udword_t top = 0;
+	while (top < height && border_left(&b, rows[top], width) == width)
+		top++;
+
+	int rc = 0;
+	if (top == height) {
+		*box = (struct region){0, 0, 1, 1};
+		rc = 1;
+		goto out;
+	}
+
+	udword_t bottom = height;
+	while (border_left(&b, rows[bottom - 1], width) == width)
+		bottom--;
+
+	udword_t left = width;
+	udword_t right = width;
+	for (udword_t y = top; y < bottom; y++) {
+		udword_t l = border_left(&b, rows[y], left);
+		if (l < left)
+			left = l;
+		udword_t r = border_right(&b, rows[y] + width - right, right);
+		if (r < right)
+			right = r;
+	}
+
+	box->x = left;
+	box->y = top;
+	box->width = width - left - right;
+	box->height = bottom - top;
+out:
+	free(rows);
+	return rc;
+}
+
+// replace *pix with the box of it
+void trim(struct pixmap **pix, const struct region *box, struct arena *arena)
+{
+	assert(pix != NULL);
+	assert(box != NULL);
+
+	uint16_t **rows = pixmap_get_rows(*pix);
+	struct pixmap *new = NULL;
+	pixmap_new(&new, box->width, arena);
+	for (udword_t y = 0; y < box->height; y++)
+		pixmap_add_row(new, rows[box->y + y] + box->x);
+	free(rows);
+
+	pixmap_free(*pix);
+	*pix = new;
+}
+
+// <name>.trim: where the box was, in an image of width x height
+int trim_write_sidecar(const char *name, const struct region *box, udword_t width, udword_t height)
+{
+	assert(name != NULL);
+	assert(box != NULL);
+	int rc = 0;
+
+	char *sidecar = malloc(strlen(name) + strlen(TRIM_EXTENSION) + 1);
+	if (sidecar == NULL)
+		abort();
+	strcpy(sidecar, name);
+	strcat(sidecar, TRIM_EXTENSION);
+
+	FILE *fp = fopen(sidecar, "wx");
+	if (fp == NULL) {
+		printf("Cannot open file '%s'\n", sidecar);
+		rc = 1;
+		goto out;
+	}
+	fprintf(fp, "x=%llu y=%llu width=%llu height=%llu original_width=%llu original_height=%llu\n",
+		(unsigned long long)box->x, (unsigned long long)box->y,
+		(unsigned long long)box->width, (unsigned long long)box->height,
+		(unsigned long long)width, (unsigned long long)height);
+	if (ferror(fp))
+		rc = 1;
+	if (fclose(fp) != 0)
+		rc = 1;
+out:
+	free(sidecar);
+	return rc;
+}
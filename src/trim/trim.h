@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_TRIM_H
+#define PIXMAP565_TRIM_H
+
+#include "arena.h"
+#include "file_utils.h"
+#include "pixmap.h"
+
+/*
+ * trim:
+ *
+ * Remove the uniform border of an image: the rows and columns of pixels
+ * equal to the top left one, or fully transparent if that one is.
+ */
+
+#define TRIM_EXTENSION ".trim"
+
+struct pixel_format;
+
+int trim_bounds(struct pixmap *pix, const struct pixel_format *format, struct region *box);
+void trim(struct pixmap **pix, const struct region *box, struct arena *arena);
+int trim_write_sidecar(const char *name, const struct region *box, udword_t width, udword_t height);
+
+#endif /* PIXMAP565_TRIM_H */
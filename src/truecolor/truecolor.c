@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "file_utils.h"
+#include "format.h"
+#include "jobs.h"
+#include "pixmap.h"
+#include "truecolor.h"
+
+// repeat the bits of a channel down to 8 bits, 31 becomes 255
+static unsigned widen(unsigned value, unsigned width)
+{
+	if (width == 0)
+		return 0;
+	if (width >= CHAR_BIT)
+		return value >> (width - CHAR_BIT);
+
+	unsigned wide = value << (CHAR_BIT - width);
+	for (unsigned n = width; n < CHAR_BIT; n *= 2)
+		wide |= wide >> n;
+	return wide & UCHAR_MAX;
+}
+
+// the RGB565 pixels that are a multiple of 8, the rest are left
+static udword_t expand_rgb565(const uint16_t *row, unsigned bits, unsigned char *out, udword_t count)
+{
+	udword_t i = 0;
+#if defined(__SSE2__)
+	const __m128i high5 = _mm_set1_epi16(0xf8);
+	const __m128i high6 = _mm_set1_epi16(0xfc);
+	const __m128i low3 = _mm_set1_epi16(0x07);
+	const __m128i low2 = _mm_set1_epi16(0x03);
+	const __m128i opaque = _mm_set1_epi16((short)0xff00);
+	for (; i + 8 <= count; i += 8) {
+		// rrrrrggg gggbbbbb
+		__m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+		__m128i r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 8), high5), _mm_srli_epi16(v, 13));
+		__m128i g = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 3), high6), _mm_and_si128(_mm_srli_epi16(v, 9), low2));
+		__m128i b = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(v, 3), high5), _mm_and_si128(_mm_srli_epi16(v, 2), low3));
+		__m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+		__m128i ra = _mm_or_si128(r, opaque);
+		__m128i lo = _mm_unpacklo_epi16(bg, ra);
+		__m128i hi = _mm_unpackhi_epi16(bg, ra);
+
+		unsigned char *dst = out + (size_t)i * (bits / CHAR_BIT);
+		if (bits == 32) {
+			_mm_storeu_si128((__m128i *)dst, lo);
+			_mm_storeu_si128((__m128i *)(dst + 16), hi);
+		} else {
+			// drop the alpha bytes of two little-endian pixels at a time
+			uint64_t pairs[4];
+			_mm_storeu_si128((__m128i *)pairs, lo);
+			_mm_storeu_si128((__m128i *)(pairs + 2), hi);
+			for (int k = 0; k < 4; k++) {
+				uint64_t bgr = (pairs[k] & 0xffffffu) | ((pairs[k] >> 8) & 0xffffff000000u);
+				memcpy(dst + 6 * k, &bgr, 6);
+			}
+		}
+	}
+#else
+	(void)row;
+	(void)bits;
+	(void)out;
+	(void)count;
+#endif
+	return i;
+}
+
+// expand count pixels of the format to 24 bit BGR or 32 bit BGRA
+void truecolor_expand(const uint16_t *row, const struct pixel_format *format, unsigned bits,
+	unsigned char *out, udword_t count)
+{
+	assert(row != NULL);
+	assert(format != NULL);
+	assert(bits == 24 || bits == 32);
+	assert(out != NULL);
+
+	udword_t i = 0;
+	if (format_equal(format, format_get(format_rgb565)))
+		i = expand_rgb565(row, bits, out, count);
+
+	size_t step = bits / CHAR_BIT;
+	for (; i < count; i++) {
+		unsigned char *dst = out + i * step;
+		for (int c = 0; c < 3; c++)
+			dst[2 - c] = widen((row[i] & format->mask[c]) >> format->shift[c], format->width[c]);
+		if (bits == 32 && format->width[3] == 0)
+			dst[3] = UCHAR_MAX;
+		else if (bits == 32)
+			dst[3] = widen((row[i] & format->mask[3]) >> format->shift[3], format->width[3]);
+	}
+}
+
+struct pack_ctx
+{
+	uint16_t **rows;
+	udword_t width;
+	udword_t height;
+	const struct pixel_format *format;
+	unsigned bits;
+	unsigned char *out;
+	size_t stride;
+};
+
+static int pack_band(void *arg, size_t index)
+{
+	struct pack_ctx *ctx = arg;
+	size_t last = (index + 1) * TRUECOLOR_BAND;
+	if (last > ctx->height)
+		last = ctx->height;
+
+	for (size_t y = index * TRUECOLOR_BAND; y < last; y++)
+		truecolor_expand(ctx->rows[y], ctx->format, ctx->bits, ctx->out + y * ctx->stride, ctx->width);
+	return 0;
+}
+
+/*
+ * The rows of pix as 24 or 32 bit pixels, top-down, each one padded with
+ * zero bytes to a multiple of alignment. Bands of rows are expanded in
+ * parallel.
+ */
+int truecolor_pack(struct pixmap *pix, const struct pixel_format *format, unsigned bits,
+	udword_t alignment, unsigned char **packed, size_t *stride)
+{
+	assert(pix != NULL);
+	assert(format != NULL);
+	assert(bits == 24 || bits == 32);
+	assert(alignment != 0);
+	assert(packed != NULL);
+	assert(stride != NULL);
+
+	struct pack_ctx ctx = {
+		.rows = pixmap_get_rows(pix),
+		.width = pixmap_get_x(pix),
+		.height = pixmap_get_y(pix),
+		.format = format,
+		.bits = bits
+	};
+	size_t bytes = (size_t)ctx.width * (bits / CHAR_BIT);
+	ctx.stride = (bytes + alignment - 1) / alignment * alignment;
+	ctx.out = calloc(ctx.stride * ctx.height + 1, 1);
+	if (ctx.out == NULL)
+		abort();
+
+	int rc = jobs_run((ctx.height + TRUECOLOR_BAND - 1) / TRUECOLOR_BAND, 0, pack_band, &ctx);
+
+	free(ctx.rows);
+	*packed = ctx.out;
+	*stride = ctx.stride;
+	return rc;
+}
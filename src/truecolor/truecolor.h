@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (c) 2021 Pierro Zachareas
+ */
+
+#ifndef PIXMAP565_TRUECOLOR_H
+#define PIXMAP565_TRUECOLOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_utils.h"
+#include "pixmap.h"
+
+/*
+ * truecolor:
+ *
+ * 24 or 32 bit BGR(A) pixels, for the pictures that every viewer shows.
+ * Each channel is widened to 8 bits by repeating its bits, so that the
+ * full 5 and 6 bit values are full 8 bit ones. A format without alpha is
+ * opaque.
+ */
+
+struct pixel_format;
+
+#define TRUECOLOR_BAND 64 // rows of one job
+
+void truecolor_expand(const uint16_t *row, const struct pixel_format *format, unsigned bits,
+	unsigned char *out, udword_t count);
+int truecolor_pack(struct pixmap *pix, const struct pixel_format *format, unsigned bits,
+	udword_t alignment, unsigned char **packed, size_t *stride);
+
+#endif /* PIXMAP565_TRUECOLOR_H */